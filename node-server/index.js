@@ -10,12 +10,58 @@ const app = express();
 const PORT = 3000;
 
 app.use(cors());
-app.use(express.json());
+app.use(express.json({ limit: '10mb' }));
 
 const wss = new WebSocketServer({ port: 3001 });
 
+// REST over the socket: {rpc, method, path, body} frames are replayed
+// against the HTTP routes on loopback, so both transports share one set of
+// handlers, and answered with {rpc, status, body, retryAfter} (the raw
+// Retry-After header). Clients skip a TCP/HTTP round trip per call and
+// keep many calls in flight on one connection.
+const MAX_RPC_IN_FLIGHT = 64;
+
 wss.on('connection', ws => {
-    ws.send(JSON.stringify({ event: "serverOnline" }));
+    ws.send(JSON.stringify({ event: "serverOnline", rpc: 1 }));
+
+    let inFlight = 0;
+    const reply = (rpc, status, body, retryAfter = '') => {
+      if (ws.readyState === ws.OPEN)
+        ws.send(JSON.stringify({ rpc, status, body, retryAfter }));
+    };
+
+    ws.on('message', async data => {
+      let call;
+      try {
+        call = JSON.parse(data.toString());
+      } catch {
+        return;
+      }
+      if (call == null || !Number.isInteger(call.rpc))
+        return;
+      const { rpc, method, path, body } = call;
+      if (typeof method !== 'string' || typeof path !== 'string' || !path.startsWith('/api/')) {
+        return reply(rpc, 400, JSON.stringify({ error: 'rpc needs a method and an /api/ path' }));
+      }
+      if (inFlight >= MAX_RPC_IN_FLIGHT) {
+        return reply(rpc, 503, JSON.stringify({ error: 'too many calls in flight' }), '1');
+      }
+
+      inFlight++;
+      try {
+        const hasBody = typeof body === 'string' && body.length > 0;
+        const res = await fetch(`http://127.0.0.1:${PORT}${path}`, {
+          method,
+          headers: hasBody ? { 'Content-Type': 'application/json' } : undefined,
+          body: hasBody ? body : undefined,
+        });
+        reply(rpc, res.status, await res.text(), res.headers.get('retry-after') ?? '');
+      } catch (err) {
+        reply(rpc, 502, JSON.stringify({ error: String(err) }));
+      } finally {
+        inFlight--;
+      }
+    });
 });
 
 // Connect to SQLite database
@@ -33,27 +79,216 @@ db.prepare(`
 `).run();
 
 
-// GET all users 
+// a user needs a string name and an integer age
+const isValidUser = (user) =>
+  user != null && typeof user.name === 'string' && Number.isInteger(user.age);
+
+// GET all users, or one keyset page of them:
+// ?after_id=X&before_id=Y&limit=N -> rows with X < id < Y ordered by id
+const MAX_PAGE = 10000;
+const selectPage = db.prepare('SELECT * FROM users WHERE id > ? AND id < ? ORDER BY id LIMIT ?');
+
+// single rows by id, clients with a bounded cache fetch evicted rows back
+const MAX_IDS = 1000;
+
 app.get('/api/users', (req, res) => {
-  const users = db.prepare('SELECT * FROM users ').all();
-  res.json(users);
+  const { after_id, before_id, limit, ids } = req.query;
+  if (ids !== undefined) {
+    const idList = String(ids).split(',').map((v) => Number.parseInt(v, 10));
+    if (idList.length > MAX_IDS || idList.some(Number.isNaN)) {
+      return res.status(400).json({ error: `ids must be up to ${MAX_IDS} comma separated integers` });
+    }
+    const placeholders = idList.map(() => '?').join(',');
+    return res.json(db.prepare(`SELECT * FROM users WHERE id IN (${placeholders}) ORDER BY id`).all(...idList));
+  }
+  if (after_id === undefined && before_id === undefined && limit === undefined) {
+    const users = db.prepare('SELECT * FROM users ').all();
+    return res.json(users);
+  }
+
+  const after = Number.parseInt(after_id ?? '0', 10);
+  const before = before_id === undefined ? Number.MAX_SAFE_INTEGER : Number.parseInt(before_id, 10);
+  const pageSize = Math.min(Number.parseInt(limit ?? '1000', 10), MAX_PAGE);
+  if ([after, before, pageSize].some(Number.isNaN) || pageSize <= 0) {
+    return res.status(400).json({ error: 'after_id, before_id and limit must be integers' });
+  }
+  res.json(selectPage.all(after, before, pageSize));
+});
+
+// id range + row count, lets clients split a snapshot into parallel slices
+app.get('/api/users/range', (req, res) => {
+  const range = db.prepare('SELECT MIN(id) AS min_id, MAX(id) AS max_id, COUNT(*) AS count FROM users').get();
+  res.json(range);
 });
 
 // POST a new item
 app.post('/api/users', (req, res) => {
+  if (!isValidUser(req.body)) {
+    return res.status(400).json({ error: 'expected { name: string, age: integer }' });
+  }
   const { name, age } = req.body;
   const stmt = db.prepare('INSERT INTO users  (name, age) VALUES (?, ?)');
   const info = stmt.run(name, age);
   const newUser = { id: info.lastInsertRowid, name, age };
+  toggleMerkleRow(newUser, 1);
   res.status(201).json(newUser);
 });
 
 
+// POST many users at once (bulk import / batched sync)
+// NB: one transaction, ids come back in request order
+const insertUser = db.prepare('INSERT INTO users  (name, age) VALUES (?, ?)');
+const insertUsers = db.transaction((users) =>
+  users.map(({ name, age }) => {
+    const info = insertUser.run(name, age);
+    return { id: info.lastInsertRowid, name, age };
+  })
+);
+
+app.post('/api/users/bulk', (req, res) => {
+  if (!Array.isArray(req.body) || !req.body.every(isValidUser)) {
+    return res.status(400).json({ error: 'expected an array of { name: string, age: integer }' });
+  }
+  // buckets only once the transaction committed
+  const users = insertUsers(req.body);
+  users.forEach((user) => toggleMerkleRow(user, 1));
+  res.status(201).json(users);
+});
+
+
+// Merkle reconciliation: every row hashes to FNV-1a 64 of "id:name:age"
+// (UTF-8), a range hashes to the XOR of its rows. Clients send ranges
+// (lo, hi] and get the hashes of their `fanout` equal-width children back,
+// then descend only into children that differ from their own replica.
+const MAX_MERKLE_RANGES = 256;
+const MAX_FANOUT = 64;
+const selectRange = db.prepare('SELECT id, name, age FROM users WHERE id > ? AND id <= ? ORDER BY id');
+
+// 64-bit FNV-1a on four 16-bit limbs, stays within double precision; the
+// client's LocalDB::rowHash must agree (qt-client/tests/tst_merkle.cpp)
+const fnv1a64 = (bytes) => {
+  let h0 = 0x2325, h1 = 0x8422, h2 = 0x9ce4, h3 = 0xcbf2;
+  for (const byte of bytes) {
+    h0 ^= byte;
+    // * 0x100000001b3
+    const t0 = h0 * 0x1b3;
+    const t1 = h1 * 0x1b3 + (t0 >>> 16);
+    const t2 = h2 * 0x1b3 + h0 * 0x100 + (t1 >>> 16);
+    const t3 = h3 * 0x1b3 + h1 * 0x100 + (t2 >>> 16);
+    h0 = t0 & 0xffff;
+    h1 = t1 & 0xffff;
+    h2 = t2 & 0xffff;
+    h3 = t3 & 0xffff;
+  }
+  return [((h3 << 16) | h2) >>> 0, ((h1 << 16) | h0) >>> 0];
+};
+
+const hex32 = (v) => v.toString(16).padStart(8, '0');
+
+const rowHash = ({ id, name, age }) => fnv1a64(Buffer.from(`${id}:${name ?? ''}:${age ?? 0}`, 'utf8'));
+
+// XOR of the rows with ids in (b * MERKLE_BUCKET_IDS, (b + 1) * MERKLE_BUCKET_IDS]
+// by bucket b, built once here and kept up to date by every route that
+// writes users (h ^= old ^ new), so a call only reads the rows at the edges
+// of its children
+const MERKLE_BUCKET_IDS = 64;
+const merkleBuckets = new Map();
+
+const toggleMerkleRow = (row, delta) => {
+  const id = Number(row.id);
+  if (!(id > 0))
+    return;
+  const key = Math.floor((id - 1) / MERKLE_BUCKET_IDS);
+  const bucket = merkleBuckets.get(key) ?? { count: 0, high: 0, low: 0 };
+  const [high, low] = rowHash(row);
+  bucket.high = (bucket.high ^ high) >>> 0;
+  bucket.low = (bucket.low ^ low) >>> 0;
+  bucket.count += delta;
+  if (bucket.count === 0)
+    merkleBuckets.delete(key);
+  else
+    merkleBuckets.set(key, bucket);
+};
+
+for (const row of db.prepare('SELECT id, name, age FROM users').iterate())
+  toggleMerkleRow(row, 1);
+
+const addRows = (child, from, to) => {
+  if (to <= from)
+    return;
+  for (const row of selectRange.iterate(from, to)) {
+    const [high, low] = rowHash(row);
+    child.high = (child.high ^ high) >>> 0;
+    child.low = (child.low ^ low) >>> 0;
+    child.count++;
+  }
+};
+
+const addBucket = (child, bucket) => {
+  child.high = (child.high ^ bucket.high) >>> 0;
+  child.low = (child.low ^ bucket.low) >>> 0;
+  child.count += bucket.count;
+};
+
+// same split as the client: width = ceil((hi - lo) / fanout)
+const childHashes = (lo, hi, fanout) => {
+  const width = Math.max(1, Math.ceil((hi - lo) / fanout));
+  const children = [];
+  for (let childLo = lo; childLo < hi; childLo += width)
+    children.push({ lo: childLo, hi: Math.min(hi, childLo + width), count: 0, high: 0, low: 0 });
+
+  for (const child of children) {
+    const firstBucket = Math.ceil(Math.max(0, child.lo) / MERKLE_BUCKET_IDS);
+    const endBucket = Math.floor(Math.max(0, child.hi) / MERKLE_BUCKET_IDS);
+    if (firstBucket >= endBucket) {
+      addRows(child, child.lo, child.hi);
+      continue;
+    }
+    // a wide range over a sparse table: walk the buckets that exist instead
+    if (endBucket - firstBucket > merkleBuckets.size) {
+      for (const [key, bucket] of merkleBuckets) {
+        if (key >= firstBucket && key < endBucket)
+          addBucket(child, bucket);
+      }
+    } else {
+      for (let key = firstBucket; key < endBucket; key++) {
+        const bucket = merkleBuckets.get(key);
+        if (bucket)
+          addBucket(child, bucket);
+      }
+    }
+    addRows(child, child.lo, firstBucket * MERKLE_BUCKET_IDS);
+    addRows(child, endBucket * MERKLE_BUCKET_IDS, child.hi);
+  }
+  return children.map((c) => [c.lo, c.hi, c.count, hex32(c.high) + hex32(c.low)]);
+};
+
+// body: { fanout, ranges: [[lo, hi], ...] } -> [[[lo, hi, count, hash], ...], ...]
+app.post('/api/users/merkle', (req, res) => {
+  const { fanout, ranges } = req.body ?? {};
+  const validRange = (r) => Array.isArray(r) && r.length === 2
+    && Number.isSafeInteger(r[0]) && Number.isSafeInteger(r[1]) && r[0] < r[1];
+  if (!Number.isInteger(fanout) || fanout < 2 || fanout > MAX_FANOUT
+      || !Array.isArray(ranges) || ranges.length > MAX_MERKLE_RANGES || !ranges.every(validRange)) {
+    return res.status(400).json({ error: `expected { fanout: 2..${MAX_FANOUT}, ranges: up to ${MAX_MERKLE_RANGES} [lo, hi] pairs }` });
+  }
+  res.json(ranges.map(([lo, hi]) => childHashes(lo, hi, fanout)));
+});
+
+
 // PUT: update item
+const selectUser = db.prepare('SELECT id, name, age FROM users WHERE id = ?');
+
 app.put('/api/users/:id', (req, res) => {
   const id = req.params.id;
   const {name, age } = req.body;
-  db.prepare('UPDATE users SET name = ?, age = ? WHERE id = ?').run(name, age, id);
+  const before = selectUser.get(id);
+  const info = db.prepare('UPDATE users SET name = ?, age = ? WHERE id = ?').run(name, age, id);
+  if (info.changes > 0) {
+    // hashed as stored, after SQLite's type conversion
+    toggleMerkleRow(before, -1);
+    toggleMerkleRow(selectUser.get(id), 1);
+  }
   res.json({ id, name, age });
 });
 
@@ -61,8 +296,12 @@ app.put('/api/users/:id', (req, res) => {
 // DELETE an item by ID
 app.delete('/api/users/:id', (req, res) => {
   const id = req.params.id;
-  db.prepare('DELETE FROM users WHERE id = ?').run(id);
-  res.status(204).send();
+  const before = selectUser.get(id);
+  const info = db.prepare('DELETE FROM users WHERE id = ?').run(id);
+  if (info.changes > 0)
+    toggleMerkleRow(before, -1);
+  // 404 lets clients tell "already gone" apart from a failed delete
+  res.status(info.changes > 0 ? 204 : 404).send();
 });
 
 
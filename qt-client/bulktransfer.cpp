@@ -0,0 +1,237 @@
+#include "bulktransfer.h"
+#include "localdb.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QList>
+
+namespace {
+
+// how far a quoted field may carry a CSV record over line breaks; past
+// that the quote is taken as a stray one and only its line is dropped
+const int kMaxCsvRecordLines = 100;
+const int kMaxCsvRecordBytes = 64 * 1024;
+
+// one CSV record (quoted fields, "" escapes), line breaks inside quoted
+// fields included
+QList<QByteArray> splitCsvRecord(const QByteArray &line)
+{
+    QList<QByteArray> fields;
+    QByteArray field;
+    bool quoted = false;
+
+    for (int i = 0; i < line.size(); ++i)
+    {
+        const char c = line.at(i);
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line.at(i + 1) == '"') {
+                field.append('"');
+                ++i;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field.append(c);
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.append(field);
+            field.clear();
+        } else if (c != '\r' && c != '\n') {
+            field.append(c);
+        }
+    }
+    fields.append(field);
+    return fields;
+}
+
+// strips "\n" or "\r\n" only: spaces belong to the fields
+void chopLineEnd(QByteArray &line)
+{
+    if (line.endsWith('\n'))
+        line.chop(1);
+    if (line.endsWith('\r'))
+        line.chop(1);
+}
+
+QByteArray csvField(const QString &value)
+{
+    QByteArray utf8 = value.toUtf8();
+    if (!utf8.contains(',') && !utf8.contains('"') && !utf8.contains('\n') && !utf8.contains('\r'))
+        return utf8;
+
+    utf8.replace("\"", "\"\"");
+    return '"' + utf8 + '"';
+}
+
+}
+
+BulkTransfer::BulkTransfer(LocalDB *db)
+    : m_db(db)
+{
+}
+
+void BulkTransfer::setChunkSize(int rows)
+{
+    m_chunkSize = qMax(1, rows);
+}
+
+int BulkTransfer::chunkSize() const
+{
+    return m_chunkSize;
+}
+
+BulkTransfer::Format BulkTransfer::formatForPath(const QString &path)
+{
+    return path.endsWith(".csv", Qt::CaseInsensitive) ? Csv : Ndjson;
+}
+
+BulkTransfer::Result BulkTransfer::importFile(const QString &path, Format format)
+{
+    Result result;
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        result.error = file.errorString();
+        return result;
+    }
+
+    // CSV columns come from the header when there is one
+    int nameColumn = 0;
+    int ageColumn = 1;
+    bool firstLine = true;
+
+    UserRecords chunk;
+    chunk.reserve(m_chunkSize);
+
+    auto commitChunk = [&]() {
+        if (chunk.isEmpty())
+            return true;
+        if (m_db->insertPendingUsers(chunk) != chunk.size())
+            return false;
+        result.rows += chunk.size();
+        chunk.clear();
+        return true;
+    };
+
+    while (!file.atEnd())
+    {
+        QByteArray line = file.readLine();
+        // an odd number of quotes leaves a quoted field open: its line
+        // break is part of the value, the record goes on
+        if (format == Csv) {
+            const qint64 nextLine = file.pos();
+            qint64 quotes = line.count('"');
+            int lines = 1;
+            while (quotes % 2 != 0 && !file.atEnd()
+                   && lines < kMaxCsvRecordLines && line.size() < kMaxCsvRecordBytes) {
+                const QByteArray next = file.readLine();
+                quotes += next.count('"');
+                line += next;
+                lines++;
+            }
+            if (quotes % 2 != 0) {
+                // never closed: skip the line, the ones after it are records
+                result.skipped++;
+                if (!file.seek(nextLine)) {
+                    result.error = file.errorString();
+                    result.elapsedMs = timer.elapsed();
+                    return result;
+                }
+                continue;
+            }
+        }
+        chopLineEnd(line);
+        if (line.trimmed().isEmpty())
+            continue;
+
+        UserRecord user;
+        if (format == Ndjson)
+        {
+            const QJsonObject o = QJsonDocument::fromJson(line).object();
+            if (!o.contains("name")) {
+                result.skipped++;
+                continue;
+            }
+            user.name = o["name"].toString();
+            user.age = o["age"].toInt();
+        }
+        else
+        {
+            const QList<QByteArray> fields = splitCsvRecord(line);
+            if (firstLine) {
+                firstLine = false;
+                const int n = fields.indexOf("name");
+                if (n >= 0) {
+                    nameColumn = n;
+                    ageColumn = fields.indexOf("age");
+                    continue;
+                }
+            }
+            if (nameColumn >= fields.size()) {
+                result.skipped++;
+                continue;
+            }
+            user.name = QString::fromUtf8(fields.at(nameColumn));
+            user.age = ageColumn >= 0 && ageColumn < fields.size() ? fields.at(ageColumn).toInt() : 0;
+        }
+
+        chunk.append(std::move(user));
+        if (chunk.size() >= m_chunkSize && !commitChunk()) {
+            result.error = QStringLiteral("import chunk failed after %1 rows").arg(result.rows);
+            result.elapsedMs = timer.elapsed();
+            return result;
+        }
+    }
+
+    result.ok = commitChunk();
+    if (!result.ok)
+        result.error = QStringLiteral("import chunk failed after %1 rows").arg(result.rows);
+    result.elapsedMs = timer.elapsed();
+    return result;
+}
+
+BulkTransfer::Result BulkTransfer::exportFile(const QString &path, Format format)
+{
+    Result result;
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        result.error = file.errorString();
+        return result;
+    }
+
+    if (format == Csv)
+        file.write("id,name,age\n");
+
+    bool writeOk = true;
+    result.ok = m_db->forEachUser([&](UserRecord &&user) {
+        QByteArray line;
+        if (format == Ndjson) {
+            QJsonObject o;
+            o["id"] = user.id;
+            o["name"] = user.name;
+            o["age"] = user.age;
+            line = QJsonDocument(o).toJson(QJsonDocument::Compact);
+        } else {
+            line = QByteArray::number(user.id) + ',' + csvField(user.name) + ',' + QByteArray::number(user.age);
+        }
+        line.append('\n');
+
+        writeOk = file.write(line) == line.size();
+        result.rows++;
+        return writeOk;
+    });
+
+    if (!writeOk) {
+        result.ok = false;
+        result.error = file.errorString();
+    }
+    result.elapsedMs = timer.elapsed();
+    return result;
+}
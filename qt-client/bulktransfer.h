@@ -0,0 +1,43 @@
+#ifndef BULKTRANSFER_H
+#define BULKTRANSFER_H
+
+#include <QString>
+
+class LocalDB;
+
+// Streams users between NDJSON/CSV files and the local replica. Imports are
+// read and committed chunk by chunk as pending inserts, so they reach the
+// server with the next (batched) sync run; exports never hold more than
+// one row in memory. A CSV quote left open for more than a bounded number
+// of lines counts its line as skipped instead of swallowing the file.
+class BulkTransfer
+{
+public:
+    enum Format { Ndjson, Csv };
+
+    struct Result
+    {
+        bool ok = false;
+        qint64 rows = 0;
+        qint64 skipped = 0;
+        qint64 elapsedMs = 0;
+        QString error;
+    };
+
+    explicit BulkTransfer(LocalDB *db);
+
+    void setChunkSize(int rows);
+    int chunkSize() const;
+
+    // .csv -> Csv, anything else -> Ndjson
+    static Format formatForPath(const QString &path);
+
+    Result importFile(const QString &path, Format format);
+    Result exportFile(const QString &path, Format format);
+
+private:
+    LocalDB *m_db;
+    int m_chunkSize = 10000;
+};
+
+#endif // BULKTRANSFER_H
@@ -3,17 +3,30 @@
 
 DbUser::DbUser(QObject *parent)
     : QObject(parent),
+    m_name(0),
     m_age(0),
-    m_tableId(0)
+    m_tableId(0),
+    m_loaded(true),
+    m_stale(false)
 {
 }
 
 QString DbUser::name() const
 {
-    return m_name;
+    return NamePool::shared().toString(m_name);
 }
 
 void DbUser::setName(const QString &name)
+{
+    m_name = NamePool::shared().intern(name);
+}
+
+NamePool::Handle DbUser::nameHandle() const
+{
+    return m_name;
+}
+
+void DbUser::setNameHandle(NamePool::Handle name)
 {
     m_name = name;
 }
@@ -37,3 +50,23 @@ void DbUser::setTableId(int id)
 {
     m_tableId = id;
 }
+
+bool DbUser::isLoaded() const
+{
+    return m_loaded;
+}
+
+void DbUser::setLoaded(bool loaded)
+{
+    m_loaded = loaded;
+}
+
+bool DbUser::isStale() const
+{
+    return m_stale;
+}
+
+void DbUser::setStale(bool stale)
+{
+    m_stale = stale;
+}
@@ -3,6 +3,7 @@
 
 #include <QObject>
 #include <QString>
+#include "namepool.h"
 
 class DbUser : public QObject
 {
@@ -11,8 +12,12 @@ class DbUser : public QObject
 public:
     explicit DbUser(QObject *parent = nullptr);
 
+    // the name is a handle into NamePool::shared(); name() builds the
+    // QString, setName() interns
     QString name() const;
     void setName(const QString &name);
+    NamePool::Handle nameHandle() const;
+    void setNameHandle(NamePool::Handle name);
 
     int age() const;
     void setAge(int age);
@@ -20,10 +25,21 @@ public:
     int tableId() const;
     void setTableId(int id);
 
+    // false for rows evicted from the local cache: only the id is known
+    bool isLoaded() const;
+    void setLoaded(bool loaded);
+
+    // evicted, but name and age are kept as the last known values so a
+    // view sorted by them keeps the row in place
+    bool isStale() const;
+    void setStale(bool stale);
+
 private:
-    QString m_name;
+    NamePool::Handle m_name;
     int m_age;
     int m_tableId;
+    bool m_loaded;
+    bool m_stale;
 };
 
 #endif // DBUSER_H
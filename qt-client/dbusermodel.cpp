@@ -1,46 +1,43 @@
 #include "DbUserModel.h"
-#include <QNetworkAccessManager>
-#include <QNetworkReply>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonArray>
+#include "trace.h"
 #include <QDebug>
+#include <algorithm>
+#include <functional>
+
+namespace {
+// rows a view asks for within one frame are fetched together
+const int kFetchDelayMs = 16;
+// LRU access times are written back at most once a second
+const int kTouchDelayMs = 1000;
+}
 
 DbUserModel::DbUserModel(QObject *parent)
     : QAbstractListModel(parent)
 {
-    mpManager = make_unique<QNetworkAccessManager>();
+    mFetchTimer.setSingleShot(true);
+    mFetchTimer.setInterval(kFetchDelayMs);
+    connect(&mFetchTimer, &QTimer::timeout, this, &DbUserModel::fetchWantedRows);
 
-    // init local db
-    initLocalDb();
+    mTouchTimer.setSingleShot(true);
+    mTouchTimer.setInterval(kTouchDelayMs);
+    connect(&mTouchTimer, &QTimer::timeout, this, &DbUserModel::flushTouchedRows);
 
-    // init websocket
-    initSocketClient();
+    // changes of one event loop pass leave as few dataChanged as possible
+    mChangeTimer.setSingleShot(true);
+    mChangeTimer.setInterval(0);
+    connect(&mChangeTimer, &QTimer::timeout, this, &DbUserModel::flushChangedRows);
 
-    // load data from server (if online)
-    getUsers();
+    // init local db + websocket, load data from server (if online)
+    initSyncEngine();
 }
 
 DbUserModel::~DbUserModel()
 {
-    qDeleteAll(mUserList);
-    mUserList.clear();
-}
-
-void DbUserModel::testPendingOps()
-{
-    // Simulate offline insert
-    handleInsertOffline("OfflineUser1", 25);
-    handleInsertOffline("OfflineUser2", 30);
+    // commit what is still buffered
+    flushTouchedRows();
+    mpSyncEngine.reset();
 
-    // simulate offline delete
-    handleDeleteOffline(-1);  // -1 for testing temp ID
-
-    // check pending ops
-    auto ops = mpLocalDB->loadPendingOperations();
-    qDebug() << "Pending ops after inserts/deletes:";
-    for (auto &op : ops)
-        qDebug() << op;
+    clearUsers();
 }
 
 QHash<int, QByteArray> DbUserModel::roleNames() const
@@ -66,488 +63,688 @@ QVariant DbUserModel::data(const QModelIndex &index, int role) const
     const DbUser *u = mUserList.at(index.row());
     if (!u) return QVariant();
 
-    if (role == nameRole) return u->name();
-    if (role == ageRole) return u->age();
     if (role == tableIdRole) return u->tableId();
 
+    if (role == nameRole || role == ageRole) {
+        // one lookup per row: the name is asked first by the delegate
+        if (!accessRow(u, role == nameRole))
+            return QVariant();
+        return role == nameRole ? QVariant(u->name()) : QVariant(u->age());
+    }
+
     return QVariant();
 }
 
-void DbUserModel::initLocalDb()
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+void DbUserModel::multiData(const QModelIndex &index, QModelRoleDataSpan roleDataSpan) const
 {
-    if (!mpLocalDB)
-        mpLocalDB = make_unique<LocalDB>(this);
-
-    if (!mpLocalDB->open())
-    {
-        qWarning() << "LocalDB open failed"; 
+    const DbUser *u = index.isValid() && index.row() >= 0 && index.row() < mUserList.size()
+                          ? mUserList.at(index.row()) : nullptr;
+    if (!u) {
+        for (QModelRoleData &roleData : roleDataSpan)
+            roleData.clearData();
+        return;
     }
 
-    mpLocalDB->createTable();
-    loadLocalUsers();
+    // all roles of a delegate in one call, one cache lookup for the row
+    bool loaded = false;
+    bool accessed = false;
+    for (QModelRoleData &roleData : roleDataSpan) {
+        const int role = roleData.role();
+        if ((role == nameRole || role == ageRole) && !accessed) {
+            loaded = accessRow(u, true);
+            accessed = true;
+        }
+
+        if (role == tableIdRole)
+            roleData.setData(u->tableId());
+        else if (role == nameRole && loaded)
+            roleData.setData(u->name());
+        else if (role == ageRole && loaded)
+            roleData.setData(u->age());
+        else
+            roleData.clearData();
+    }
 }
+#endif
 
-void DbUserModel::loadLocalUsers()
+bool DbUserModel::accessRow(const DbUser *u, bool countLookup) const
 {
-    auto list = mpLocalDB->loadUsers();
-    beginResetModel();
-    qDeleteAll(mUserList);
-    mUserList.clear();
-    for (const QVariantMap &m : list) {
-        DbUser *u = new DbUser();
-        u->setTableId(m["id"].toInt());
-        u->setName(m["name"].toString());
-        u->setAge(m["age"].toInt());
-        mUserList.append(u);
+    if (u->isLoaded()) {
+        if (countLookup) {
+            mCacheHits++;
+            mTouched.insert(u->tableId());
+            if (!mTouchTimer.isActive())
+                mTouchTimer.start();
+        }
+        return true;
     }
-    endResetModel();
+
+    if (countLookup)
+        mCacheMisses++;
+    mFetchWanted.insert(u->tableId());
+    if (!mFetchTimer.isActive())
+        mFetchTimer.start();
+    return false;
 }
 
-void DbUserModel::initSocketClient()
+void DbUserModel::notifyChanged(DbUser *u, int roles)
 {
-    if (!mpSocketClient)
-        mpSocketClient = make_unique<WebSocketClient>(QUrl(WEBSOCKET_URL));
+    mChangedRoles[u] |= roles;
+    if (!mChangeTimer.isActive())
+        mChangeTimer.start();
+}
 
-    // SERVER ONLINE: sync pending ops + update gui
-    connect(mpSocketClient.get(), &WebSocketClient::serverOnline,
-            this, &DbUserModel::onServerOnline);
+void DbUserModel::flushChangedRows()
+{
+    if (mChangedRoles.isEmpty())
+        return;
 
-    // SERVER OFFLINE: notify offline state
-    connect(mpSocketClient.get(), &WebSocketClient::serverOffline, [this](){
-        mServerOnline = false;
-        qDebug() << "Server offline!";
-    });
+    UM_TRACE_SCOPE("DbUserModel::flushChangedRows");
+    // rows may have moved since: resolve them now, by binary search when
+    // sorted, in one scan otherwise
+    QVector<QPair<int, int>> changed;
+    changed.reserve(mChangedRoles.size());
+    if (mSortMode == Unsorted) {
+        for (int row = 0; row < mUserList.size(); ++row) {
+            auto it = mChangedRoles.constFind(mUserList.at(row));
+            if (it != mChangedRoles.constEnd())
+                changed.append({ row, it.value() });
+        }
+    } else {
+        for (auto it = mChangedRoles.cbegin(); it != mChangedRoles.cend(); ++it)
+            changed.append({ rowOfUser(it.key()), it.value() });
+        std::sort(changed.begin(), changed.end());
+    }
+    mChangedRoles.clear();
+
+    // one signal per run of adjacent rows with the same roles
+    int first = 0;
+    for (int i = 1; i <= changed.size(); ++i) {
+        if (i < changed.size() && changed.at(i).first == changed.at(i - 1).first + 1
+            && changed.at(i).second == changed.at(first).second)
+            continue;
+
+        const int roles = changed.at(first).second;
+        QVector<int> roleList;
+        if (roles & NameChanged)
+            roleList.append(nameRole);
+        if (roles & AgeChanged)
+            roleList.append(ageRole);
+        if (roles & TableIdChanged)
+            roleList.append(tableIdRole);
+
+        mDataChangedSignals++;
+        emit dataChanged(index(changed.at(first).first), index(changed.at(i - 1).first), roleList);
+        first = i;
+    }
+}
 
-    mpSocketClient->start();
+void DbUserModel::initSyncEngine()
+{
+    if (!mpSyncEngine)
+        mpSyncEngine = make_unique<SyncEngine>();
+
+    // local mutations and sync results update single rows
+    connect(mpSyncEngine.get(), &SyncEngine::userInserted,
+            this, &DbUserModel::appendUserRow);
+    connect(mpSyncEngine.get(), &SyncEngine::userRemoved,
+            this, &DbUserModel::removeUserRow);
+    connect(mpSyncEngine.get(), &SyncEngine::userIdReplaced,
+            this, &DbUserModel::replaceUserRowId);
+
+    // full snapshot from the server, or one page of it at a time
+    connect(mpSyncEngine.get(), &SyncEngine::usersReceived,
+            this, &DbUserModel::createList);
+    connect(mpSyncEngine.get(), &SyncEngine::usersPageReceived,
+            this, &DbUserModel::applyUsersPage);
+
+    // bounded cache
+    connect(mpSyncEngine.get(), &SyncEngine::usersEvicted,
+            this, &DbUserModel::markRowsEvicted);
+    connect(mpSyncEngine.get(), &SyncEngine::usersFetched,
+            this, &DbUserModel::fillFetchedRows);
+    connect(mpSyncEngine.get(), &SyncEngine::usersFetchFailed,
+            this, &DbUserModel::clearFetchInFlight);
+
+    // shared replica: another process may be syncing the same file
+    connect(mpSyncEngine.get(), &SyncEngine::usersChanged,
+            this, &DbUserModel::applyChangedUsers);
+    connect(mpSyncEngine.get(), &SyncEngine::replicaReset,
+            this, &DbUserModel::loadLocalUsers);
+    mpSyncEngine->setSharedReplica(qEnvironmentVariableIsSet("USERMANAGER_SHARED_REPLICA"));
+    // CRUD and sync go over the WebSocket when it is up, REST otherwise
+    mpSyncEngine->setUseRpc(!qEnvironmentVariableIsSet("USERMANAGER_NO_RPC"));
+    // pending ops in a segment log instead of the pending_ops table
+    mpSyncEngine->setOutboxLogDirectory(qEnvironmentVariable("USERMANAGER_OUTBOX_LOG"));
+
+    mpSyncEngine->start();
+    loadLocalUsers();
+}
+
+void DbUserModel::loadLocalUsers()
+{
+    UM_TRACE_SCOPE("DbUserModel::loadLocalUsers");
+    beginResetModel();
+    clearUsers();
+    const int count = mpSyncEngine->localDb()->countUsers();
+    mUserList.reserve(count);
+
+    // straight from the cursor into the rows, no intermediate list and no
+    // QString per row; sorted views read through the matching index
+    const UserOrder order = mSortMode == SortByName ? UserOrder::ByName
+                          : mSortMode == SortByAge ? UserOrder::ByAge
+                          : UserOrder::ById;
+    mpSyncEngine->localDb()->forEachPooledUser(NamePool::shared(), [this](const PooledUserRecord &user) {
+        mUserList.append(newUser(user.id, user.name, user.age));
+        return true;
+    }, order);
+
+    // evicted rows: id only, the rest comes from the server on demand
+    const QList<int> evicted = mpSyncEngine->localDb()->loadEvictedIds();
+    for (int id : evicted) {
+        DbUser *u = newUser(id, 0, 0);
+        u->setLoaded(false);
+        mUserList.append(u);
+    }
+    sortUsers();
+    mFetchInFlight.clear();
+    endResetModel();
 }
 
 void DbUserModel::addUser(const QString &name, int age, int tableId, bool insertRows)
 {
+    const NamePool::Handle handle = NamePool::shared().intern(name);
     auto it = std::find_if(mUserList.begin(), mUserList.end(), [&](DbUser* el){
-        return el->name() == name && el->age() == age;
+        return el->nameHandle() == handle && el->age() == age;
     });
 
     if (it == mUserList.end()) {
+        DbUser *u = newUser(tableId, handle, age);
         if (insertRows)
-            beginInsertRows(QModelIndex(), rowCount(), rowCount());
-
-        DbUser *u = new DbUser();
-        u->setName(name);
-        u->setAge(age);
-        u->setTableId(tableId);
-        mUserList.append(u);
-
-        if (insertRows)
-            endInsertRows();
+            insertUserRow(u);
+        else
+            mUserList.append(u);
     }
 }
 
-void DbUserModel::createListFromLocalDb()
+int DbUserModel::rowForTableId(int id) const
 {
-    loadLocalUsers();
+    const DbUser *u = mUserById.value(id);
+    return u ? rowOfUser(u) : -1;
 }
 
-void DbUserModel::createList(const QByteArray &jsonData)
+void DbUserModel::appendUserRow(int id, const QString &name, int age)
 {
-    QJsonDocument doc = QJsonDocument::fromJson(jsonData);
-    if (!doc.isArray()) {
-        qWarning() << "Expected array from server";
+    // a snapshot page may have brought the row before the POST reply
+    if (mUserById.contains(id))
         return;
-    }
 
-    QJsonArray arr = doc.array();
-    beginResetModel();
-    qDeleteAll(mUserList);
-    mUserList.clear();
+    // appended when unsorted, at its sorted position otherwise
+    insertUserRow(newUser(id, NamePool::shared().intern(name), age));
+}
 
-    for (const QJsonValue &v : arr) {
-        if (!v.isObject()) continue;
-        QJsonObject o = v.toObject();
-        QString name = o["name"].toString();
-        int age = o["age"].toInt();
-        int id = o["id"].toInt();
+void DbUserModel::removeUserRow(int id)
+{
+    int row = rowForTableId(id);
+    if (row < 0)
+        return;
 
-        // save local copy
-        mpLocalDB->saveUser(name, age, id);
+    removeUserAt(row);
+}
 
-        DbUser *u = new DbUser();
-        u->setName(name);
-        u->setAge(age);
-        u->setTableId(id);
-        mUserList.append(u);
-    }
-    endResetModel();
+void DbUserModel::replaceUserRowId(int oldId, int newId)
+{
+    int row = rowForTableId(oldId);
+    if (row < 0)
+        return;
+
+    DbUser *u = mUserList.at(row);
+    mUserById.remove(oldId);
+    u->setTableId(newId);
+    mUserById.insert(newId, u);
+    notifyChanged(u, TableIdChanged);
+
+    // the id orders SortById and breaks ties in the others
+    moveToSortedRow(row);
 }
 
-void DbUserModel::sendUserToServer(const QString &name, int age)
+DbUser *DbUserModel::newUser(int id, NamePool::Handle name, int age)
 {
-    qDebug() << "sendUserToServer:" << name << age;
+    DbUser *u = new DbUser();
+    u->setNameHandle(name);
+    u->setAge(age);
+    u->setTableId(id);
+    mUserById.insert(id, u);
+    return u;
+}
 
-    // === CASE A : SERVER ONLINE ===
-    if (mServerOnline)
-    {
-        QUrl url(SERVER_URL);
-        QNetworkRequest request(url);
-        request.setHeader(QNetworkRequest::ContentTypeHeader,
-                          "application/json");
-
-        QJsonObject userJson;
-        userJson["name"] = name;
-        userJson["age"] = age;
-
-        QNetworkReply *reply = mpManager->sendCustomRequest(
-            request,
-            "POST",
-            QJsonDocument(userJson).toJson()
-            );
-
-        QObject::connect(reply, &QNetworkReply::finished,
-            [this, reply]() {
-
-                if (reply->error() == QNetworkReply::NoError)
-                {
-                    QByteArray data = reply->readAll();
-                    QJsonDocument doc = QJsonDocument::fromJson(data);
-                    QJsonObject obj = doc.object();
-
-                    QString name = obj["name"].toString();
-                    int age = obj["age"].toInt();
-                    int serverId = obj["id"].toInt();
-
-                    // salva su db locale
-                    mpLocalDB->saveUser(name, age, serverId);
-
-                    // aggiorna UI
-                    getUsers();
-                }
-                else
-                {
-                    qWarning() << "POST error:" << reply->errorString();
-                    // fallback offline
-                    handleInsertOffline("fallbackName", 0);
-                }
-
-                reply->deleteLater();
-            });
+void DbUserModel::clearUsers()
+{
+    qDeleteAll(mUserList);
+    mUserList.clear();
+    mUserById.clear();
+    mChangedRoles.clear();
+}
 
-        return;
+void DbUserModel::insertUserRow(DbUser *u)
+{
+    int row = mUserList.size();
+    if (mSortMode != Unsorted) {
+        auto less = [this](const DbUser *a, const DbUser *b) { return lessThan(a, b); };
+        row = int(std::lower_bound(mUserList.cbegin(), mUserList.cend(), u, less) - mUserList.cbegin());
     }
 
-    // === CASE B : SERVER OFFLINE ===
-    handleInsertOffline(name, age);
+    beginInsertRows(QModelIndex(), row, row);
+    mUserList.insert(row, u);
+    endInsertRows();
 }
 
-
-void DbUserModel::handleInsertOffline(const QString &name, int age)
+void DbUserModel::removeUserAt(int row)
 {
-    qDebug() << "Handling insert offline, name =" << name << " age =" << age;
+    beginRemoveRows(QModelIndex(), row, row);
+    DbUser *u = mUserList.takeAt(row);
+    mUserById.remove(u->tableId());
+    mChangedRoles.remove(u);
+    delete u;
+    endRemoveRows();
+}
 
-    int tempId = mpLocalDB->generateTempId();
+void DbUserModel::setUserValues(int row, NamePool::Handle name, int age)
+{
+    DbUser *u = mUserList.at(row);
+    u->setNameHandle(name);
+    u->setAge(age);
+    u->setLoaded(true);
+    u->setStale(false);
+    notifyChanged(u, NameChanged | AgeChanged);
+
+    moveToSortedRow(row);
+}
 
-    // save locally
-    mpLocalDB->saveUser(name, age, tempId);
+void DbUserModel::moveToSortedRow(int row)
+{
+    if (mSortMode == Unsorted)
+        return;
 
-    // save pending op
-    mpLocalDB->addPendingOperation("insert", 0, tempId, name, age);
+    // everything but this row is in order: search the side it belongs to
+    DbUser *u = mUserList.at(row);
+    auto less = [this](const DbUser *a, const DbUser *b) { return lessThan(a, b); };
+    int dest = row;
+    if (row > 0 && lessThan(u, mUserList.at(row - 1)))
+        dest = int(std::lower_bound(mUserList.cbegin(), mUserList.cbegin() + row, u, less) - mUserList.cbegin());
+    else if (row + 1 < mUserList.size() && lessThan(mUserList.at(row + 1), u))
+        dest = int(std::lower_bound(mUserList.cbegin() + row + 1, mUserList.cend(), u, less) - mUserList.cbegin());
+    if (dest == row)
+        return;
 
-    // reload UI
-    createListFromLocalDb();
+    // dest is the row it lands in front of, counted before the move
+    beginMoveRows(QModelIndex(), row, row, QModelIndex(), dest);
+    mUserList.move(row, dest > row ? dest - 1 : dest);
+    endMoveRows();
 }
 
-void DbUserModel::handleDeleteOffline(int id)
+int DbUserModel::rowOfUser(const DbUser *u) const
 {
-    qDebug() << "Handling delete offline, id =" << id;
-    if (id < 0) {
-        // remove local unsynced insert
-        mpLocalDB->deleteUser(id);
-        mpLocalDB->removePendingInsertForLocalTempId(id);
-        createListFromLocalDb();
-        return;
+    if (mSortMode != Unsorted) {
+        auto less = [this](const DbUser *a, const DbUser *b) { return lessThan(a, b); };
+        auto it = std::lower_bound(mUserList.cbegin(), mUserList.cend(), u, less);
+        if (it != mUserList.cend() && *it == u)
+            return int(it - mUserList.cbegin());
     }
-    // add pending delete
-    mpLocalDB->addPendingOperation("delete", id, -1, "", -1);
-    mpLocalDB->deleteUser(id);
-    createListFromLocalDb();
+    return mUserList.indexOf(const_cast<DbUser*>(u));
 }
 
-void DbUserModel::deleteUserFromServer(int id)
+bool DbUserModel::lessThan(const DbUser *a, const DbUser *b) const
 {
-    if (mServerOnline)
-    {
-        // ------- SERVER ONLINE: normal DELETE -------
+    if (sortsByValue()) {
+        // rows evicted before this run have no values yet: last, by id
+        const bool aKnown = a->isLoaded() || a->isStale();
+        const bool bKnown = b->isLoaded() || b->isStale();
+        if (aKnown != bKnown)
+            return aKnown;
+
+        if (aKnown && mSortMode == SortByName) {
+            const int c = NamePool::shared().compare(a->nameHandle(), b->nameHandle());
+            if (c != 0)
+                return c < 0;
+        } else if (aKnown && a->age() != b->age()) {
+            return a->age() < b->age();
+        }
+    }
+    return a->tableId() < b->tableId();
+}
 
-        QUrl url(QString("%1/%2").arg(SERVER_URL).arg(id));
-        QNetworkRequest request(url);
+bool DbUserModel::sortsByValue() const
+{
+    return mSortMode == SortByName || mSortMode == SortByAge;
+}
 
-        QNetworkReply *reply = mpManager->sendCustomRequest(
-            request,
-            "DELETE"
-            );
+void DbUserModel::sortUsers()
+{
+    if (mSortMode == Unsorted)
+        return;
 
-        connect(reply, &QNetworkReply::finished, [this, id, reply]() {
-            if (reply->error() == QNetworkReply::NoError)
-            {
-                qDebug() << "User deleted on server OK.";
+    // rows read through the matching index are in order already (names
+    // compare as UTF-8 bytes like SQLite), unless evicted stubs were appended
+    auto less = [this](const DbUser *a, const DbUser *b) { return lessThan(a, b); };
+    if (!std::is_sorted(mUserList.cbegin(), mUserList.cend(), less))
+        std::sort(mUserList.begin(), mUserList.end(), less);
+}
 
-                mpLocalDB->deleteUser(id);
-                getUsers();
-            }
-            else
-            {
-                qWarning() << "Error DELETE:" << reply->errorString();
+void DbUserModel::createListFromLocalDb()
+{
+    // buffered mutations must reach the table before reading it back
+    mpSyncEngine->outbox()->flush();
+    loadLocalUsers();
+}
 
-                // fallback: salva offline
-                mpLocalDB->addPendingOperation("delete", id, -1, "", -1);
+void DbUserModel::resync()
+{
+    createListFromLocalDb();
+}
 
-                mpLocalDB->deleteUser(id);
-                createListFromLocalDb();
-            }
+void DbUserModel::createList(const UserRecords &users)
+{
+    UM_TRACE_SCOPE("DbUserModel::createList");
+    beginResetModel();
+    clearUsers();
 
-            reply->deleteLater();
-        });
-    }
-    else
-    {
-        handleDeleteOffline(id);
-    }
+    NamePool &pool = NamePool::shared();
+    for (const UserRecord &m : users)
+        mUserList.append(newUser(m.id, pool.intern(m.name), m.age));
+    sortUsers();
+    endResetModel();
 }
 
-void DbUserModel::syncPendingOperations()
+void DbUserModel::applyUsersPage(int afterId, int uptoId, const UserRecords &rows)
 {
-    if (!mServerOnline)
-        return;
+    UM_TRACE_SCOPE("DbUserModel::applyUsersPage");
+    QHash<int, int> incoming;
+    for (int i = 0; i < rows.size(); ++i)
+        incoming.insert(rows.at(i).id, i);
+
+    // rows of this id range we already show, from the id index: only the
+    // ones to drop (-1) or update need their row looked up
+    NamePool &pool = NamePool::shared();
+    QVector<QPair<DbUser*, int>> changed;
+    for (auto it = mUserById.lowerBound(afterId + 1); it != mUserById.end() && it.key() <= uptoId; ++it)
+    {
+        DbUser *u = it.value();
+        auto in = incoming.find(it.key());
+        if (in == incoming.end()) {
+            changed.append({ u, -1 });
+            continue;
+        }
 
-    auto ops = mpLocalDB->loadPendingOperations();
+        const UserRecord &m = rows.at(in.value());
+        if (u->nameHandle() != pool.intern(m.name) || u->age() != m.age)
+            changed.append({ u, in.value() });
+        incoming.erase(in);
+    }
 
-    for (auto &op : ops)
-    {
-        QString type = op["op_type"].toString();
-        int serverId = op["server_id"].toInt();
-        int localTempId = op["local_temp_id"].toInt();
-        QString name = op["name"].toString();
-        int age = op["age"].toInt();
-
-        if (type == "insert")
-        {
-            // send insert to server
-            sendUserToServer(name, age);
-            mpLocalDB->removePendingOperation(op["pending_id"].toInt());
+    if (mSortMode != Unsorted) {
+        // binary search, fresh for each row as the earlier ones move
+        for (const auto &change : std::as_const(changed)) {
+            const int row = rowOfUser(change.first);
+            if (change.second < 0) {
+                removeUserAt(row);
+            } else {
+                const UserRecord &m = rows.at(change.second);
+                setUserValues(row, pool.intern(m.name), m.age);
+            }
         }
-        else if (type == "delete")
-        {
-            deleteUserFromServer(serverId);
-            mpLocalDB->removePendingOperation(op["pending_id"].toInt());
+    } else if (!changed.isEmpty()) {
+        // one scan for their rows, applied bottom up so none shifts
+        QHash<const DbUser*, int> wanted;
+        for (const auto &change : std::as_const(changed))
+            wanted.insert(change.first, change.second);
+        QVector<QPair<int, int>> found;
+        for (int row = 0; row < mUserList.size() && found.size() < wanted.size(); ++row) {
+            auto it = wanted.constFind(mUserList.at(row));
+            if (it != wanted.constEnd())
+                found.append({ row, it.value() });
+        }
+        for (int i = found.size() - 1; i >= 0; --i) {
+            if (found.at(i).second < 0) {
+                removeUserAt(found.at(i).first);
+            } else {
+                const UserRecord &m = rows.at(found.at(i).second);
+                setUserValues(found.at(i).first, pool.intern(m.name), m.age);
+            }
         }
     }
-}
 
-void DbUserModel::flushPendingOperations()
-{
-    if (!mServerOnline) return;
-
-    auto ops = mpLocalDB->loadPendingOperations();
+    if (incoming.isEmpty())
+        return;
 
-    for (auto &op : ops)
-    {
-        QString type = op["op_type"].toString();
-        int pendingId = op["pending_id"].toInt();
-        int localTempId = op["local_temp_id"].toInt();
-        int serverId = op["server_id"].toInt();
-        QString name = op["name"].toString();
-        int age = op["age"].toInt();
-
-        if (type == "insert")
-        {
-            // POST insert
-            QUrl url(SERVER_URL);
-            QNetworkRequest req(url);
-            req.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
-
-            QJsonObject obj;
-            obj["name"] = name;
-            obj["age"] = age;
-
-            QNetworkReply *reply = mpManager->post(req, QJsonDocument(obj).toJson());
-
-            connect(reply, &QNetworkReply::finished, this, [this, reply, pendingId, localTempId]() {
-                if (reply->error() == QNetworkReply::NoError)
-                {
-                    QByteArray data = reply->readAll();
-                    QJsonDocument doc = QJsonDocument::fromJson(data);
-                    if (doc.isObject())
-                    {
-                        QJsonObject o = doc.object();
-                        int serverId = o["id"].toInt();
-                        QString name = o["name"].toString();
-                        int age = o["age"].toInt();
-
-                        // update local temp ID with final ID
-                        mpLocalDB->deleteUser(localTempId);
-                        mpLocalDB->insertUser(serverId, name, age);
-
-                        // Remove pending op
-                        mpLocalDB->removePendingOperation(pendingId);
-                    }
-                }
-                else
-                {
-                    qWarning() << "Sync insert failed:" << reply->errorString();
-                }
-                reply->deleteLater();
-            });
-        }
-        else if (type == "delete")
-        {
-            // DELETE
-            QUrl url(QString("%1/%2").arg(SERVER_URL).arg(serverId));
-            QNetworkRequest req(url);
-
-            QNetworkReply *reply = mpManager->sendCustomRequest(req, "DELETE");
-
-            connect(reply, &QNetworkReply::finished, this, [this, reply, pendingId, serverId]() {
-                if (reply->error() == QNetworkReply::NoError)
-                {
-                    mpLocalDB->removePendingOperation(pendingId);
-                    mpLocalDB->deleteUser(serverId);
-                }
-                else
-                {
-                    qWarning() << "Sync delete failed:" << reply->errorString();
-                }
-                reply->deleteLater();
-            });
+    // the rest is new: appended in page (id) order, or each at its place
+    if (mSortMode != Unsorted) {
+        for (const UserRecord &m : rows) {
+            if (incoming.contains(m.id))
+                insertUserRow(newUser(m.id, pool.intern(m.name), m.age));
         }
+        return;
     }
+
+    beginInsertRows(QModelIndex(), rowCount(), rowCount() + incoming.size() - 1);
+    for (const UserRecord &m : rows) {
+        if (incoming.contains(m.id))
+            mUserList.append(newUser(m.id, pool.intern(m.name), m.age));
+    }
+    endInsertRows();
 }
 
-void DbUserModel::onServerOnline()
+bool DbUserModel::dumpTrace(const QString &path)
 {
-    mServerOnline = true;
+    return Trace::writeChromeJson(path);
+}
 
-    syncPendingOperations();
-    createListFromLocalDb();
-    getUsers();
+int DbUserModel::cacheLimit() const
+{
+    return mpSyncEngine->localDb()->cacheLimit();
 }
 
-void DbUserModel::getUsers()
+void DbUserModel::setCacheLimit(int maxRows)
 {
-    QUrl url(SERVER_URL);
-    QNetworkRequest req(url);
-    req.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+    if (maxRows == cacheLimit())
+        return;
 
-    // use GET (no body)
-    QNetworkReply *reply = mpManager->get(req);
-    connect(reply, &QNetworkReply::finished, this, [this, reply]() {
-        if (reply->error() == QNetworkReply::NoError) {
-            QByteArray data = reply->readAll();
-            createList(data);
-        } else {
-            qWarning() << "GET error:" << reply->errorString();
-            // fallback to local DB
-            createListFromLocalDb();
-        }
-        reply->deleteLater();
-    });
+    // evict by up-to-date access times
+    flushTouchedRows();
+    mpSyncEngine->setCacheLimit(maxRows);
+    emit cacheStatsChanged();
 }
 
-void DbUserModel::processPendingDelete(QVariantMap op,
-                                       QList<QVariantMap> ops,
-                                       int index)
+double DbUserModel::cacheHitRatio() const
 {
-    int serverId = op["server_id"].toInt();
-    int pendingId = op["pending_id"].toInt();
+    const qint64 lookups = mCacheHits + mCacheMisses;
+    return lookups > 0 ? double(mCacheHits) / lookups : 1.0;
+}
 
-    qDebug() << "Processing pending DELETE for id =" << serverId;
+qint64 DbUserModel::dataChangedSignals() const
+{
+    return mDataChangedSignals;
+}
 
-    QUrl url(QString("%1/%2").arg(SERVER_URL).arg(serverId));
-    QNetworkRequest req(url);
+DbUserModel::SortMode DbUserModel::sortMode() const
+{
+    return mSortMode;
+}
 
-    QNetworkReply *reply = mpManager->sendCustomRequest(req, "DELETE");
+void DbUserModel::setSortMode(SortMode mode)
+{
+    if (mode == mSortMode)
+        return;
 
-    connect(reply, &QNetworkReply::finished, [=]() mutable {
+    // one full sort on a mode change, incremental from then on; Unsorted
+    // keeps whatever order the rows are in
+    mSortMode = mode;
+    if (mode != Unsorted) {
+        UM_TRACE_SCOPE("DbUserModel::setSortMode");
+        emit layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
+        const QModelIndexList before = persistentIndexList();
+        QList<DbUser*> users;
+        for (const QModelIndex &idx : before)
+            users.append(mUserList.at(idx.row()));
+
+        sortUsers();
+
+        QModelIndexList after;
+        for (const DbUser *u : std::as_const(users))
+            after.append(index(rowOfUser(u)));
+        changePersistentIndexList(before, after);
+        emit layoutChanged({}, QAbstractItemModel::VerticalSortHint);
+    }
+    emit sortModeChanged();
+}
 
-        if (reply->error() == QNetworkReply::NoError)
-        {
-            mpLocalDB->removePendingOperation(pendingId);
-            processNextPendingOperation(ops, index + 1);
-        }
-        else
-        {
-            qWarning() << "Pending delete failed:" << reply->errorString();
-            // STOP sync
+void DbUserModel::markRowsEvicted(const QList<int> &ids)
+{
+    UM_TRACE_SCOPE("DbUserModel::markRowsEvicted");
+    // no dataChanged: the values are still right, only no longer held;
+    // views sorted by them keep them to keep the row where it is
+    const bool keepValues = sortsByValue();
+    for (int id : ids) {
+        DbUser *u = mUserById.value(id);
+        if (!u)
+            continue;
+
+        u->setLoaded(false);
+        if (keepValues) {
+            u->setStale(true);
+        } else {
+            u->setNameHandle(0);
+            u->setAge(0);
         }
-
-        reply->deleteLater();
-    });
+    }
 }
 
-void DbUserModel::processPendingInsert(QVariantMap op,
-                                       QList<QVariantMap> ops,
-                                       int index)
+void DbUserModel::fillFetchedRows(const UserRecords &rows)
 {
-    QString name = op["name"].toString();
-    int age = op["age"].toInt();
-    int localTempId = op["local_temp_id"].toInt();
-    int pendingId = op["pending_id"].toInt();
-
-    qDebug() << "Processing pending INSERT:" << name << age << "temp id =" << localTempId;
+    UM_TRACE_SCOPE("DbUserModel::fillFetchedRows");
+    NamePool &pool = NamePool::shared();
+    // sorted rows are found by binary search and may move when filled
+    if (mSortMode != Unsorted) {
+        for (const UserRecord &m : rows) {
+            mFetchInFlight.remove(m.id);
+            const int row = rowForTableId(m.id);
+            if (row >= 0)
+                setUserValues(row, pool.intern(m.name), m.age);
+        }
+        emit cacheStatsChanged();
+        return;
+    }
 
-    // ----- Send to server -----
-    QUrl url(SERVER_URL);
-    QNetworkRequest req(url);
-    req.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+    QHash<int, int> incoming;
+    for (int i = 0; i < rows.size(); ++i)
+        incoming.insert(rows.at(i).id, i);
 
-    QJsonObject json;
-    json["name"] = name;
-    json["age"] = age;
+    for (int row = 0; row < mUserList.size() && !incoming.isEmpty(); ++row) {
+        DbUser *u = mUserList.at(row);
+        auto it = incoming.find(u->tableId());
+        if (it == incoming.end())
+            continue;
 
-    QNetworkReply *reply = mpManager->sendCustomRequest(
-        req, "POST", QJsonDocument(json).toJson()
-        );
+        const UserRecord &m = rows.at(it.value());
+        mFetchInFlight.remove(u->tableId());
+        setUserValues(row, pool.intern(m.name), m.age);
+        incoming.erase(it);
+    }
+    emit cacheStatsChanged();
+}
 
-    connect(reply, &QNetworkReply::finished, [=]() mutable {
+void DbUserModel::clearFetchInFlight(const QList<int> &ids)
+{
+    // asked again the next time a view shows them
+    for (int id : ids)
+        mFetchInFlight.remove(id);
+}
 
-        if (reply->error() == QNetworkReply::NoError)
-        {
-            QByteArray resp = reply->readAll();
-            QJsonObject obj = QJsonDocument::fromJson(resp).object();
+void DbUserModel::fetchWantedRows()
+{
+    QList<int> ids;
+    for (int id : std::as_const(mFetchWanted)) {
+        if (!mFetchInFlight.contains(id)) {
+            mFetchInFlight.insert(id);
+            ids.append(id);
+        }
+    }
+    mFetchWanted.clear();
 
-            int newId = obj["id"].toInt();
+    mpSyncEngine->fetchUsers(ids);
+}
 
-            // update local cache: replace temp id → new id
-            mpLocalDB->replaceTempId(localTempId, newId);
+void DbUserModel::flushTouchedRows()
+{
+    if (mTouched.isEmpty() || !mpSyncEngine)
+        return;
 
-            // remove pending op
-            mpLocalDB->removePendingOperation(pendingId);
+    mpSyncEngine->localDb()->touchUsers(QList<int>(mTouched.cbegin(), mTouched.cend()));
+    mTouched.clear();
+    emit cacheStatsChanged();
+}
 
-            // continue chain
-            processNextPendingOperation(ops, index + 1);
-        }
-        else
-        {
-            qWarning() << "Insert sync failed:" << reply->errorString();
-            // STOP sync → server offline again?
+void DbUserModel::applyChangedUsers(const UserRecords &rows, const QList<int> &removedIds)
+{
+    UM_TRACE_SCOPE("DbUserModel::applyChangedUsers");
+    // unsorted rows can only be found by a scan: index them once
+    QHash<int, int> rowOf;
+    if (mSortMode == Unsorted) {
+        rowOf.reserve(mUserList.size());
+        for (int row = 0; row < mUserList.size(); ++row)
+            rowOf.insert(mUserList.at(row)->tableId(), row);
+    }
+    auto rowFor = [&](const DbUser *u) {
+        return mSortMode == Unsorted ? rowOf.value(u->tableId(), -1) : rowOfUser(u);
+    };
+
+    // our own writes come back too: only real differences are signalled
+    NamePool &pool = NamePool::shared();
+    UserRecords added;
+    for (const UserRecord &m : rows) {
+        const DbUser *u = mUserById.value(m.id);
+        if (!u) {
+            added.append(m);
+            continue;
         }
 
-        reply->deleteLater();
-    });
-}
+        const NamePool::Handle name = pool.intern(m.name);
+        if (!u->isLoaded() || u->nameHandle() != name || u->age() != m.age)
+            setUserValues(rowFor(u), name, m.age);
+    }
 
-void DbUserModel::processNextPendingOperation(const QList<QVariantMap> &ops, int index)
-{
-    if (index >= ops.size()) {
-        qDebug() << "All pending operations processed.";
-        getUsers();
-        return;
+    // highest row first so the indexes above stay valid
+    QList<int> removedRows;
+    for (int id : removedIds) {
+        if (const DbUser *u = mUserById.value(id))
+            removedRows.append(rowFor(u));
     }
+    std::sort(removedRows.begin(), removedRows.end(), std::greater<int>());
+    for (int row : removedRows)
+        removeUserAt(row);
+
+    if (added.isEmpty())
+        return;
 
-    QVariantMap op = ops[index];
-    QString type = op["op_type"].toString();
+    if (mSortMode != Unsorted) {
+        for (const UserRecord &m : added)
+            insertUserRow(newUser(m.id, pool.intern(m.name), m.age));
+        return;
+    }
 
-    if (type == "insert")
-        processPendingInsert(op, ops, index);
-    else if (type == "delete")
-        processPendingDelete(op, ops, index);
+    beginInsertRows(QModelIndex(), rowCount(), rowCount() + added.size() - 1);
+    for (const UserRecord &m : added)
+        mUserList.append(newUser(m.id, pool.intern(m.name), m.age));
+    endInsertRows();
 }
 
+void DbUserModel::sendUserToServer(const QString &name, int age)
+{
+    mpSyncEngine->insertUser(name, age);
+}
 
+void DbUserModel::deleteUserFromServer(int id)
+{
+    mpSyncEngine->deleteUser(id);
+}
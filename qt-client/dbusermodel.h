@@ -2,18 +2,22 @@
 #define DBUSERMODEL_H
 
 #include <QAbstractListModel>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
 #include <memory>
 #include "DbUser.h"
-#include "LocalDB.h"
-#include "websocketclient.h"
-
-class QNetworkAccessManager;
+#include "syncengine.h"
 
 using namespace std;
 
 class DbUserModel : public QAbstractListModel
 {
     Q_OBJECT
+    Q_PROPERTY(int cacheLimit READ cacheLimit WRITE setCacheLimit NOTIFY cacheStatsChanged)
+    Q_PROPERTY(double cacheHitRatio READ cacheHitRatio NOTIFY cacheStatsChanged)
+    Q_PROPERTY(SortMode sortMode READ sortMode WRITE setSortMode NOTIFY sortModeChanged)
 public:
     enum Roles {
         nameRole = Qt::UserRole + 1,
@@ -21,59 +25,124 @@ public:
         tableIdRole
     };
 
+    // Unsorted keeps rows in arrival order; the others are kept sorted on
+    // every insert, delete and update (ties broken by id)
+    enum SortMode {
+        Unsorted,
+        SortById,
+        SortByName,
+        SortByAge
+    };
+    Q_ENUM(SortMode)
+
     explicit DbUserModel(QObject *parent = nullptr);
     ~DbUserModel() override;
 
     int rowCount(const QModelIndex &parent = QModelIndex()) const override;
     QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    void multiData(const QModelIndex &index, QModelRoleDataSpan roleDataSpan) const override;
+#endif
     QHash<int, QByteArray> roleNames() const override;
 
     Q_INVOKABLE void sendUserToServer(const QString &name, int age);
     Q_INVOKABLE void deleteUserFromServer(int id);
 
-private:
-    void initLocalDb();
-    void initSocketClient();
-    void loadLocalUsers();
-
-    void createListFromLocalDb();
-    void createList(const QByteArray &jsonData);
+    // drop the in-memory rows and read them back from the local db
+    Q_INVOKABLE void resync();
 
-    void addUser(const QString &name, int age, int tableId, bool insertRows = false);
+    // Chrome trace JSON of everything recorded so far (trace builds only)
+    Q_INVOKABLE bool dumpTrace(const QString &path);
 
-    // offline/online helpers
-    void handleInsertOffline(const QString &name, int age);
-    void handleDeleteOffline(int id);
+    // bounded local cache: evicted rows stay as id-only stubs and are
+    // fetched again when a view asks for them
+    int cacheLimit() const;
+    void setCacheLimit(int maxRows);
+    double cacheHitRatio() const;
 
-    void syncPendingOperations();
-    void flushPendingOperations(); // alias for clarity
-    void onServerOnline();
+    // dataChanged signals emitted so far, after coalescing
+    qint64 dataChangedSignals() const;
 
-    void testPendingOps();
+    SortMode sortMode() const;
+    void setSortMode(SortMode mode);
 
-    // network
-    void getUsers();
+signals:
+    void cacheStatsChanged();
+    void sortModeChanged();
 
 private:
-    QList<DbUser*> mUserList;
-    unique_ptr<QNetworkAccessManager> mpManager;
-    unique_ptr<LocalDB> mpLocalDB;
-    unique_ptr<WebSocketClient> mpSocketClient;
+    // feeds synthetic change batches straight into applyChangedUsers()
+    friend class ModelBench;
 
-    bool mServerOnline = false;
-    const QString SERVER_URL = QStringLiteral("http://localhost:3000/api/users");
-    const QString WEBSOCKET_URL = QStringLiteral("ws://localhost:3001");
+    void initSyncEngine();
+    void loadLocalUsers();
 
-    void processPendingDelete(QVariantMap op,
-                              QList<QVariantMap> ops,
-                              int index);
+    void createListFromLocalDb();
+    void createList(const UserRecords &users);
+    void applyUsersPage(int afterId, int uptoId, const UserRecords &rows);
+    // shared replica: rows another process (or we) wrote
+    void applyChangedUsers(const UserRecords &rows, const QList<int> &removedIds);
 
-    void processPendingInsert(QVariantMap op,
-                         QList<QVariantMap> ops,
-                              int index);
+    void addUser(const QString &name, int age, int tableId, bool insertRows = false);
 
-    void processNextPendingOperation(const QList<QVariantMap> &ops, int index);
+    // single-row updates of the in-memory list
+    int rowForTableId(int id) const;
+    void appendUserRow(int id, const QString &name, int age);
+    void removeUserRow(int id);
+    void replaceUserRowId(int oldId, int newId);
+
+    // row bookkeeping shared by all updates: every DbUser is in mUserById
+    // (ordered, so an id range is found without a scan), sorted modes find
+    // rows and insert positions by binary search
+    DbUser *newUser(int id, NamePool::Handle name, int age);
+    void clearUsers();
+    void insertUserRow(DbUser *u);
+    void removeUserAt(int row);
+    void setUserValues(int row, NamePool::Handle name, int age);
+    void moveToSortedRow(int row);
+    int rowOfUser(const DbUser *u) const;
+    bool lessThan(const DbUser *a, const DbUser *b) const;
+    bool sortsByValue() const;
+    void sortUsers();
+
+    // bounded cache
+    void markRowsEvicted(const QList<int> &ids);
+    void fillFetchedRows(const UserRecords &rows);
+    void clearFetchInFlight(const QList<int> &ids);
+    void fetchWantedRows();
+    void flushTouchedRows();
+    // hit/miss bookkeeping of one lookup, false (fetch queued) if evicted
+    bool accessRow(const DbUser *u, bool countLookup) const;
+
+    // dataChanged batching: changed roles per row, sent on the next pass
+    // of the event loop as contiguous ranges
+    enum ChangedRole {
+        NameChanged = 1,
+        AgeChanged = 2,
+        TableIdChanged = 4
+    };
+    void notifyChanged(DbUser *u, int roles);
+    void flushChangedRows();
 
+private:
+    QList<DbUser*> mUserList;
+    QMap<int, DbUser*> mUserById;
+    SortMode mSortMode = Unsorted;
+    unique_ptr<SyncEngine> mpSyncEngine;
+
+    // data() is const but feeds the cache: misses queue a fetch, hits
+    // refresh the LRU order, both batched on a timer
+    mutable qint64 mCacheHits = 0;
+    mutable qint64 mCacheMisses = 0;
+    mutable QSet<int> mFetchWanted;
+    mutable QSet<int> mTouched;
+    mutable QTimer mFetchTimer;
+    mutable QTimer mTouchTimer;
+    QSet<int> mFetchInFlight;
+
+    QHash<const DbUser*, int> mChangedRoles;
+    QTimer mChangeTimer;
+    qint64 mDataChangedSignals = 0;
 };
 
 #endif // DBUSERMODEL_H
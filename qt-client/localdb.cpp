@@ -1,33 +1,172 @@
 #include "localdb.h"
+#include "namepool.h"
+#include "outboxlog.h"
+#include "trace.h"
 #include <QSqlQuery>
 #include <QSqlError>
 #include <QDebug>
+#include <QAtomicInt>
 #include <QDateTime>
+#include <QFileInfo>
+#include <QThread>
+#include <QMutexLocker>
+#include <limits>
 
-LocalDB::LocalDB(QObject *parent) : QObject(parent)
+namespace {
+
+// temp ids are claimed from the shared floor this many at a time
+const int kTempIdBlock = 1024;
+
+// Merkle bucket b holds the XOR of the row hashes with ids in
+// (b * kMerkleBucketIds, (b + 1) * kMerkleBucketIds], kept by triggers
+const int kMerkleBucketIds = 64;
+
+// SQLite has no XOR operator
+QString sqlXor(const QString &a, const QString &b)
+{
+    return QStringLiteral("((~(%1 & %2)) & (%1 | %2))").arg(a, b);
+}
+
+// holds one of the reader slots for the duration of a read query
+class ReaderSlot
+{
+public:
+    explicit ReaderSlot(QSemaphore &slots) : m_slots(slots) { m_slots.acquire(); }
+    ~ReaderSlot() { m_slots.release(); }
+
+private:
+    QSemaphore &m_slots;
+};
+
+// per LocalDB and thread: two instances (say on different files) must not
+// share a connection
+QString readerConnectionName(const QString &writerName)
+{
+    return QStringLiteral("%1_ro_%2")
+        .arg(writerName)
+        .arg(reinterpret_cast<quintptr>(QThread::currentThread()), 0, 16);
+}
+
+QAtomicInt nextInstanceId;
+
+}
+
+LocalDB::LocalDB(QObject *parent)
+    : QObject(parent),
+      m_connectionName(QStringLiteral("local_%1").arg(nextInstanceId.fetchAndAddRelaxed(1)))
 {
 }
 
 LocalDB::~LocalDB()
 {
+    closeReaders();
     if (m_db.isOpen()) m_db.close();
+    m_db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(m_connectionName);
+}
+
+void LocalDB::setDatabasePath(const QString &path)
+{
+    m_path = path;
+}
+
+QString LocalDB::databasePath() const
+{
+    return m_path;
 }
 
 bool LocalDB::open()
 {
-    if (QSqlDatabase::contains("local"))
-        m_db = QSqlDatabase::database("local");
+    if (QSqlDatabase::contains(m_connectionName))
+        m_db = QSqlDatabase::database(m_connectionName);
     else
-        m_db = QSqlDatabase::addDatabase("QSQLITE", "local");
+        m_db = QSqlDatabase::addDatabase("QSQLITE", m_connectionName);
 
-    m_db.setDatabaseName("local_users.db");
+    m_db.setDatabaseName(m_path);
+    m_db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
     if (!m_db.open()) {
         qWarning() << "Cannot open local DB:" << m_db.lastError().text();
         return false;
     }
+
+    // WAL lets the reader connections run while the writer commits
+    QSqlQuery q(m_db);
+    if (!q.exec("PRAGMA journal_mode=WAL"))
+        qWarning() << "Enable WAL failed:" << q.lastError().text();
+    q.exec("PRAGMA synchronous=NORMAL");
+    // REPLACE only fires the delete triggers (Merkle buckets) with it
+    q.exec("PRAGMA recursive_triggers=ON");
+
+    if (m_readerSlots.available() == 0)
+        m_readerSlots.release(m_maxReaders);
     return true;
 }
 
+void LocalDB::setMaxReaders(int count)
+{
+    if (count < 1) count = 1;
+    if (!m_db.isOpen()) {
+        m_maxReaders = count;
+        return;
+    }
+
+    if (count > m_maxReaders)
+        m_readerSlots.release(count - m_maxReaders);
+    else if (count < m_maxReaders)
+        m_readerSlots.acquire(m_maxReaders - count);
+    m_maxReaders = count;
+}
+
+int LocalDB::maxReaders() const
+{
+    return m_maxReaders;
+}
+
+QSqlDatabase LocalDB::readConnection()
+{
+    // QSqlDatabase connections are bound to the thread that created them,
+    // so each reading thread gets its own read-only connection
+    const QString name = readerConnectionName(m_connectionName);
+    if (QSqlDatabase::contains(name))
+        return QSqlDatabase::database(name);
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", name);
+    db.setDatabaseName(m_path);
+    db.setConnectOptions("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=5000");
+    if (!db.open()) {
+        qWarning() << "Cannot open reader connection:" << db.lastError().text();
+        return m_db;
+    }
+
+    {
+        QMutexLocker lock(&m_readersMutex);
+        m_readerNames.append(name);
+    }
+
+    QThread *thread = QThread::currentThread();
+    if (thread != this->thread()) {
+        connect(thread, &QThread::finished, this, [this, name]() {
+            {
+                QMutexLocker lock(&m_readersMutex);
+                m_readerNames.removeAll(name);
+            }
+            QSqlDatabase::removeDatabase(name);
+        }, Qt::DirectConnection);
+    }
+
+    return db;
+}
+
+void LocalDB::closeReaders()
+{
+    // only the connection of the owner thread can be removed from here,
+    // the others go away when their thread finishes
+    const QString name = readerConnectionName(m_connectionName);
+    QMutexLocker lock(&m_readersMutex);
+    if (m_readerNames.removeAll(name) > 0)
+        QSqlDatabase::removeDatabase(name);
+}
+
 bool LocalDB::createTable()
 {
     QSqlQuery q(m_db);
@@ -41,6 +180,78 @@ bool LocalDB::createTable()
         return false;
     }
 
+    // LRU bookkeeping for the bounded cache mode
+    if (!ensureColumn("users", "last_access", "INTEGER NOT NULL DEFAULT 0"))
+        return false;
+
+    // rowHash() of the row, written with every id, name or age change; the
+    // triggers fold it into the bucket of its id
+    if (!ensureColumn("users", "row_hash", "INTEGER NOT NULL DEFAULT 0"))
+        return false;
+    const QString bucket = QStringLiteral("((%2.id - 1) / %1)").arg(kMerkleBucketIds);
+    // no OR IGNORE: the INSERT OR REPLACE firing the trigger would turn it
+    // into a REPLACE of the bucket
+    const QString addRow = QStringLiteral(
+        "INSERT INTO merkle_buckets (bucket, count, hash) SELECT %1, 0, 0 "
+        "WHERE NEW.id > 0 AND NOT EXISTS (SELECT 1 FROM merkle_buckets WHERE bucket = %1); "
+        "UPDATE merkle_buckets SET count = count + 1, hash = %2 WHERE NEW.id > 0 AND bucket = %1; ")
+        .arg(bucket.arg("NEW"), sqlXor("hash", "NEW.row_hash"));
+    const QString removeRow = QStringLiteral(
+        "UPDATE merkle_buckets SET count = count - 1, hash = %2 WHERE OLD.id > 0 AND bucket = %1; ")
+        .arg(bucket.arg("OLD"), sqlXor("hash", "OLD.row_hash"));
+    const QString merkleStatements[] = {
+        QStringLiteral("CREATE TABLE IF NOT EXISTS merkle_buckets ("
+                       "bucket INTEGER PRIMARY KEY,"
+                       "count INTEGER NOT NULL,"
+                       "hash INTEGER NOT NULL)"),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS users_merkle_insert AFTER INSERT ON users BEGIN %1END").arg(addRow),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS users_merkle_delete AFTER DELETE ON users BEGIN %1END").arg(removeRow),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS users_merkle_update AFTER UPDATE OF id, row_hash ON users "
+                       "BEGIN %1%2END").arg(removeRow, addRow)
+    };
+    for (const QString &sql : merkleStatements) {
+        if (!q.exec(sql)) {
+            qWarning() << "Create merkle_buckets FAILED:" << q.lastError().text();
+            return false;
+        }
+    }
+    if (!q.exec("CREATE INDEX IF NOT EXISTS idx_users_last_access ON users(last_access)")) {
+        qWarning() << "Create users index FAILED:" << q.lastError().text();
+        return false;
+    }
+
+    // sorted views; the rowid in every index entry breaks ties by id
+    if (!q.exec("CREATE INDEX IF NOT EXISTS idx_users_name ON users(name)")
+        || !q.exec("CREATE INDEX IF NOT EXISTS idx_users_age ON users(age)")) {
+        qWarning() << "Create users sort index FAILED:" << q.lastError().text();
+        return false;
+    }
+
+    const char *evicted_sql =
+        "CREATE TABLE IF NOT EXISTS evicted_users ("
+        "id INTEGER PRIMARY KEY)";
+    if (!q.exec(evicted_sql)) {
+        qWarning() << "Create evicted_users FAILED:" << q.lastError().text();
+        return false;
+    }
+
+    // an evicted row keeps its hash in the buckets, so a bounded cache can
+    // still compare ranges with the server; an id is in users or here
+    if (!ensureColumn("evicted_users", "row_hash", "INTEGER NOT NULL DEFAULT 0"))
+        return false;
+    const QString evictedStatements[] = {
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS evicted_merkle_insert AFTER INSERT ON evicted_users BEGIN %1END").arg(addRow),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS evicted_merkle_delete AFTER DELETE ON evicted_users BEGIN %1END").arg(removeRow),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS users_unevict AFTER INSERT ON users "
+                       "BEGIN DELETE FROM evicted_users WHERE id = NEW.id; END")
+    };
+    for (const QString &sql : evictedStatements) {
+        if (!q.exec(sql)) {
+            qWarning() << "Create evicted_users triggers FAILED:" << q.lastError().text();
+            return false;
+        }
+    }
+
     const char *pending_sql =
         "CREATE TABLE IF NOT EXISTS pending_ops ("
         "id INTEGER PRIMARY KEY AUTOINCREMENT,"
@@ -49,63 +260,494 @@ bool LocalDB::createTable()
         "local_temp_id INTEGER,"
         "name TEXT,"
         "age INTEGER,"
-        "created_at INTEGER)";
+        "created_at INTEGER,"
+        "attempts INTEGER NOT NULL DEFAULT 0,"
+        "next_attempt_at INTEGER NOT NULL DEFAULT 0,"
+        "error_class TEXT,"
+        "last_error TEXT)";
     if (!q.exec(pending_sql)) {
         qWarning() << "Create pending_ops FAILED:" << q.lastError().text();
         return false;
     }
 
+    const char *state_sql =
+        "CREATE TABLE IF NOT EXISTS sync_state ("
+        "key TEXT PRIMARY KEY,"
+        "value TEXT)";
+    if (!q.exec(state_sql)) {
+        qWarning() << "Create sync_state FAILED:" << q.lastError().text();
+        return false;
+    }
+
+    // files from before the buckets, or written by an older version
+    if (syncState("merkle_buckets") != QLatin1String("2") && !rebuildMerkleBuckets())
+        return false;
+
+    const char *slices_sql =
+        "CREATE TABLE IF NOT EXISTS snapshot_slices ("
+        "slice INTEGER PRIMARY KEY,"
+        "cursor INTEGER NOT NULL,"
+        "done INTEGER NOT NULL DEFAULT 0)";
+    if (!q.exec(slices_sql)) {
+        qWarning() << "Create snapshot_slices FAILED:" << q.lastError().text();
+        return false;
+    }
+
+    // retry state on pending_ops created by older versions
+    if (!ensureColumn("pending_ops", "attempts", "INTEGER NOT NULL DEFAULT 0")
+        || !ensureColumn("pending_ops", "next_attempt_at", "INTEGER NOT NULL DEFAULT 0")
+        || !ensureColumn("pending_ops", "error_class", "TEXT")
+        || !ensureColumn("pending_ops", "last_error", "TEXT"))
+        return false;
+
+    const char *dead_sql =
+        "CREATE TABLE IF NOT EXISTS dead_ops ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "pending_id INTEGER,"
+        "op_type TEXT NOT NULL,"
+        "server_id INTEGER,"
+        "local_temp_id INTEGER,"
+        "name TEXT,"
+        "age INTEGER,"
+        "created_at INTEGER,"
+        "attempts INTEGER,"
+        "error_class TEXT,"
+        "last_error TEXT,"
+        "failed_at INTEGER)";
+    if (!q.exec(dead_sql)) {
+        qWarning() << "Create dead_ops FAILED:" << q.lastError().text();
+        return false;
+    }
+
+    if (m_outbox)
+        return true;
+    if (!restoreOutboxLog())
+        return false;
+    if (!m_outboxDirectory.isEmpty())
+        return openOutboxLog();
     return true;
 }
 
-QList<QVariantMap> LocalDB::loadUsers()
+bool LocalDB::ensureColumn(const QString &table, const QString &column, const QString &definition)
 {
-    QList<QVariantMap> out;
     QSqlQuery q(m_db);
+    if (!q.exec(QStringLiteral("PRAGMA table_info(%1)").arg(table))) {
+        qWarning() << "ensureColumn FAILED:" << q.lastError().text();
+        return false;
+    }
+    while (q.next()) {
+        if (q.value(1).toString() == column)
+            return true;
+    }
+
+    if (!q.exec(QStringLiteral("ALTER TABLE %1 ADD COLUMN %2 %3").arg(table, column, definition))) {
+        qWarning() << "ensureColumn FAILED:" << q.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool LocalDB::beginTransaction()
+{
+    if (!m_db.transaction()) {
+        qWarning() << "beginTransaction FAILED:" << m_db.lastError().text();
+        return false;
+    }
+    m_inTransaction = true;
+    return true;
+}
+
+bool LocalDB::commitTransaction()
+{
+    // log records of this transaction count once their batch is committed
+    const quint32 batch = m_outbox ? m_outbox->batch() : 0;
+    if (batch != 0) {
+        // on disk before the marker can be: a committed batch whose
+        // records a power loss took would drop ops the tables reflect
+        if (!m_outbox->syncBatch()) {
+            m_outbox->abortBatch();
+            return false;
+        }
+        QSqlQuery q(m_db);
+        q.prepare("INSERT OR REPLACE INTO sync_state (key, value) VALUES ('outbox_batch', ?)");
+        q.addBindValue(QString::number(batch));
+        if (!q.exec()) {
+            qWarning() << "commitTransaction FAILED:" << q.lastError().text();
+            m_outbox->abortBatch();
+            return false;
+        }
+    }
+
+    if (!m_db.commit()) {
+        qWarning() << "commitTransaction FAILED:" << m_db.lastError().text();
+        if (batch != 0)
+            m_outbox->abortBatch();
+        return false;
+    }
+    m_inTransaction = false;
+    if (batch != 0)
+        m_outbox->commitBatch();
+    return true;
+}
+
+void LocalDB::rollbackTransaction()
+{
+    if (!m_db.rollback())
+        qWarning() << "rollbackTransaction FAILED:" << m_db.lastError().text();
+    m_inTransaction = false;
+    if (m_outbox && m_outbox->batch() != 0)
+        m_outbox->abortBatch();
+}
+
+UserRecords LocalDB::loadUsers()
+{
+    UM_TRACE_SCOPE("LocalDB::loadUsers");
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
     if (!q.exec("SELECT id, name, age FROM users")) {
         qWarning() << "loadUsers failed:" << q.lastError().text();
-        return out;
+        return {};
     }
 
-    while (q.next()) {
-        QVariantMap m;
-        m["id"] = q.value(0).toInt();
-        m["name"] = q.value(1).toString();
-        m["age"] = q.value(2).toInt();
-        out.append(m);
+    return readUsers(q);
+}
+
+UserRecords LocalDB::loadUsersPage(int offset, int limit, UserOrder order)
+{
+    UM_TRACE_SCOPE("LocalDB::loadUsersPage");
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    q.prepare(QStringLiteral("SELECT id, name, age FROM users ORDER BY %1 LIMIT ? OFFSET ?")
+                  .arg(QLatin1String(orderByClause(order))));
+    q.addBindValue(limit);
+    q.addBindValue(offset);
+    if (!q.exec()) {
+        qWarning() << "loadUsersPage failed:" << q.lastError().text();
+        return {};
     }
+
+    return readUsers(q);
+}
+
+UserRecords LocalDB::searchUsers(const QString &pattern, int limit)
+{
+    UM_TRACE_SCOPE("LocalDB::searchUsers");
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    q.prepare("SELECT id, name, age FROM users WHERE name LIKE ? ORDER BY name LIMIT ?");
+    q.addBindValue(QStringLiteral("%%1%").arg(pattern));
+    q.addBindValue(limit);
+    if (!q.exec()) {
+        qWarning() << "searchUsers failed:" << q.lastError().text();
+        return {};
+    }
+
+    return readUsers(q);
+}
+
+const char *LocalDB::orderByClause(UserOrder order)
+{
+    switch (order) {
+    case UserOrder::ByName:
+        return "name, id";
+    case UserOrder::ByAge:
+        return "age, id";
+    case UserOrder::ById:
+        break;
+    }
+    return "id";
+}
+
+UserRecords LocalDB::readUsers(QSqlQuery &q)
+{
+    UserRecords out;
+    while (q.next())
+        out.append(UserRecord{ q.value(0).toInt(), q.value(1).toString(), q.value(2).toInt() });
     return out;
 }
 
-void LocalDB::insertUser(int id, const QString &name, int age)
+int LocalDB::countUsers()
+{
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    if (!q.exec("SELECT COUNT(*) FROM users") || !q.next()) {
+        qWarning() << "countUsers failed:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toInt();
+}
+
+bool LocalDB::insertUser(int id, const QString &name, int age)
 {
     QSqlQuery q(m_db);
-    q.prepare("INSERT OR REPLACE INTO users (id, name, age) VALUES (?, ?, ?)");
+    q.prepare("INSERT OR REPLACE INTO users (id, name, age, row_hash) VALUES (?, ?, ?, ?)");
     q.addBindValue(id);
     q.addBindValue(name);
     q.addBindValue(age);
+    q.addBindValue(qint64(rowHash(id, name, age)));
     if (!q.exec()) {
         qWarning() << "insertUser failed:" << q.lastError().text();
+        return false;
     }
+    return true;
 }
 
-void LocalDB::saveUser(const QString &name, int age, int id)
+bool LocalDB::saveUser(const QString &name, int age, int id)
 {
-    insertUser(id, name, age);
+    return insertUser(id, name, age);
 }
 
-void LocalDB::deleteUser(int id)
+bool LocalDB::deleteUser(int id)
 {
     QSqlQuery q(m_db);
     q.prepare("DELETE FROM users WHERE id = ?");
     q.addBindValue(id);
     if (!q.exec()) {
         qWarning() << "deleteUser failed:" << q.lastError().text();
+        return false;
+    }
+
+    q.prepare("DELETE FROM evicted_users WHERE id = ?");
+    q.addBindValue(id);
+    if (!q.exec()) {
+        qWarning() << "deleteUser failed:" << q.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+int LocalDB::insertPendingUsers(const UserRecords &users)
+{
+    UM_TRACE_SCOPE("LocalDB::insertPendingUsers");
+    if (users.isEmpty())
+        return 0;
+    // claimed outside the transaction: a rollback must not free ids
+    // this process still regards as its own
+    int tempId = reserveTempIds(users.size());
+    if (tempId == 0 || !beginTransaction())
+        return 0;
+
+    // one prepared statement per table for the whole batch
+    QSqlQuery userQ(m_db);
+    userQ.prepare("INSERT OR REPLACE INTO users (id, name, age) VALUES (?, ?, ?)");
+    QSqlQuery opQ(m_db);
+    if (!m_outbox)
+        opQ.prepare("INSERT INTO pending_ops (op_type, server_id, local_temp_id, name, age, created_at) "
+                    "VALUES ('insert', NULL, ?, ?, ?, ?)");
+
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    for (const UserRecord &u : users)
+    {
+        userQ.bindValue(0, tempId);
+        userQ.bindValue(1, u.name);
+        userQ.bindValue(2, u.age);
+        bool queued;
+        if (m_outbox) {
+            PendingOp op;
+            op.type = PendingOp::Insert;
+            op.localTempId = tempId;
+            op.name = u.name;
+            op.age = u.age;
+            op.createdAt = now;
+            queued = outboxForWrite()->append(std::move(op)) != 0;
+        } else {
+            opQ.bindValue(0, tempId);
+            opQ.bindValue(1, u.name);
+            opQ.bindValue(2, u.age);
+            opQ.bindValue(3, now);
+            queued = opQ.exec();
+        }
+        if (!userQ.exec() || !queued) {
+            qWarning() << "insertPendingUsers failed:" << userQ.lastError().text() << opQ.lastError().text();
+            rollbackTransaction();
+            return 0;
+        }
+        tempId--;
+    }
+
+    if (!commitTransaction()) {
+        rollbackTransaction();
+        return 0;
+    }
+    return users.size();
+}
+
+bool LocalDB::forEachUser(const std::function<bool(UserRecord &&user)> &fn, UserOrder order)
+{
+    UM_TRACE_SCOPE("LocalDB::forEachUser");
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    if (!q.exec(QStringLiteral("SELECT id, name, age FROM users ORDER BY %1")
+                    .arg(QLatin1String(orderByClause(order))))) {
+        qWarning() << "forEachUser failed:" << q.lastError().text();
+        return false;
+    }
+
+    while (q.next()) {
+        if (!fn(UserRecord{ q.value(0).toInt(), q.value(1).toString(), q.value(2).toInt() }))
+            break;
+    }
+    return true;
+}
+
+bool LocalDB::forEachPooledUser(NamePool &pool, const std::function<bool(const PooledUserRecord &user)> &fn,
+                                UserOrder order)
+{
+    UM_TRACE_SCOPE("LocalDB::forEachPooledUser");
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    // a blob comes back as the stored UTF-8, no UTF-16 QString per row
+    if (!q.exec(QStringLiteral("SELECT id, CAST(name AS BLOB), age FROM users ORDER BY %1")
+                    .arg(QLatin1String(orderByClause(order))))) {
+        qWarning() << "forEachPooledUser failed:" << q.lastError().text();
+        return false;
+    }
+
+    while (q.next()) {
+        const QByteArray name = q.value(1).toByteArray();
+        if (!fn(PooledUserRecord{ q.value(0).toInt(), pool.intern(name.constData(), name.size()), q.value(2).toInt() }))
+            break;
+    }
+    return true;
+}
+
+void LocalDB::setOutboxLogDirectory(const QString &directory)
+{
+    m_outboxDirectory = directory;
+}
+
+QString LocalDB::outboxLogDirectory() const
+{
+    return m_outboxDirectory;
+}
+
+OutboxLog *LocalDB::outboxLog() const
+{
+    return m_outbox.get();
+}
+
+bool LocalDB::openOutboxLog()
+{
+    const QString path = QFileInfo(m_outboxDirectory).absoluteFilePath();
+    auto log = std::make_unique<OutboxLog>(path);
+    if (!log->open(syncState("outbox_batch", "0").toUInt()))
+        return false;
+
+    // read while the table still backs the pending ops
+    const PendingOps queued = loadPendingOperations();
+    m_outbox = std::move(log);
+    if (queued.isEmpty() && syncState("outbox_log") == path)
+        return true;
+
+    if (!beginTransaction())
+        return false;
+    for (const PendingOp &op : queued) {
+        if (outboxForWrite()->append(op) == 0) {
+            rollbackTransaction();
+            return false;
+        }
+    }
+    // from here on the ops live in the log: a run without it has to find
+    // them (restoreOutboxLog)
+    QSqlQuery q(m_db);
+    q.prepare("INSERT OR REPLACE INTO sync_state (key, value) VALUES ('outbox_log', ?)");
+    q.addBindValue(path);
+    if (!q.exec() || !q.exec("DELETE FROM pending_ops")) {
+        qWarning() << "openOutboxLog FAILED:" << q.lastError().text();
+        rollbackTransaction();
+        return false;
+    }
+    if (!commitTransaction()) {
+        rollbackTransaction();
+        return false;
     }
+    if (!queued.isEmpty())
+        qDebug() << "Moved" << queued.size() << "pending ops into the outbox log";
+    return true;
 }
 
-void LocalDB::addPendingOperation(const QString &opType, int serverId, int localTempId, const QString &name, int age)
+bool LocalDB::restoreOutboxLog()
 {
+    // the log last used still holds the ops unless it is the one to open
+    const QString recorded = syncState("outbox_log");
+    if (recorded.isEmpty()
+        || (!m_outboxDirectory.isEmpty() && QFileInfo(m_outboxDirectory).absoluteFilePath() == recorded))
+        return true;
+
+    auto log = std::make_unique<OutboxLog>(recorded);
+    if (!log->open(syncState("outbox_batch", "0").toUInt())) {
+        qWarning() << "Pending ops are in the outbox log at" << recorded << "which cannot be opened";
+        return false;
+    }
+    const PendingOps ops = log->ops();
+
+    // acked in the same batch, so the log and the table never both hold them
+    m_outbox = std::move(log);
+    bool ok = beginTransaction();
+    if (ok) {
+        QSqlQuery q(m_db);
+        q.prepare("INSERT INTO pending_ops (op_type, server_id, local_temp_id, name, age, created_at, "
+                  "attempts, next_attempt_at, error_class) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        for (const PendingOp &op : ops) {
+            q.bindValue(0, op.type == PendingOp::Insert ? QStringLiteral("insert") : QStringLiteral("delete"));
+            q.bindValue(1, op.serverId == 0 ? QVariant() : QVariant(op.serverId));
+            q.bindValue(2, op.localTempId == 0 ? QVariant() : QVariant(op.localTempId));
+            q.bindValue(3, op.name);
+            q.bindValue(4, op.age);
+            q.bindValue(5, op.createdAt);
+            q.bindValue(6, op.attempts);
+            q.bindValue(7, op.nextAttemptAt);
+            q.bindValue(8, op.errorClass.isEmpty() ? QVariant() : QVariant(op.errorClass));
+            if (!q.exec() || !outboxForWrite()->ack(op.pendingId)) {
+                ok = false;
+                break;
+            }
+        }
+        ok = ok && q.exec("DELETE FROM sync_state WHERE key = 'outbox_log'");
+        if (!ok)
+            qWarning() << "restoreOutboxLog FAILED:" << q.lastError().text();
+        if (!ok || !commitTransaction()) {
+            rollbackTransaction();
+            ok = false;
+        }
+    }
+    m_outbox.reset();
+
+    if (ok)
+        qDebug() << "Moved" << ops.size() << "pending ops from the outbox log at" << recorded << "back into the table";
+    return ok;
+}
+
+OutboxLog *LocalDB::outboxForWrite()
+{
+    // inside a transaction the records count only if it commits
+    if (m_inTransaction && m_outbox->batch() == 0)
+        m_outbox->beginBatch();
+    return m_outbox.get();
+}
+
+bool LocalDB::addPendingOperation(const QString &opType, int serverId, int localTempId, const QString &name, int age)
+{
+    if (m_outbox) {
+        PendingOp op;
+        op.type = PendingOp::typeFromString(opType);
+        op.serverId = qMax(0, serverId);
+        op.localTempId = localTempId;
+        op.name = name;
+        op.age = age;
+        op.createdAt = QDateTime::currentSecsSinceEpoch();
+        if (outboxForWrite()->append(std::move(op)) == 0) {
+            qWarning() << "addPendingOperation failed: outbox log append";
+            return false;
+        }
+        return true;
+    }
+
     QSqlQuery q(m_db);
     q.prepare("INSERT INTO pending_ops (op_type, server_id, local_temp_id, name, age, created_at) VALUES (?, ?, ?, ?, ?, ?)");
     q.addBindValue(opType);
@@ -116,34 +758,88 @@ void LocalDB::addPendingOperation(const QString &opType, int serverId, int local
     q.addBindValue(QDateTime::currentSecsSinceEpoch());
     if (!q.exec()) {
         qWarning() << "addPendingOperation failed:" << q.lastError().text();
+        return false;
     }
+    return true;
 }
 
-QList<QVariantMap> LocalDB::loadPendingOperations()
+PendingOps LocalDB::loadPendingOperations()
 {
-    QList<QVariantMap> result;
-    QSqlQuery q(m_db);
-    if (!q.exec("SELECT id, op_type, server_id, local_temp_id, name, age, created_at FROM pending_ops ORDER BY created_at ASC")) {
+    if (m_outbox)
+        return m_outbox->ops();
+
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    if (!q.exec("SELECT id, op_type, server_id, local_temp_id, name, age, created_at, "
+                "attempts, next_attempt_at, error_class FROM pending_ops ORDER BY created_at ASC, id ASC")) {
         qWarning() << "loadPendingOperations FAILED:" << q.lastError().text();
-        return result;
+        return {};
     }
+    return readPendingOperations(q);
+}
+
+PendingOps LocalDB::loadDuePendingOperations(qint64 nowMs)
+{
+    UM_TRACE_SCOPE("LocalDB::loadDuePendingOperations");
+    if (m_outbox)
+        return m_outbox->dueOps(nowMs);
 
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    q.prepare("SELECT id, op_type, server_id, local_temp_id, name, age, created_at, "
+              "attempts, next_attempt_at, error_class FROM pending_ops "
+              "WHERE next_attempt_at <= ? ORDER BY created_at ASC, id ASC");
+    q.addBindValue(nowMs);
+    if (!q.exec()) {
+        qWarning() << "loadDuePendingOperations FAILED:" << q.lastError().text();
+        return {};
+    }
+    return readPendingOperations(q);
+}
+
+PendingOps LocalDB::readPendingOperations(QSqlQuery &q)
+{
+    PendingOps result;
     while (q.next()) {
-        QVariantMap m;
-        m["pending_id"] = q.value(0).toInt();
-        m["op_type"] = q.value(1).toString();
-        m["server_id"] = q.value(2).isNull() ? QVariant() : q.value(2).toInt();
-        m["local_temp_id"] = q.value(3).isNull() ? QVariant() : q.value(3).toInt();
-        m["name"] = q.value(4).toString();
-        m["age"] = q.value(5).toInt();
-        m["created_at"] = q.value(6).toLongLong();
-        result.append(m);
+        PendingOp op;
+        op.pendingId = q.value(0).toInt();
+        op.type = PendingOp::typeFromString(q.value(1).toString());
+        op.serverId = q.value(2).toInt();      // NULL -> 0
+        op.localTempId = q.value(3).toInt();
+        op.name = q.value(4).toString();
+        op.age = q.value(5).toInt();
+        op.createdAt = q.value(6).toLongLong();
+        op.attempts = q.value(7).toInt();
+        op.nextAttemptAt = q.value(8).toLongLong();
+        op.errorClass = q.value(9).toString();
+        result.append(std::move(op));
     }
     return result;
 }
 
+int LocalDB::countPendingOperations()
+{
+    if (m_outbox)
+        return m_outbox->count();
+
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    if (!q.exec("SELECT COUNT(*) FROM pending_ops") || !q.next()) {
+        qWarning() << "countPendingOperations FAILED:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toInt();
+}
+
 void LocalDB::removePendingOperation(int pendingId)
 {
+    if (m_outbox) {
+        outboxForWrite()->ack(pendingId);
+        return;
+    }
+
     QSqlQuery q(m_db);
     q.prepare("DELETE FROM pending_ops WHERE id = ?");
     q.addBindValue(pendingId);
@@ -152,8 +848,187 @@ void LocalDB::removePendingOperation(int pendingId)
     }
 }
 
+void LocalDB::markPendingRetry(int pendingId, int attempts, qint64 nextAttemptAt,
+                               const QString &errorClass, const QString &error)
+{
+    // the log keeps no last error, dead letters get it from moveToDeadLetter()
+    if (m_outbox) {
+        outboxForWrite()->markRetry(pendingId, attempts, nextAttemptAt, errorClass);
+        return;
+    }
+
+    QSqlQuery q(m_db);
+    q.prepare("UPDATE pending_ops SET attempts = ?, next_attempt_at = ?, error_class = ?, last_error = ? "
+              "WHERE id = ?");
+    q.addBindValue(attempts);
+    q.addBindValue(nextAttemptAt);
+    q.addBindValue(errorClass);
+    q.addBindValue(error);
+    q.addBindValue(pendingId);
+    if (!q.exec()) {
+        qWarning() << "markPendingRetry FAILED:" << q.lastError().text();
+    }
+}
+
+qint64 LocalDB::nextPendingAttemptAt()
+{
+    if (m_outbox)
+        return m_outbox->nextAttemptAt();
+
+    QSqlQuery q(m_db);
+    if (!q.exec("SELECT MIN(next_attempt_at) FROM pending_ops") || !q.next()) {
+        qWarning() << "nextPendingAttemptAt FAILED:" << q.lastError().text();
+        return -1;
+    }
+    return q.value(0).isNull() ? -1 : q.value(0).toLongLong();
+}
+
+bool LocalDB::moveToDeadLetter(int pendingId, int attempts,
+                               const QString &errorClass, const QString &error)
+{
+    if (!beginTransaction())
+        return false;
+
+    QSqlQuery q(m_db);
+    PendingOp op;
+    if (!m_outbox) {
+        q.prepare("INSERT INTO dead_ops (pending_id, op_type, server_id, local_temp_id, name, age, "
+                  "created_at, attempts, error_class, last_error, failed_at) "
+                  "SELECT id, op_type, server_id, local_temp_id, name, age, created_at, ?, ?, ?, ? "
+                  "FROM pending_ops WHERE id = ?");
+        q.addBindValue(attempts);
+        q.addBindValue(errorClass);
+        q.addBindValue(error);
+        q.addBindValue(QDateTime::currentSecsSinceEpoch());
+        q.addBindValue(pendingId);
+    } else if (m_outbox->find(pendingId, &op)) {
+        q.prepare("INSERT INTO dead_ops (pending_id, op_type, server_id, local_temp_id, name, age, "
+                  "created_at, attempts, error_class, last_error, failed_at) "
+                  "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        q.addBindValue(op.pendingId);
+        q.addBindValue(op.type == PendingOp::Insert ? QStringLiteral("insert") : QStringLiteral("delete"));
+        q.addBindValue(op.serverId > 0 ? QVariant(op.serverId) : QVariant());
+        q.addBindValue(op.localTempId != 0 ? QVariant(op.localTempId) : QVariant());
+        q.addBindValue(op.name);
+        q.addBindValue(op.age);
+        q.addBindValue(op.createdAt);
+        q.addBindValue(attempts);
+        q.addBindValue(errorClass);
+        q.addBindValue(error);
+        q.addBindValue(QDateTime::currentSecsSinceEpoch());
+    } else {
+        // acked meanwhile, like the SELECT finding no row
+        return commitTransaction();
+    }
+    if (!q.exec()) {
+        qWarning() << "moveToDeadLetter FAILED:" << q.lastError().text();
+        rollbackTransaction();
+        return false;
+    }
+
+    removePendingOperation(pendingId);
+    return commitTransaction();
+}
+
+DeadLetters LocalDB::loadDeadLetters()
+{
+    DeadLetters result;
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    if (!q.exec("SELECT id, pending_id, op_type, server_id, local_temp_id, name, age, "
+                "attempts, error_class, last_error, failed_at FROM dead_ops ORDER BY id")) {
+        qWarning() << "loadDeadLetters FAILED:" << q.lastError().text();
+        return result;
+    }
+
+    while (q.next()) {
+        DeadLetter d;
+        d.deadId = q.value(0).toInt();
+        d.op.pendingId = q.value(1).toInt();
+        d.op.type = PendingOp::typeFromString(q.value(2).toString());
+        d.op.serverId = q.value(3).toInt();
+        d.op.localTempId = q.value(4).toInt();
+        d.op.name = q.value(5).toString();
+        d.op.age = q.value(6).toInt();
+        d.op.attempts = q.value(7).toInt();
+        d.op.errorClass = q.value(8).toString();
+        d.lastError = q.value(9).toString();
+        d.failedAt = q.value(10).toLongLong();
+        result.append(std::move(d));
+    }
+    return result;
+}
+
+int LocalDB::countDeadLetters()
+{
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    if (!q.exec("SELECT COUNT(*) FROM dead_ops") || !q.next()) {
+        qWarning() << "countDeadLetters FAILED:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toInt();
+}
+
+bool LocalDB::requeueDeadLetter(int deadId)
+{
+    if (!beginTransaction())
+        return false;
+
+    QSqlQuery q(m_db);
+    if (m_outbox) {
+        q.prepare("SELECT op_type, server_id, local_temp_id, name, age, created_at FROM dead_ops WHERE id = ?");
+        q.addBindValue(deadId);
+        if (!q.exec()) {
+            qWarning() << "requeueDeadLetter FAILED:" << q.lastError().text();
+            rollbackTransaction();
+            return false;
+        }
+        if (q.next()) {
+            PendingOp op;
+            op.type = PendingOp::typeFromString(q.value(0).toString());
+            op.serverId = q.value(1).toInt();
+            op.localTempId = q.value(2).toInt();
+            op.name = q.value(3).toString();
+            op.age = q.value(4).toInt();
+            op.createdAt = q.value(5).toLongLong();
+            if (outboxForWrite()->append(std::move(op)) == 0) {
+                rollbackTransaction();
+                return false;
+            }
+        }
+    } else {
+        q.prepare("INSERT INTO pending_ops (op_type, server_id, local_temp_id, name, age, created_at) "
+                  "SELECT op_type, server_id, local_temp_id, name, age, created_at FROM dead_ops WHERE id = ?");
+        q.addBindValue(deadId);
+        if (!q.exec()) {
+            qWarning() << "requeueDeadLetter FAILED:" << q.lastError().text();
+            rollbackTransaction();
+            return false;
+        }
+    }
+
+    q.prepare("DELETE FROM dead_ops WHERE id = ?");
+    q.addBindValue(deadId);
+    if (!q.exec()) {
+        qWarning() << "requeueDeadLetter FAILED:" << q.lastError().text();
+        rollbackTransaction();
+        return false;
+    }
+    return commitTransaction();
+}
+
 bool LocalDB::removePendingInsertForLocalTempId(int tempId)
 {
+    if (m_outbox) {
+        for (const PendingOp &op : m_outbox->ops()) {
+            if (op.type == PendingOp::Insert && op.localTempId == tempId)
+                outboxForWrite()->ack(op.pendingId);
+        }
+        return true;
+    }
+
     QSqlQuery q(m_db);
     q.prepare("DELETE FROM pending_ops WHERE op_type='insert' AND local_temp_id=?");
     q.addBindValue(tempId);
@@ -164,24 +1039,740 @@ bool LocalDB::removePendingInsertForLocalTempId(int tempId)
     return true;
 }
 
-int LocalDB::generateTempId()
+bool LocalDB::enableChangeLog()
+{
+    QSqlQuery q(m_db);
+    const char *statements[] = {
+        "CREATE TABLE IF NOT EXISTS change_log ("
+        "seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "user_id INTEGER NOT NULL)",
+        // last_access updates are cache bookkeeping, not changes
+        "CREATE TRIGGER IF NOT EXISTS users_log_insert AFTER INSERT ON users "
+        "BEGIN INSERT INTO change_log (user_id) VALUES (NEW.id); END",
+        "CREATE TRIGGER IF NOT EXISTS users_log_update AFTER UPDATE OF id, name, age ON users "
+        "BEGIN INSERT INTO change_log (user_id) VALUES (OLD.id); "
+        "INSERT INTO change_log (user_id) SELECT NEW.id WHERE NEW.id <> OLD.id; END",
+        "CREATE TRIGGER IF NOT EXISTS users_log_delete AFTER DELETE ON users "
+        "BEGIN INSERT INTO change_log (user_id) VALUES (OLD.id); END",
+        // temp objects belong to this connection: only our own commits
+        // land in own_changes, and a rollback takes them out again
+        "CREATE TEMP TABLE IF NOT EXISTS own_changes (seq INTEGER PRIMARY KEY)",
+        "CREATE TEMP TRIGGER IF NOT EXISTS change_log_own AFTER INSERT ON main.change_log "
+        "BEGIN INSERT INTO own_changes (seq) VALUES (NEW.seq); END"
+    };
+    for (const char *sql : statements) {
+        if (!q.exec(sql)) {
+            qWarning() << "enableChangeLog FAILED:" << q.lastError().text();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LocalDB::disableChangeLog()
+{
+    // the triggers live in the file: left over from a shared run they would
+    // keep filling change_log with nobody pruning it
+    QSqlQuery q(m_db);
+    const char *statements[] = {
+        "DROP TRIGGER IF EXISTS users_log_insert",
+        "DROP TRIGGER IF EXISTS users_log_update",
+        "DROP TRIGGER IF EXISTS users_log_delete",
+        "DROP TABLE IF EXISTS change_log"
+    };
+    for (const char *sql : statements) {
+        if (!q.exec(sql)) {
+            qWarning() << "disableChangeLog FAILED:" << q.lastError().text();
+            return false;
+        }
+    }
+    return true;
+}
+
+qint64 LocalDB::dataVersion()
+{
+    // per connection: has to be asked on the same one every time
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    if (!q.exec("PRAGMA data_version") || !q.next()) {
+        qWarning() << "dataVersion FAILED:" << q.lastError().text();
+        return -1;
+    }
+    return q.value(0).toLongLong();
+}
+
+qint64 LocalDB::firstChangeSeq()
+{
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    if (!q.exec("SELECT COALESCE(MIN(seq), 0) FROM change_log") || !q.next()) {
+        qWarning() << "firstChangeSeq FAILED:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toLongLong();
+}
+
+qint64 LocalDB::lastChangeSeq()
+{
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    if (!q.exec("SELECT COALESCE(MAX(seq), 0) FROM change_log") || !q.next()) {
+        qWarning() << "lastChangeSeq FAILED:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toLongLong();
+}
+
+QList<int> LocalDB::changedUserIds(qint64 afterSeq, qint64 uptoSeq)
+{
+    UM_TRACE_SCOPE("LocalDB::changedUserIds");
+    // on the writer: only it sees which entries are its own
+    QList<int> ids;
+    QSqlQuery q(m_db);
+    q.setForwardOnly(true);
+    q.prepare("SELECT DISTINCT user_id FROM change_log WHERE seq > ? AND seq <= ? "
+              "AND seq NOT IN (SELECT seq FROM own_changes WHERE seq > ? AND seq <= ?)");
+    q.addBindValue(afterSeq);
+    q.addBindValue(uptoSeq);
+    q.addBindValue(afterSeq);
+    q.addBindValue(uptoSeq);
+    if (!q.exec()) {
+        qWarning() << "changedUserIds FAILED:" << q.lastError().text();
+        return ids;
+    }
+    while (q.next())
+        ids.append(q.value(0).toInt());
+    return ids;
+}
+
+qint64 LocalDB::ownChangeCount(qint64 afterSeq, qint64 uptoSeq)
+{
+    QSqlQuery q(m_db);
+    q.prepare("SELECT COUNT(*) FROM own_changes WHERE seq > ? AND seq <= ?");
+    q.addBindValue(afterSeq);
+    q.addBindValue(uptoSeq);
+    if (!q.exec() || !q.next()) {
+        qWarning() << "ownChangeCount FAILED:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toLongLong();
+}
+
+void LocalDB::forgetOwnChanges(qint64 uptoSeq)
+{
+    QSqlQuery q(m_db);
+    q.prepare("DELETE FROM own_changes WHERE seq <= ?");
+    q.addBindValue(uptoSeq);
+    if (!q.exec()) {
+        qWarning() << "forgetOwnChanges FAILED:" << q.lastError().text();
+    }
+}
+
+void LocalDB::pruneChangeLog(qint64 keep)
 {
     QSqlQuery q(m_db);
-    q.exec("SELECT MIN(id) FROM users");
-    if (q.next())
+    q.prepare("DELETE FROM change_log WHERE seq <= (SELECT MAX(seq) FROM change_log) - ?");
+    q.addBindValue(keep);
+    if (!q.exec()) {
+        qWarning() << "pruneChangeLog FAILED:" << q.lastError().text();
+    }
+}
+
+void LocalDB::loadUsersByIds(const QList<int> &ids, UserRecords &rows, QList<int> &evicted)
+{
+    UM_TRACE_SCOPE("LocalDB::loadUsersByIds");
+    ReaderSlot slot(m_readerSlots);
+    const int chunk = 500;
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+
+    for (int first = 0; first < ids.size(); first += chunk) {
+        const QList<int> part = ids.mid(first, chunk);
+        QStringList list;
+        for (int id : part)
+            list.append(QString::number(id));
+        const QString in = list.join(',');
+
+        if (!q.exec(QStringLiteral("SELECT id, name, age FROM users WHERE id IN (%1)").arg(in))) {
+            qWarning() << "loadUsersByIds FAILED:" << q.lastError().text();
+            return;
+        }
+        rows += readUsers(q);
+
+        if (!q.exec(QStringLiteral("SELECT id FROM evicted_users WHERE id IN (%1)").arg(in))) {
+            qWarning() << "loadUsersByIds FAILED:" << q.lastError().text();
+            return;
+        }
+        while (q.next())
+            evicted.append(q.value(0).toInt());
+    }
+}
+
+QString LocalDB::syncState(const QString &key, const QString &defaultValue)
+{
+    QSqlQuery q(m_db);
+    q.prepare("SELECT value FROM sync_state WHERE key = ?");
+    q.addBindValue(key);
+    if (!q.exec()) {
+        qWarning() << "syncState FAILED:" << q.lastError().text();
+        return defaultValue;
+    }
+    return q.next() ? q.value(0).toString() : defaultValue;
+}
+
+void LocalDB::setSyncState(const QString &key, const QString &value)
+{
+    QSqlQuery q(m_db);
+    q.prepare("INSERT OR REPLACE INTO sync_state (key, value) VALUES (?, ?)");
+    q.addBindValue(key);
+    q.addBindValue(value);
+    if (!q.exec()) {
+        qWarning() << "setSyncState FAILED:" << q.lastError().text();
+    }
+}
+
+bool LocalDB::commitSnapshotPage(int slice, int afterId, int uptoId, bool sliceDone,
+                                 const UserRecords &rows, const QSet<int> &skipIds,
+                                 QList<int> *evictedIds)
+{
+    UM_TRACE_SCOPE("LocalDB::commitSnapshotPage");
+    if (!beginTransaction())
+        return false;
+
+    bool ok = replaceRangeRows(afterId, uptoId, rows, skipIds, evictedIds);
+
+    QSqlQuery q(m_db);
+    if (ok) {
+        q.prepare("INSERT OR REPLACE INTO snapshot_slices (slice, cursor, done) VALUES (?, ?, ?)");
+        q.addBindValue(slice);
+        q.addBindValue(uptoId);
+        q.addBindValue(sliceDone ? 1 : 0);
+        ok = q.exec();
+        if (!ok)
+            qWarning() << "commitSnapshotPage FAILED:" << q.lastError().text();
+    }
+
+    if (!ok) {
+        rollbackTransaction();
+        return false;
+    }
+    return commitTransaction();
+}
+
+bool LocalDB::replaceRange(int afterId, int uptoId, const UserRecords &rows,
+                           const QSet<int> &skipIds, QList<int> *evictedIds)
+{
+    UM_TRACE_SCOPE("LocalDB::replaceRange");
+    if (!beginTransaction())
+        return false;
+
+    if (!replaceRangeRows(afterId, uptoId, rows, skipIds, evictedIds)) {
+        rollbackTransaction();
+        return false;
+    }
+    return commitTransaction();
+}
+
+bool LocalDB::replaceRangeRows(int afterId, int uptoId, const UserRecords &rows,
+                               const QSet<int> &skipIds, QList<int> *evictedIds)
+{
+    // keep the LRU state of the range: access times survive the refresh
+    // and evicted rows stay evicted in bounded mode
+    QSqlQuery q(m_db);
+    QHash<int, qint64> lastAccess;
+    QSet<int> evicted;
+    q.prepare("SELECT id, last_access FROM users WHERE id > ? AND id <= ?");
+    q.addBindValue(afterId);
+    q.addBindValue(uptoId);
+    bool ok = q.exec();
+    while (ok && q.next())
+        lastAccess.insert(q.value(0).toInt(), q.value(1).toLongLong());
+
+    if (ok && m_cacheLimit > 0) {
+        q.prepare("SELECT id FROM evicted_users WHERE id > ? AND id <= ?");
+        q.addBindValue(afterId);
+        q.addBindValue(uptoId);
+        ok = q.exec();
+        while (ok && q.next())
+            evicted.insert(q.value(0).toInt());
+    }
+
+    // rows the server no longer has in this id range go away
+    if (ok) {
+        q.prepare("DELETE FROM users WHERE id > ? AND id <= ?");
+        q.addBindValue(afterId);
+        q.addBindValue(uptoId);
+        ok = q.exec();
+    }
+
+    // the server rows are authoritative for the range, evicted or not
+    if (ok) {
+        q.prepare("DELETE FROM evicted_users WHERE id > ? AND id <= ?");
+        q.addBindValue(afterId);
+        q.addBindValue(uptoId);
+        ok = q.exec();
+    }
+
+    QSqlQuery insertQ(m_db);
+    insertQ.prepare("INSERT OR REPLACE INTO users (id, name, age, last_access, row_hash) VALUES (?, ?, ?, ?, ?)");
+    QSqlQuery markQ(m_db);
+    markQ.prepare("INSERT OR REPLACE INTO evicted_users (id, row_hash) VALUES (?, ?)");
+    for (int i = 0; ok && i < rows.size(); ++i)
     {
-        int minId = q.value(0).toInt();
-        return (minId <= 0 ? minId - 1 : -1);
+        const UserRecord &u = rows.at(i);
+        const int id = u.id;
+        // deleted locally, the delete is still on its way to the server
+        if (skipIds.contains(id))
+            continue;
+
+        if (evicted.contains(id)) {
+            markQ.bindValue(0, id);
+            markQ.bindValue(1, qint64(rowHash(id, u.name, u.age)));
+            ok = markQ.exec();
+            if (evictedIds)
+                evictedIds->append(id);
+            continue;
+        }
+
+        insertQ.bindValue(0, id);
+        insertQ.bindValue(1, u.name);
+        insertQ.bindValue(2, u.age);
+        insertQ.bindValue(3, lastAccess.value(id, 0));
+        insertQ.bindValue(4, qint64(rowHash(id, u.name, u.age)));
+        ok = insertQ.exec();
+    }
+
+    if (!ok) {
+        qWarning() << "replaceRange FAILED:" << q.lastError().text()
+                   << insertQ.lastError().text() << markQ.lastError().text();
+    }
+    return ok;
+}
+
+quint64 LocalDB::rowHash(int id, const QString &name, int age)
+{
+    // FNV-1a 64, same as the server
+    const QByteArray bytes = QByteArray::number(id) + ':' + name.toUtf8() + ':' + QByteArray::number(age);
+    quint64 h = 0xcbf29ce484222325ULL;
+    for (char c : bytes) {
+        h ^= uchar(c);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+QList<LocalDB::RangeHash> LocalDB::rangeHashes(qint64 lo, qint64 hi, int fanout)
+{
+    UM_TRACE_SCOPE("LocalDB::rangeHashes");
+    QList<RangeHash> children;
+    if (hi <= lo || fanout < 1)
+        return children;
+
+    // same split as the server: width = ceil((hi - lo) / fanout)
+    const qint64 width = qMax<qint64>(1, (hi - lo + fanout - 1) / fanout);
+    for (qint64 childLo = lo; childLo < hi; childLo += width)
+        children.append({ childLo, qMin(hi, childLo + width), 0, 0 });
+
+    ReaderSlot slot(m_readerSlots);
+    const QSqlDatabase db = readConnection();
+    QSqlQuery bucketQ(db);
+    bucketQ.setForwardOnly(true);
+    bucketQ.prepare("SELECT count, hash FROM merkle_buckets WHERE bucket >= ? AND bucket < ?");
+    QSqlQuery rowQ(db);
+    rowQ.setForwardOnly(true);
+    rowQ.prepare("SELECT row_hash FROM users WHERE id > ? AND id <= ? "
+                 "UNION ALL SELECT row_hash FROM evicted_users WHERE id > ? AND id <= ?");
+
+    // whole buckets from merkle_buckets, only the rows at the edges read
+    auto addRows = [&rowQ](RangeHash &child, qint64 from, qint64 to) {
+        if (to <= from)
+            return true;
+        rowQ.bindValue(0, from);
+        rowQ.bindValue(1, to);
+        rowQ.bindValue(2, from);
+        rowQ.bindValue(3, to);
+        if (!rowQ.exec())
+            return false;
+        while (rowQ.next()) {
+            child.hash ^= quint64(rowQ.value(0).toLongLong());
+            child.count++;
+        }
+        return true;
+    };
+
+    for (RangeHash &child : children) {
+        const qint64 firstBucket = (qMax<qint64>(0, child.lo) + kMerkleBucketIds - 1) / kMerkleBucketIds;
+        const qint64 endBucket = qMax<qint64>(0, child.hi) / kMerkleBucketIds;
+        bool ok;
+        if (firstBucket >= endBucket) {
+            ok = addRows(child, child.lo, child.hi);
+        } else {
+            bucketQ.bindValue(0, firstBucket);
+            bucketQ.bindValue(1, endBucket);
+            ok = bucketQ.exec();
+            while (ok && bucketQ.next()) {
+                child.count += bucketQ.value(0).toInt();
+                child.hash ^= quint64(bucketQ.value(1).toLongLong());
+            }
+            ok = ok && addRows(child, child.lo, firstBucket * kMerkleBucketIds)
+                 && addRows(child, endBucket * kMerkleBucketIds, child.hi);
+        }
+        if (!ok) {
+            qWarning() << "rangeHashes FAILED:" << bucketQ.lastError().text() << rowQ.lastError().text();
+            return QList<RangeHash>();
+        }
+    }
+    return children;
+}
+
+bool LocalDB::rebuildMerkleBuckets()
+{
+    UM_TRACE_SCOPE("LocalDB::rebuildMerkleBuckets");
+    if (!beginTransaction())
+        return false;
+
+    // the update trigger folds every rewritten hash in on top of the stale
+    // buckets, so those are replaced once all rows are done
+    QHash<qint64, RangeHash> buckets;
+    QSqlQuery q(m_db);
+    QSqlQuery updateQ(m_db);
+    updateQ.prepare("UPDATE users SET row_hash = ? WHERE id = ?");
+    bool ok = q.exec("SELECT id, name, age FROM users WHERE id > 0");
+    while (ok && q.next()) {
+        const int id = q.value(0).toInt();
+        const quint64 hash = rowHash(id, q.value(1).toString(), q.value(2).toInt());
+        updateQ.bindValue(0, qint64(hash));
+        updateQ.bindValue(1, id);
+        ok = updateQ.exec();
+
+        RangeHash &bucket = buckets[(id - 1) / kMerkleBucketIds];
+        bucket.hash ^= hash;
+        bucket.count++;
+    }
+
+    // evicted rows count with the hash they were evicted with; older files
+    // have none (0), the first reconcile of their range refetches it
+    ok = ok && q.exec("DELETE FROM evicted_users WHERE id IN (SELECT id FROM users)")
+         && q.exec("SELECT id, row_hash FROM evicted_users WHERE id > 0");
+    while (ok && q.next()) {
+        RangeHash &bucket = buckets[(q.value(0).toInt() - 1) / kMerkleBucketIds];
+        bucket.hash ^= quint64(q.value(1).toLongLong());
+        bucket.count++;
+    }
+
+    ok = ok && q.exec("DELETE FROM merkle_buckets");
+    QSqlQuery insertQ(m_db);
+    insertQ.prepare("INSERT INTO merkle_buckets (bucket, count, hash) VALUES (?, ?, ?)");
+    for (auto it = buckets.cbegin(); ok && it != buckets.cend(); ++it) {
+        insertQ.bindValue(0, it.key());
+        insertQ.bindValue(1, it->count);
+        insertQ.bindValue(2, qint64(it->hash));
+        ok = insertQ.exec();
+    }
+    ok = ok && q.exec("INSERT OR REPLACE INTO sync_state (key, value) VALUES ('merkle_buckets', '2')");
+
+    if (!ok) {
+        qWarning() << "rebuildMerkleBuckets FAILED:" << q.lastError().text()
+                   << updateQ.lastError().text() << insertQ.lastError().text();
+        rollbackTransaction();
+        return false;
+    }
+    return commitTransaction();
+}
+
+int LocalDB::maxUserId()
+{
+    QSqlQuery q(m_db);
+    if (!q.exec("SELECT MAX((SELECT COALESCE(MAX(id), 0) FROM users), "
+                "(SELECT COALESCE(MAX(id), 0) FROM evicted_users))") || !q.next()) {
+        qWarning() << "maxUserId FAILED:" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toInt();
+}
+
+QHash<int, int> LocalDB::loadSnapshotSlices()
+{
+    QHash<int, int> slices;
+    QSqlQuery q(m_db);
+    if (!q.exec("SELECT slice, cursor, done FROM snapshot_slices")) {
+        qWarning() << "loadSnapshotSlices FAILED:" << q.lastError().text();
+        return slices;
+    }
+    while (q.next())
+        slices.insert(q.value(0).toInt(), q.value(2).toInt() ? -1 : q.value(1).toInt());
+    return slices;
+}
+
+void LocalDB::clearSnapshotSlices()
+{
+    QSqlQuery q(m_db);
+    if (!q.exec("DELETE FROM snapshot_slices")) {
+        qWarning() << "clearSnapshotSlices FAILED:" << q.lastError().text();
+    }
+}
+
+void LocalDB::removeUsersOutside(int lowId, int highId)
+{
+    UM_TRACE_SCOPE("LocalDB::removeUsersOutside");
+    // temp ids (<= 0) are local rows, never part of a server snapshot
+    QSqlQuery q(m_db);
+    q.prepare("DELETE FROM users WHERE id > 0 AND (id <= ? OR id > ?)");
+    q.addBindValue(lowId);
+    q.addBindValue(highId);
+    if (!q.exec()) {
+        qWarning() << "removeUsersOutside FAILED:" << q.lastError().text();
+    }
+
+    q.prepare("DELETE FROM evicted_users WHERE id <= ? OR id > ?");
+    q.addBindValue(lowId);
+    q.addBindValue(highId);
+    if (!q.exec()) {
+        qWarning() << "removeUsersOutside FAILED:" << q.lastError().text();
+    }
+}
+
+void LocalDB::setCacheLimit(int maxRows)
+{
+    m_cacheLimit = qMax(0, maxRows);
+}
+
+int LocalDB::cacheLimit() const
+{
+    return m_cacheLimit;
+}
+
+void LocalDB::touchUsers(const QList<int> &ids)
+{
+    UM_TRACE_SCOPE("LocalDB::touchUsers");
+    if (ids.isEmpty() || !beginTransaction())
+        return;
+
+    QSqlQuery q(m_db);
+    q.prepare("UPDATE users SET last_access = ? WHERE id = ?");
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (int id : ids) {
+        q.bindValue(0, now);
+        q.bindValue(1, id);
+        if (!q.exec()) {
+            qWarning() << "touchUsers FAILED:" << q.lastError().text();
+            rollbackTransaction();
+            return;
+        }
     }
-    return -1;
+    commitTransaction();
+}
+
+QList<int> LocalDB::evictColdRows()
+{
+    UM_TRACE_SCOPE("LocalDB::evictColdRows");
+    QList<int> evicted;
+    if (m_cacheLimit <= 0)
+        return evicted;
+
+    QSqlQuery q(m_db);
+    if (!q.exec("SELECT COUNT(*) FROM users WHERE id > 0") || !q.next()) {
+        qWarning() << "evictColdRows FAILED:" << q.lastError().text();
+        return evicted;
+    }
+    const int excess = q.value(0).toInt() - m_cacheLimit;
+    if (excess <= 0)
+        return evicted;
+
+    // coldest first, rows with pending ops (and temp rows) never go
+    if (m_outbox) {
+        QSet<int> pinned;
+        for (const PendingOp &op : m_outbox->ops()) {
+            if (op.serverId > 0)
+                pinned.insert(op.serverId);
+        }
+        q.prepare("SELECT id FROM users WHERE id > 0 ORDER BY last_access ASC, id ASC LIMIT ?");
+        q.addBindValue(excess + pinned.size());
+        if (!q.exec()) {
+            qWarning() << "evictColdRows FAILED:" << q.lastError().text();
+            return evicted;
+        }
+        while (q.next() && evicted.size() < excess) {
+            const int id = q.value(0).toInt();
+            if (!pinned.contains(id))
+                evicted.append(id);
+        }
+    } else {
+        q.prepare("SELECT id FROM users WHERE id > 0 AND id NOT IN "
+                  "(SELECT server_id FROM pending_ops WHERE server_id IS NOT NULL) "
+                  "ORDER BY last_access ASC, id ASC LIMIT ?");
+        q.addBindValue(excess);
+        if (!q.exec()) {
+            qWarning() << "evictColdRows FAILED:" << q.lastError().text();
+            return evicted;
+        }
+        while (q.next())
+            evicted.append(q.value(0).toInt());
+    }
+
+    if (evicted.isEmpty() || !beginTransaction())
+        return QList<int>();
+
+    // the row hash stays behind in evicted_users
+    QSqlQuery markQ(m_db);
+    markQ.prepare("INSERT OR REPLACE INTO evicted_users (id, row_hash) SELECT id, row_hash FROM users WHERE id = ?");
+    QSqlQuery deleteQ(m_db);
+    deleteQ.prepare("DELETE FROM users WHERE id = ?");
+    for (int id : evicted) {
+        markQ.bindValue(0, id);
+        deleteQ.bindValue(0, id);
+        if (!markQ.exec() || !deleteQ.exec()) {
+            qWarning() << "evictColdRows FAILED:" << markQ.lastError().text() << deleteQ.lastError().text();
+            rollbackTransaction();
+            return QList<int>();
+        }
+    }
+
+    if (!commitTransaction())
+        return QList<int>();
+    return evicted;
+}
+
+QList<int> LocalDB::loadEvictedIds()
+{
+    QList<int> ids;
+    ReaderSlot slot(m_readerSlots);
+    QSqlQuery q(readConnection());
+    q.setForwardOnly(true);
+    if (!q.exec("SELECT id FROM evicted_users WHERE id NOT IN (SELECT id FROM users) ORDER BY id")) {
+        qWarning() << "loadEvictedIds FAILED:" << q.lastError().text();
+        return ids;
+    }
+    while (q.next())
+        ids.append(q.value(0).toInt());
+    return ids;
+}
+
+void LocalDB::storeFetchedUsers(const UserRecords &rows, const QList<int> &missingIds)
+{
+    UM_TRACE_SCOPE("LocalDB::storeFetchedUsers");
+    if (!beginTransaction())
+        return;
+
+    QSqlQuery insertQ(m_db);
+    insertQ.prepare("INSERT OR REPLACE INTO users (id, name, age, last_access, row_hash) VALUES (?, ?, ?, ?, ?)");
+    QSqlQuery unmarkQ(m_db);
+    unmarkQ.prepare("DELETE FROM evicted_users WHERE id = ?");
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (const UserRecord &u : rows) {
+        insertQ.bindValue(0, u.id);
+        insertQ.bindValue(1, u.name);
+        insertQ.bindValue(2, u.age);
+        insertQ.bindValue(3, now);
+        insertQ.bindValue(4, qint64(rowHash(u.id, u.name, u.age)));
+        unmarkQ.bindValue(0, u.id);
+        if (!insertQ.exec() || !unmarkQ.exec()) {
+            qWarning() << "storeFetchedUsers FAILED:" << insertQ.lastError().text() << unmarkQ.lastError().text();
+            rollbackTransaction();
+            return;
+        }
+    }
+
+    // gone on the server meanwhile
+    for (int id : missingIds) {
+        unmarkQ.bindValue(0, id);
+        unmarkQ.exec();
+    }
+    commitTransaction();
+}
+
+QSet<int> LocalDB::pendingDeleteIds()
+{
+    QSet<int> ids;
+    if (m_outbox) {
+        for (const PendingOp &op : m_outbox->ops()) {
+            if (op.type == PendingOp::Delete && op.serverId > 0)
+                ids.insert(op.serverId);
+        }
+        return ids;
+    }
+
+    QSqlQuery q(m_db);
+    if (!q.exec("SELECT server_id FROM pending_ops WHERE op_type = 'delete' AND server_id IS NOT NULL")) {
+        qWarning() << "pendingDeleteIds FAILED:" << q.lastError().text();
+        return ids;
+    }
+    while (q.next())
+        ids.insert(q.value(0).toInt());
+    return ids;
+}
+
+int LocalDB::generateTempId()
+{
+    return reserveTempIds(1);
+}
+
+int LocalDB::reserveTempIds(int count)
+{
+    if (m_nextTempId - count + 1 >= m_lowTempId) {
+        const int first = m_nextTempId;
+        m_nextTempId -= count;
+        return first;
+    }
+
+    // processes sharing the file claim disjoint blocks below the recorded
+    // floor; the write comes first so the claim holds the write lock before
+    // it reads anything. The rest of the previous block is given up.
+    const int blockSize = qMax(count, kTempIdBlock);
+    const bool ownTransaction = !m_inTransaction;
+    if (ownTransaction && !beginTransaction())
+        return 0;
+
+    QSqlQuery q(m_db);
+    bool ok = q.exec("INSERT OR IGNORE INTO sync_state (key, value) VALUES ('temp_id_floor', '0')");
+    if (ok) {
+        // ids already in the table (older files, rows from before) stay clear
+        q.prepare("UPDATE sync_state SET value = CAST(MIN(CAST(value AS INTEGER), "
+                  "COALESCE((SELECT MIN(id) FROM users), 0), 0) - ? AS TEXT) "
+                  "WHERE key = 'temp_id_floor'");
+        q.addBindValue(blockSize);
+        ok = q.exec();
+    }
+    ok = ok && q.exec("SELECT value FROM sync_state WHERE key = 'temp_id_floor'") && q.next();
+    const qint64 floor = ok ? q.value(0).toLongLong() : 0;
+    if (!ok || floor < std::numeric_limits<int>::min()) {
+        qWarning() << "reserveTempIds FAILED:" << q.lastError().text();
+        if (ownTransaction)
+            rollbackTransaction();
+        return 0;
+    }
+    q.finish();
+    if (ownTransaction && !commitTransaction()) {
+        rollbackTransaction();
+        return 0;
+    }
+
+    m_lowTempId = int(floor);
+    m_nextTempId = int(floor) + blockSize - 1;
+    const int first = m_nextTempId;
+    m_nextTempId -= count;
+    return first;
 }
 
 void LocalDB::replaceTempId(int tempId, int realId)
 {
     QSqlQuery q(m_db);
 
-    q.prepare("UPDATE users SET id = ? WHERE id = ?");
+    // the hash covers the id: temp rows carry none that counts
+    q.prepare("SELECT name, age FROM users WHERE id = ?");
+    q.addBindValue(tempId);
+    if (!q.exec()) {
+        qWarning() << "replaceTempId FAILED:" << q.lastError();
+        return;
+    }
+    if (!q.next())
+        return;
+    const quint64 hash = rowHash(realId, q.value(0).toString(), q.value(1).toInt());
+
+    q.prepare("UPDATE users SET id = ?, row_hash = ? WHERE id = ?");
     q.addBindValue(realId);
+    q.addBindValue(qint64(hash));
     q.addBindValue(tempId);
 
     if (!q.exec())
@@ -4,7 +4,17 @@
 #include <QObject>
 #include <QSqlDatabase>
 #include <QList>
-#include <QVariantMap>
+#include <QMutex>
+#include <QSemaphore>
+#include <QHash>
+#include <QSet>
+#include <functional>
+#include <memory>
+#include "records.h"
+
+class QSqlQuery;
+class NamePool;
+class OutboxLog;
 
 class LocalDB : public QObject
 {
@@ -13,29 +23,174 @@ public:
     explicit LocalDB(QObject *parent = nullptr);
     ~LocalDB();
 
+    void setDatabasePath(const QString &path);
+    QString databasePath() const;
+
     bool open();
     bool createTable();
 
+    // connection pool: one writer (owner thread) + one read-only
+    // connection per reading thread, at most maxReaders() reading at once
+    void setMaxReaders(int count);
+    int maxReaders() const;
+    QSqlDatabase readConnection();
+
+    // explicit transactions on the writer connection
+    bool beginTransaction();
+    bool commitTransaction();
+    void rollbackTransaction();
+
     // users
-    QList<QVariantMap> loadUsers();
-    void insertUser(int id, const QString &name, int age); // insert or replace
-    void saveUser(const QString &name, int age, int id);   // alias
-    void deleteUser(int id);
+    UserRecords loadUsers();
+    UserRecords loadUsersPage(int offset, int limit, UserOrder order = UserOrder::ById);
+    UserRecords searchUsers(const QString &pattern, int limit = 100);
+    int countUsers();
+    bool insertUser(int id, const QString &name, int age); // insert or replace
+    bool saveUser(const QString &name, int age, int id);   // alias
+    bool deleteUser(int id);
     void clearUsers();
 
-    // pending ops
-    void addPendingOperation(const QString &opType, int serverId, int localTempId, const QString &name, int age);
-    QList<QVariantMap> loadPendingOperations();
+    // bulk: new rows with temp ids + their pending inserts, one transaction
+    int insertPendingUsers(const UserRecords &users);
+    // streams all rows in the given order without building a list, stops
+    // when fn returns false; the record can be moved out
+    bool forEachUser(const std::function<bool(UserRecord &&user)> &fn, UserOrder order = UserOrder::ById);
+    // same, names interned into pool straight from their UTF-8 bytes
+    bool forEachPooledUser(NamePool &pool, const std::function<bool(const PooledUserRecord &user)> &fn,
+                           UserOrder order = UserOrder::ById);
+
+    // pending ops, in the pending_ops table or, with a directory set
+    // before createTable(), in an append-only segment log (outboxlog.h);
+    // ops still in the table move to the log when it is opened, and back
+    // when a later run has no (or another) directory set
+    void setOutboxLogDirectory(const QString &directory);
+    QString outboxLogDirectory() const;
+    OutboxLog *outboxLog() const;
+
+    bool addPendingOperation(const QString &opType, int serverId, int localTempId, const QString &name, int age);
+    PendingOps loadPendingOperations();
+    PendingOps loadDuePendingOperations(qint64 nowMs);
+    int countPendingOperations();
     void removePendingOperation(int pendingId);
     bool removePendingInsertForLocalTempId(int tempId);
 
-    // temp id generator
+    // retry state: next_attempt_at is in ms since epoch, -1 = queue empty
+    void markPendingRetry(int pendingId, int attempts, qint64 nextAttemptAt,
+                          const QString &errorClass, const QString &error);
+    qint64 nextPendingAttemptAt();
+
+    // dead letters: ops that failed for good, kept for inspection/requeue
+    bool moveToDeadLetter(int pendingId, int attempts,
+                          const QString &errorClass, const QString &error);
+    DeadLetters loadDeadLetters();
+    int countDeadLetters();
+    bool requeueDeadLetter(int deadId);
+
+    // bounded cache: at most limit server rows stay local (0 = no limit),
+    // the least recently used ones without pending ops are evicted
+    void setCacheLimit(int maxRows);
+    int cacheLimit() const;
+    void touchUsers(const QList<int> &ids);
+    QList<int> evictColdRows();
+    QList<int> loadEvictedIds();
+    // rows fetched on demand: back in the cache, no longer evicted
+    void storeFetchedUsers(const UserRecords &rows, const QList<int> &missingIds);
+
+    // shared replica: triggers log every users change into change_log so
+    // other processes on the same file can pick up just those rows
+    bool enableChangeLog();
+    // drops the triggers and the log again, for a file no longer shared
+    bool disableChangeLog();
+    // changes whenever another connection committed (PRAGMA data_version)
+    qint64 dataVersion();
+    qint64 firstChangeSeq();
+    qint64 lastChangeSeq();
+    // ids changed in (afterSeq, uptoSeq] by other connections
+    QList<int> changedUserIds(qint64 afterSeq, qint64 uptoSeq);
+    // entries this connection wrote itself, forgotten once polled past
+    qint64 ownChangeCount(qint64 afterSeq, qint64 uptoSeq);
+    void forgetOwnChanges(qint64 uptoSeq);
+    void pruneChangeLog(qint64 keep);
+    // current state of ids: rows still here, ids only evicted; the rest is gone
+    void loadUsersByIds(const QList<int> &ids, UserRecords &rows, QList<int> &evicted);
+
+    // key/value sync bookkeeping (snapshot progress etc.)
+    QString syncState(const QString &key, const QString &defaultValue = QString());
+    void setSyncState(const QString &key, const QString &value);
+
+    // paged snapshot: one page replaces the server rows in (afterId, uptoId]
+    // and moves the slice cursor forward, all in one transaction
+    bool commitSnapshotPage(int slice, int afterId, int uptoId, bool sliceDone,
+                            const UserRecords &rows, const QSet<int> &skipIds,
+                            QList<int> *evictedIds = nullptr);
+    // same replacement of (afterId, uptoId] outside a snapshot
+    bool replaceRange(int afterId, int uptoId, const UserRecords &rows,
+                      const QSet<int> &skipIds, QList<int> *evictedIds = nullptr);
+    // slice -> cursor (last committed id), done slices map to -1
+    QHash<int, int> loadSnapshotSlices();
+    void clearSnapshotSlices();
+    // drops server rows outside (lowId, highId] once a snapshot completed
+    void removeUsersOutside(int lowId, int highId);
+    QSet<int> pendingDeleteIds();
+
+    // Merkle reconciliation: a row hashes to FNV-1a 64 of "id:name:age",
+    // a range (lo, hi] to the XOR of its rows, evicted ones included with
+    // the hash they were evicted with. Triggers keep the XOR of fixed id
+    // buckets in merkle_buckets, so only the rows at the edges of a range
+    // are read.
+    struct RangeHash
+    {
+        qint64 lo;
+        qint64 hi;
+        int count;
+        quint64 hash;
+    };
+    static quint64 rowHash(int id, const QString &name, int age);
+    // hashes of the fanout equal-width children of (lo, hi]
+    QList<RangeHash> rangeHashes(qint64 lo, qint64 hi, int fanout);
+    // cached or evicted
+    int maxUserId();
+
+    // temp id generator: negative ids from a block claimed in sync_state,
+    // unique across processes sharing the file; 0 on failure
     int generateTempId();
 
     void replaceTempId(int tempId, int realId);
 
 private:
+    void closeReaders();
+    bool openOutboxLog();
+    // moves the ops of a log recorded in sync_state but not configured
+    // now back into pending_ops
+    bool restoreOutboxLog();
+    bool rebuildMerkleBuckets();
+    // first of count consecutive descending temp ids
+    int reserveTempIds(int count);
+    OutboxLog *outboxForWrite();
+    bool ensureColumn(const QString &table, const QString &column, const QString &definition);
+    static UserRecords readUsers(QSqlQuery &q);
+    static const char *orderByClause(UserOrder order);
+    static PendingOps readPendingOperations(QSqlQuery &q);
+    bool replaceRangeRows(int afterId, int uptoId, const UserRecords &rows,
+                          const QSet<int> &skipIds, QList<int> *evictedIds);
+
+    // "local_<n>", unique per instance; readers append the thread
+    const QString m_connectionName;
     QSqlDatabase m_db;
+    QString m_path = QStringLiteral("local_users.db");
+    // current temp id block: next id handed out, lowest id in it
+    int m_nextTempId = 0;
+    int m_lowTempId = 1;
+    int m_cacheLimit = 0;
+    bool m_inTransaction = false;
+
+    QString m_outboxDirectory;
+    std::unique_ptr<OutboxLog> m_outbox;
+
+    int m_maxReaders = 4;
+    QSemaphore m_readerSlots;
+    QMutex m_readersMutex;
+    QStringList m_readerNames;
 };
 
 #endif // LOCALDB_H
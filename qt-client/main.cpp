@@ -1,7 +1,11 @@
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
 #include <QQmlContext>
+#include <QQuickItem>
+#include <QQuickWindow>
 #include "DbUserModel.h"
+#include "modelbench.h"
+#include "trace.h"
 
 int main(int argc, char *argv[])
 {
@@ -13,6 +17,8 @@ int main(int argc, char *argv[])
 
     QQmlApplicationEngine engine;
     DbUserModel *model = new DbUserModel();
+    // bounded local cache, unset = keep every row
+    model->setCacheLimit(qEnvironmentVariableIntValue("USERMANAGER_CACHE_LIMIT"));
 
     engine.rootContext()->setContextProperty("_dbUserModel", model);
 
@@ -24,5 +30,27 @@ int main(int argc, char *argv[])
 
     engine.load(url);
 
+    // frame-time benchmark of the list instead of normal use
+    const int benchUpdates = qEnvironmentVariableIntValue("USERMANAGER_BENCH_UPDATES");
+    if (benchUpdates > 0) {
+        auto *window = qobject_cast<QQuickWindow*>(engine.rootObjects().value(0));
+        QQuickItem *view = window ? window->findChild<QQuickItem*>("userList") : nullptr;
+        if (view) {
+            auto *bench = new ModelBench(window, view, model, &app);
+            bench->setUpdatesPerFrame(benchUpdates);
+            if (qEnvironmentVariableIsSet("USERMANAGER_BENCH_ROWS"))
+                bench->setRows(qEnvironmentVariableIntValue("USERMANAGER_BENCH_ROWS"));
+            bench->start();
+        }
+    }
+
+    // trace builds: dump the recorded events when the app quits
+    const QString traceFile = qEnvironmentVariable("USERMANAGER_TRACE_FILE");
+    if (!traceFile.isEmpty()) {
+        QObject::connect(&app, &QCoreApplication::aboutToQuit, [traceFile]() {
+            Trace::writeChromeJson(traceFile);
+        });
+    }
+
     return app.exec();
 }
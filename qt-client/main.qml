@@ -25,6 +25,7 @@ Window {
 
             ListView {
                 id: userList
+                objectName: "userList"
                 anchors.fill: parent
                 model: _dbUserModel
                 clip: true
@@ -110,6 +111,14 @@ Window {
                         ageInput.text = ""
                     }
                 }
+
+                // same order as DbUserModel::SortMode
+                ComboBox {
+                    Layout.preferredWidth: 120
+                    model: ["Unsorted", "By id", "By name", "By age"]
+                    currentIndex: _dbUserModel.sortMode
+                    onActivated: _dbUserModel.sortMode = index
+                }
             }
         }
     }
@@ -0,0 +1,142 @@
+#include "modelbench.h"
+#include "dbusermodel.h"
+#include <QCoreApplication>
+#include <QQuickItem>
+#include <QQuickWindow>
+#include <QRandomGenerator>
+#include <QTextStream>
+#include <algorithm>
+
+namespace {
+// far above real server ids, the rows never reach the db
+const int kFirstSyntheticId = 1 << 30;
+}
+
+ModelBench::ModelBench(QQuickWindow *window, QQuickItem *view, DbUserModel *model, QObject *parent)
+    : QObject(parent), m_window(window), m_view(view), m_model(model)
+{
+}
+
+void ModelBench::setRows(int rows)
+{
+    m_rows = qMax(1, rows);
+}
+
+void ModelBench::setUpdatesPerFrame(int updates)
+{
+    m_updatesPerFrame = qMax(1, updates);
+}
+
+void ModelBench::setSeconds(int seconds)
+{
+    m_seconds = qMax(1, seconds);
+}
+
+void ModelBench::start()
+{
+    m_synthetic.reserve(m_rows);
+    for (int i = 0; i < m_rows; ++i)
+        m_synthetic.append(UserRecord{ kFirstSyntheticId + i, QStringLiteral("bench%1").arg(i % 5000), 18 + i % 60 });
+
+    QElapsedTimer timer;
+    timer.start();
+    m_model->applyChangedUsers(m_synthetic, {});
+    QTextStream(stdout) << "bench: " << m_rows << " rows added in " << timer.elapsed() << " ms, "
+                        << m_model->rowCount() << " in the model\n";
+
+    // GUI thread, once per frame
+    connect(m_window, &QQuickWindow::afterAnimating, this, &ModelBench::onFrame);
+    beginPhase(Delegates);
+}
+
+void ModelBench::beginPhase(Phase phase)
+{
+    m_phase = phase;
+    m_frameUs.clear();
+    m_workUs = 0;
+    m_rowsUpdated = 0;
+    m_signalsAtStart = m_model->dataChangedSignals();
+    m_phaseClock.start();
+    m_frameClock.invalidate();
+
+    if (phase == Done) {
+        disconnect(m_window, &QQuickWindow::afterAnimating, this, &ModelBench::onFrame);
+        QCoreApplication::quit();
+        return;
+    }
+    m_window->update();
+}
+
+void ModelBench::onFrame()
+{
+    if (m_frameClock.isValid())
+        m_frameUs.append(m_frameClock.nsecsElapsed() / 1000);
+    m_frameClock.start();
+
+    if (m_phaseClock.elapsed() >= m_seconds * 1000) {
+        report();
+        beginPhase(m_phase == Delegates ? Updates : Done);
+        return;
+    }
+
+    QElapsedTimer work;
+    work.start();
+    auto *rng = QRandomGenerator::global();
+    if (m_phase == Delegates) {
+        const int row = int(rng->bounded(quint32(qMax(1, m_model->rowCount()))));
+        // 0 = ListView.Beginning
+        QMetaObject::invokeMethod(m_view, "positionViewAtIndex", Q_ARG(int, row), Q_ARG(int, 0));
+    } else {
+        // a contiguous id run, as a replica batch usually is
+        const int count = qMin(m_updatesPerFrame, int(m_synthetic.size()));
+        const int first = int(rng->bounded(quint32(m_synthetic.size() - count + 1)));
+        UserRecords changed;
+        changed.reserve(count);
+        for (int i = first; i < first + count; ++i) {
+            UserRecord &u = m_synthetic[i];
+            u.age = 18 + (u.age - 17) % 60;
+            changed.append(u);
+        }
+        m_model->applyChangedUsers(changed, {});
+        m_rowsUpdated += count;
+    }
+    m_workUs += work.nsecsElapsed() / 1000;
+
+    // keep frames coming even when nothing on screen changed
+    m_window->update();
+}
+
+void ModelBench::report()
+{
+    QTextStream out(stdout);
+    const int frames = m_frameUs.size();
+    if (frames == 0) {
+        out << "bench: no frames rendered\n";
+        return;
+    }
+
+    QVector<qint64> sorted = m_frameUs;
+    std::sort(sorted.begin(), sorted.end());
+    qint64 total = 0;
+    int slow = 0;
+    for (qint64 us : sorted) {
+        total += us;
+        if (us > 16700)
+            slow++;
+    }
+
+    out << (m_phase == Delegates ? "delegates" : "updates") << ": " << frames << " frames, frame ms mean "
+        << QString::number(total / 1000.0 / frames, 'f', 2)
+        << " p95 " << QString::number(sorted.at(frames * 95 / 100) / 1000.0, 'f', 2)
+        << " max " << QString::number(sorted.last() / 1000.0, 'f', 2)
+        << ", " << slow << " over 16.7 ms, model ms/frame "
+        << QString::number(m_workUs / 1000.0 / frames, 'f', 3);
+    if (m_phase == Updates) {
+        const qint64 signalCount = m_model->dataChangedSignals() - m_signalsAtStart;
+        out << ", " << qint64(m_rowsUpdated * 1000 / qMax<qint64>(1, m_phaseClock.elapsed())) << " rows/s updated, "
+            << signalCount << " dataChanged (" << QString::number(double(m_rowsUpdated) / qMax<qint64>(1, signalCount), 'f', 1)
+            << " rows each)";
+    }
+    out << "\n";
+    out.flush();
+}
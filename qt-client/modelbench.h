@@ -0,0 +1,59 @@
+#ifndef MODELBENCH_H
+#define MODELBENCH_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QVector>
+#include "records.h"
+
+class DbUserModel;
+class QQuickItem;
+class QQuickWindow;
+
+// Frame-time benchmark of the user list, started by main.cpp when
+// USERMANAGER_BENCH_UPDATES is set. Adds synthetic rows to the model, then
+// runs two phases of a few seconds each:
+//  - delegates: the view jumps to a random row every frame, so a screen of
+//    delegates is created each time
+//  - updates: every frame a burst of changed rows goes through the model's
+//    replica change path (DbUserModel::applyChangedUsers, this class is a
+//    friend), like a replica catching up; the rows never reach the db
+// prints frame times and coalesced dataChanged counts, then quits.
+class ModelBench : public QObject
+{
+    Q_OBJECT
+public:
+    ModelBench(QQuickWindow *window, QQuickItem *view, DbUserModel *model, QObject *parent = nullptr);
+
+    void setRows(int rows);
+    void setUpdatesPerFrame(int updates);
+    void setSeconds(int seconds);
+
+    void start();
+
+private:
+    enum Phase { Delegates, Updates, Done };
+
+    void onFrame();
+    void beginPhase(Phase phase);
+    void report();
+
+    QQuickWindow *m_window;
+    QQuickItem *m_view;
+    DbUserModel *m_model;
+
+    int m_rows = 20000;
+    int m_updatesPerFrame = 1000;
+    int m_seconds = 5;
+
+    UserRecords m_synthetic;
+    Phase m_phase = Done;
+    QElapsedTimer m_phaseClock;
+    QElapsedTimer m_frameClock;
+    QVector<qint64> m_frameUs;
+    qint64 m_workUs = 0;
+    qint64 m_signalsAtStart = 0;
+    qint64 m_rowsUpdated = 0;
+};
+
+#endif // MODELBENCH_H
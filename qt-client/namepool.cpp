@@ -0,0 +1,180 @@
+#include "namepool.h"
+#include <QDebug>
+#include <QHash>
+#include <QMutexLocker>
+#include <QVarLengthArray>
+#include <cstring>
+
+namespace {
+const int kBlockSize = 64 * 1024;
+// longer names get a block of their own instead of wasting a tail
+const int kMaxInlineName = kBlockSize / 4;
+const quint32 kChunkSize = 4096;
+const quint32 kMaxChunks = 4096;    // 16M distinct names
+const size_t kInitialSlots = 1024;
+}
+
+NamePool::NamePool()
+    : m_chunks(new Entry *[kMaxChunks]())
+{
+    // handle 0: the empty name
+    m_chunks[0] = new Entry[kChunkSize];
+    m_chunks[0][0] = { "", 0, 0 };
+    m_count = 1;
+
+    m_slots.assign(kInitialSlots, 0);
+    m_stats.reservedBytes = qint64(kMaxChunks * sizeof(Entry *) + kChunkSize * sizeof(Entry)
+                                   + kInitialSlots * sizeof(Handle));
+}
+
+NamePool::~NamePool()
+{
+    for (quint32 i = 0; i < kMaxChunks && m_chunks[i]; ++i)
+        delete[] m_chunks[i];
+}
+
+NamePool &NamePool::shared()
+{
+    static NamePool pool;
+    return pool;
+}
+
+NamePool::Handle NamePool::intern(const QString &name)
+{
+    if (name.isEmpty())
+        return 0;
+
+    // most names are ASCII: narrow them on the stack, no QByteArray
+    QVarLengthArray<char, 256> ascii(name.size());
+    const QChar *chars = name.constData();
+    for (int i = 0; i < name.size(); ++i) {
+        const ushort c = chars[i].unicode();
+        if (c >= 0x80) {
+            const QByteArray utf8 = name.toUtf8();
+            return intern(utf8.constData(), utf8.size());
+        }
+        ascii[i] = char(c);
+    }
+    return intern(ascii.constData(), ascii.size());
+}
+
+NamePool::Handle NamePool::intern(const char *utf8, int size)
+{
+    if (size <= 0)
+        return 0;
+
+    const quint32 hash = quint32(qHashBits(utf8, size_t(size)));
+    QMutexLocker lock(&m_mutex);
+    m_stats.lookups++;
+
+    const size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; m_slots[i] != 0; i = (i + 1) & mask) {
+        const Entry &e = entry(m_slots[i]);
+        if (e.hash == hash && e.size == quint32(size) && std::memcmp(e.data, utf8, size_t(size)) == 0) {
+            m_stats.hits++;
+            return m_slots[i];
+        }
+    }
+
+    if (m_count == kMaxChunks * kChunkSize) {
+        qWarning() << "NamePool: full, name not interned";
+        return 0;
+    }
+
+    const Handle name = m_count;
+    Entry *&chunk = m_chunks[name / kChunkSize];
+    if (!chunk) {
+        chunk = new Entry[kChunkSize];
+        m_stats.reservedBytes += qint64(kChunkSize * sizeof(Entry));
+    }
+    chunk[name % kChunkSize] = { store(utf8, size), quint32(size), hash };
+    m_count++;
+    m_stats.names++;
+    m_stats.nameBytes += size;
+
+    // at most half full
+    if (size_t(m_stats.names) * 2 > m_slots.size())
+        rehash(m_slots.size() * 2);
+    else
+        insertSlot(name);
+    return name;
+}
+
+QString NamePool::toString(Handle name) const
+{
+    if (name == 0)
+        return QString();
+
+    const Entry &e = entry(name);
+    return QString::fromUtf8(e.data, int(e.size));
+}
+
+const char *NamePool::utf8(Handle name, int *size) const
+{
+    const Entry &e = entry(name);
+    *size = int(e.size);
+    return e.data;
+}
+
+int NamePool::compare(Handle a, Handle b) const
+{
+    if (a == b)
+        return 0;
+
+    // memcmp on UTF-8 orders by code point
+    const Entry &ea = entry(a);
+    const Entry &eb = entry(b);
+    const int c = std::memcmp(ea.data, eb.data, qMin(ea.size, eb.size));
+    if (c != 0)
+        return c;
+    return ea.size < eb.size ? -1 : (ea.size > eb.size ? 1 : 0);
+}
+
+NamePool::Stats NamePool::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_stats;
+}
+
+const NamePool::Entry &NamePool::entry(Handle name) const
+{
+    return m_chunks[name / kChunkSize][name % kChunkSize];
+}
+
+const char *NamePool::store(const char *utf8, int size)
+{
+    char *dest;
+    if (size > kMaxInlineName) {
+        m_blocks.emplace_back(new char[size_t(size)]);
+        m_stats.reservedBytes += size;
+        dest = m_blocks.back().get();
+    } else {
+        if (!m_block || m_blockUsed + size > kBlockSize) {
+            m_blocks.emplace_back(new char[kBlockSize]);
+            m_stats.reservedBytes += kBlockSize;
+            m_block = m_blocks.back().get();
+            m_blockUsed = 0;
+        }
+        dest = m_block + m_blockUsed;
+        m_blockUsed += size;
+    }
+    std::memcpy(dest, utf8, size_t(size));
+    return dest;
+}
+
+void NamePool::insertSlot(Handle name)
+{
+    const size_t mask = m_slots.size() - 1;
+    size_t i = entry(name).hash & mask;
+    while (m_slots[i] != 0)
+        i = (i + 1) & mask;
+    m_slots[i] = name;
+}
+
+void NamePool::rehash(size_t slots)
+{
+    m_stats.reservedBytes += qint64((slots - m_slots.size()) * sizeof(Handle));
+    m_slots.assign(slots, 0);
+    for (Handle name = 1; name < m_count; ++name)
+        insertSlot(name);
+}
@@ -0,0 +1,79 @@
+#ifndef NAMEPOOL_H
+#define NAMEPOOL_H
+
+#include <QMutex>
+#include <QString>
+#include <memory>
+#include <vector>
+
+// Interned user names. Every distinct name is stored once, as UTF-8, in
+// append-only arena blocks; rows keep a 4-byte handle and build a QString
+// only when a view asks for it. Handle 0 is the empty name.
+//
+// Entries never move and are never freed (distinct names are few next to
+// rows), so resolving a handle takes no lock; interning does.
+class NamePool
+{
+public:
+    using Handle = quint32;
+
+    struct Stats
+    {
+        int names = 0;              // distinct, the empty name not counted
+        qint64 nameBytes = 0;       // UTF-8 payload
+        qint64 reservedBytes = 0;   // arena blocks + entry and hash tables
+        qint64 lookups = 0;
+        qint64 hits = 0;
+    };
+
+    NamePool();
+    ~NamePool();
+
+    NamePool(const NamePool &) = delete;
+    NamePool &operator=(const NamePool &) = delete;
+
+    // the pool of the model and the local db loaders
+    static NamePool &shared();
+
+    Handle intern(const QString &name);
+    Handle intern(const char *utf8, int size);
+
+    QString toString(Handle name) const;
+    // UTF-8 bytes, not terminated
+    const char *utf8(Handle name, int *size) const;
+    // code point order, same as SQLite's BINARY collation
+    int compare(Handle a, Handle b) const;
+
+    Stats stats() const;
+
+private:
+    struct Entry
+    {
+        const char *data;
+        quint32 size;
+        quint32 hash;
+    };
+
+    const Entry &entry(Handle name) const;
+    const char *store(const char *utf8, int size);
+    void insertSlot(Handle name);
+    void rehash(size_t slots);
+
+    mutable QMutex m_mutex;
+
+    // entries in fixed chunks behind a table allocated up front, so a
+    // published handle stays readable while others are added
+    std::unique_ptr<Entry *[]> m_chunks;
+    quint32 m_count = 0;
+
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    char *m_block = nullptr;    // the shared block being filled
+    int m_blockUsed = 0;
+
+    // open addressing over handles, 0 = free slot
+    std::vector<Handle> m_slots;
+
+    Stats m_stats;
+};
+
+#endif // NAMEPOOL_H
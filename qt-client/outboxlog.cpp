@@ -0,0 +1,729 @@
+#include "outboxlog.h"
+#include "trace.h"
+#include <QDebug>
+#include <QDir>
+#include <QMutexLocker>
+#include <QSet>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// "UMO1": format version included
+const quint32 kSegmentMagic = 0x314f4d55;
+const quint32 kSegmentSize = 1 << 20;
+const int kMaxSpareSegments = 2;
+
+enum RecordKind : quint32 { OpRecord = 1, AckRecord, RetryRecord, AbortRecord, SealRecord };
+
+// all structs are written as they are in memory: the log is local to
+// this machine, like the SQLite file next to it
+struct SegmentHeader
+{
+    quint32 magic;
+    quint32 crc;        // of magic and seq
+    quint64 seq;
+};
+
+// the payload follows, every record starts 8-byte aligned
+struct RecordHeader
+{
+    quint32 size;       // payload bytes
+    quint32 crc;        // of the segment seq, the other fields and the payload
+    quint32 batch;      // 0 = outside a transaction
+    quint32 kind;
+};
+
+// followed by the UTF-8 name and error class
+struct OpFields
+{
+    qint32 pendingId;
+    qint32 type;
+    qint32 serverId;
+    qint32 localTempId;
+    qint32 age;
+    qint32 attempts;
+    qint64 createdAt;
+    qint64 nextAttemptAt;
+    quint32 nameSize;
+    quint32 errorClassSize;
+};
+
+struct AckFields
+{
+    qint32 pendingId;
+    qint32 unused;
+};
+
+// followed by the UTF-8 error class
+struct RetryFields
+{
+    qint32 pendingId;
+    qint32 attempts;
+    qint64 nextAttemptAt;
+    quint32 errorClassSize;
+    quint32 unused;
+};
+
+// two slots written in turn, a torn write leaves the older one intact
+struct CursorSlot
+{
+    quint64 generation;
+    quint64 segment;
+    quint32 offset;
+    qint32 nextPendingId;
+    quint32 crc;        // of the fields above
+    quint32 unused;
+};
+
+static_assert(sizeof(SegmentHeader) == 16 && sizeof(RecordHeader) == 16 && sizeof(OpFields) == 48
+                  && sizeof(RetryFields) == 24 && sizeof(CursorSlot) == 32,
+              "on-disk layout");
+
+const quint32 kHeaderSize = sizeof(SegmentHeader);
+const quint32 kRecordHeaderSize = sizeof(RecordHeader);
+
+quint32 aligned(quint32 size)
+{
+    return (size + 7) & ~quint32(7);
+}
+
+// CRC-32 (IEEE), the running value is kept inverted
+quint32 crcUpdate(quint32 crc, const void *data, size_t size)
+{
+    static const std::array<quint32, 256> table = [] {
+        std::array<quint32, 256> t {};
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    const uchar *p = static_cast<const uchar *>(data);
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+quint32 segmentCrc(const SegmentHeader &h)
+{
+    const quint32 crc = crcUpdate(0xffffffffu, &h.magic, sizeof(h.magic));
+    return ~crcUpdate(crc, &h.seq, sizeof(h.seq));
+}
+
+// the seq makes records left over from a recycled segment's previous use
+// fail the check
+quint32 recordCrc(quint64 seq, const RecordHeader &h, const uchar *payload)
+{
+    quint32 crc = crcUpdate(0xffffffffu, &seq, sizeof(seq));
+    crc = crcUpdate(crc, &h.size, sizeof(h.size));
+    crc = crcUpdate(crc, &h.batch, sizeof(h.batch) + sizeof(h.kind));
+    return ~crcUpdate(crc, payload, h.size);
+}
+
+quint32 cursorCrc(const CursorSlot &slot)
+{
+    return ~crcUpdate(0xffffffffu, &slot, offsetof(CursorSlot, crc));
+}
+
+}
+
+OutboxLog::OutboxLog(const QString &directory)
+    : m_directory(directory)
+{
+}
+
+OutboxLog::~OutboxLog()
+{
+    sync();
+}
+
+bool OutboxLog::open(quint32 committedBatch)
+{
+    UM_TRACE_SCOPE("OutboxLog::open");
+    QMutexLocker lock(&m_mutex);
+    if (!QDir().mkpath(m_directory)) {
+        qWarning() << "OutboxLog: cannot create" << m_directory;
+        return false;
+    }
+    if (!openCursor())
+        return false;
+    m_lastSeq = m_cursor.segment;
+
+    std::vector<std::unique_ptr<Segment>> found;
+    const QDir dir(m_directory);
+    const QStringList names = dir.entryList({ QStringLiteral("segment-*.log") }, QDir::Files);
+    for (const QString &name : names) {
+        // segment-<index>.log
+        m_nextFileIndex = qMax(m_nextFileIndex, name.mid(8, name.size() - 12).toInt() + 1);
+        std::unique_ptr<Segment> segment = mapSegment(dir.filePath(name));
+        if (!segment)
+            continue;
+        m_lastSeq = qMax(m_lastSeq, segment->seq);
+        if (segment->seq == 0)
+            retireSegment(std::move(segment));
+        else
+            found.push_back(std::move(segment));
+    }
+    std::sort(found.begin(), found.end(), [](const auto &a, const auto &b) { return a->seq < b->seq; });
+
+    // from the cursor on, the segments must follow each other, each one
+    // sealed before the next: past a gap or a torn record nothing counts
+    QVector<Scanned> records;
+    bool sealed = false;
+    for (auto &segment : found) {
+        const bool acked = segment->seq < m_cursor.segment;
+        if (acked || (!m_segments.empty() && (!sealed || segment->seq != m_segments.back()->seq + 1))) {
+            if (!acked)
+                qWarning() << "OutboxLog: dropping segment" << segment->seq << "past the end of the log";
+            retireSegment(std::move(segment));
+            continue;
+        }
+        const quint32 offset = segment->seq == m_cursor.segment ? qMax(m_cursor.offset, kHeaderSize) : kHeaderSize;
+        sealed = scanSegment(*segment, offset, records);
+        m_segments.push_back(std::move(segment));
+    }
+    m_tailSealed = sealed;
+    if (m_segments.empty() && !addSegment())
+        return false;
+
+    QSet<quint32> aborted;
+    for (const Scanned &r : std::as_const(records)) {
+        if (r.kind == AbortRecord)
+            aborted.insert(r.batch);
+    }
+
+    // a batch above the committed one without an abort record was cut
+    // short by a crash before its transaction committed
+    QSet<quint32> unfinished;
+    int maxId = 0;
+    m_lastBatch = committedBatch;
+    for (const Scanned &r : std::as_const(records)) {
+        m_lastBatch = qMax(m_lastBatch, r.batch);
+        if (r.kind == AbortRecord)
+            continue;
+        if (r.batch != 0 && (r.batch > committedBatch || aborted.contains(r.batch))) {
+            if (!aborted.contains(r.batch))
+                unfinished.insert(r.batch);
+            // its ids stay used
+            if (r.kind == OpRecord && r.size >= sizeof(OpFields)) {
+                qint32 id;
+                std::memcpy(&id, r.payload, sizeof(id));
+                maxId = qMax(maxId, int(id));
+            }
+            continue;
+        }
+        applyRecord(r, &maxId);
+    }
+    m_nextPendingId = qMax(m_nextPendingId, maxId + 1);
+
+    // void them for good: later commits raise the committed batch past them,
+    // so the abort records must reach the disk before any such commit
+    const Location voidStart = tail();
+    for (quint32 batch : std::as_const(unfinished)) {
+        if (writeRecord(AbortRecord, batch, nullptr, 0).segment == 0)
+            return false;
+    }
+    if (!unfinished.isEmpty() && !syncFrom(voidStart)) {
+        qWarning() << "OutboxLog: cannot sync the void of unfinished batches";
+        return false;
+    }
+
+    advanceCursor();
+    return true;
+}
+
+QString OutboxLog::directory() const
+{
+    return m_directory;
+}
+
+quint32 OutboxLog::beginBatch()
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_batch == 0) {
+        m_batch = ++m_lastBatch;
+        m_undo.clear();
+        m_batchStart = tail();
+    }
+    return m_batch;
+}
+
+quint32 OutboxLog::batch() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_batch;
+}
+
+void OutboxLog::commitBatch()
+{
+    QMutexLocker lock(&m_mutex);
+    m_batch = 0;
+    m_undo.clear();
+    advanceCursor();
+}
+
+void OutboxLog::abortBatch()
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_batch == 0)
+        return;
+
+    // synced right away (with the seal, should it start a new segment):
+    // the next batch to commit would otherwise cover a batch number whose
+    // void is not on disk
+    const Location voidStart = tail();
+    if (writeRecord(AbortRecord, m_batch, nullptr, 0).segment == 0 || !syncFrom(voidStart))
+        qWarning() << "OutboxLog: cannot void batch" << m_batch;
+    for (int i = m_undo.size() - 1; i >= 0; --i) {
+        const QPair<int, std::optional<Entry>> &before = m_undo.at(i);
+        if (before.second)
+            m_live.insert(before.first, *before.second);
+        else
+            m_live.remove(before.first);
+    }
+    m_undo.clear();
+    m_batch = 0;
+    advanceCursor();
+}
+
+int OutboxLog::append(PendingOp op)
+{
+    QMutexLocker lock(&m_mutex);
+    const int id = m_nextPendingId;
+    const QByteArray name = op.name.toUtf8();
+    const QByteArray errorClass = op.errorClass.toUtf8();
+    const OpFields fields { id, qint32(op.type), op.serverId, op.localTempId, op.age, op.attempts,
+                            op.createdAt, op.nextAttemptAt, quint32(name.size()), quint32(errorClass.size()) };
+    const Location at = writeRecord(OpRecord, m_batch, &fields, sizeof(fields), name, errorClass);
+    if (at.segment == 0)
+        return 0;
+
+    m_nextPendingId++;
+    remember(id);
+    op.pendingId = id;
+    m_live.insert(id, Entry { std::move(op), at });
+    return id;
+}
+
+bool OutboxLog::ack(int pendingId)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!m_live.contains(pendingId))
+        return false;
+
+    const AckFields fields { pendingId, 0 };
+    if (writeRecord(AckRecord, m_batch, &fields, sizeof(fields)).segment == 0)
+        return false;
+
+    remember(pendingId);
+    m_live.remove(pendingId);
+    advanceCursor();
+    return true;
+}
+
+bool OutboxLog::markRetry(int pendingId, int attempts, qint64 nextAttemptAt, const QString &errorClass)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!m_live.contains(pendingId))
+        return false;
+
+    const QByteArray errorClassUtf8 = errorClass.toUtf8();
+    const RetryFields fields { pendingId, attempts, nextAttemptAt, quint32(errorClassUtf8.size()), 0 };
+    if (writeRecord(RetryRecord, m_batch, &fields, sizeof(fields), errorClassUtf8).segment == 0)
+        return false;
+
+    remember(pendingId);
+    PendingOp &op = m_live[pendingId].op;
+    op.attempts = attempts;
+    op.nextAttemptAt = nextAttemptAt;
+    op.errorClass = errorClass;
+    return true;
+}
+
+PendingOps OutboxLog::ops() const
+{
+    return dueOps(std::numeric_limits<qint64>::max());
+}
+
+PendingOps OutboxLog::dueOps(qint64 nowMs) const
+{
+    PendingOps result;
+    {
+        QMutexLocker lock(&m_mutex);
+        result.reserve(m_live.size());
+        for (const Entry &e : m_live) {
+            if (e.op.nextAttemptAt <= nowMs)
+                result.append(e.op);
+        }
+    }
+    // already in id order
+    std::stable_sort(result.begin(), result.end(),
+                     [](const PendingOp &a, const PendingOp &b) { return a.createdAt < b.createdAt; });
+    return result;
+}
+
+bool OutboxLog::find(int pendingId, PendingOp *op) const
+{
+    QMutexLocker lock(&m_mutex);
+    auto it = m_live.constFind(pendingId);
+    if (it == m_live.constEnd())
+        return false;
+    *op = it->op;
+    return true;
+}
+
+int OutboxLog::count() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_live.size();
+}
+
+qint64 OutboxLog::nextAttemptAt() const
+{
+    QMutexLocker lock(&m_mutex);
+    qint64 next = -1;
+    for (const Entry &e : m_live) {
+        if (next < 0 || e.op.nextAttemptAt < next)
+            next = e.op.nextAttemptAt;
+    }
+    return next;
+}
+
+bool OutboxLog::sync()
+{
+    QMutexLocker lock(&m_mutex);
+    bool ok = syncDirectory();
+#ifdef Q_OS_UNIX
+    for (const auto &segment : m_segments)
+        ok = ::msync(segment->data, kSegmentSize, MS_SYNC) == 0 && ok;
+    if (m_cursorData)
+        ok = ::msync(m_cursorData, 2 * sizeof(CursorSlot), MS_SYNC) == 0 && ok;
+#endif
+    return ok;
+}
+
+bool OutboxLog::syncBatch()
+{
+    UM_TRACE_SCOPE("OutboxLog::syncBatch");
+    QMutexLocker lock(&m_mutex);
+    if (m_batch == 0)
+        return true;
+
+    // only the pages written since beginBatch()
+    const bool ok = syncFrom(m_batchStart);
+    if (!ok)
+        qWarning() << "OutboxLog: cannot sync batch" << m_batch;
+    return ok;
+}
+
+OutboxLog::Location OutboxLog::tail() const
+{
+    return m_segments.empty() ? Location { m_lastSeq + 1, 0 }
+                              : Location { m_segments.back()->seq, m_tailOffset };
+}
+
+bool OutboxLog::syncFrom(const Location &start)
+{
+    bool ok = syncDirectory();
+#ifdef Q_OS_UNIX
+    // msync wants the range page aligned
+    static const quint32 pageSize = quint32(::sysconf(_SC_PAGESIZE));
+    for (const auto &segment : m_segments) {
+        if (segment->seq < start.segment)
+            continue;
+        const quint32 from = segment->seq == start.segment ? start.offset / pageSize * pageSize : 0;
+        const quint32 to = segment == m_segments.back() ? m_tailOffset : kSegmentSize;
+        if (to > from)
+            ok = ::msync(segment->data + from, to - from, MS_SYNC) == 0 && ok;
+    }
+#endif
+    return ok;
+}
+
+bool OutboxLog::syncDirectory()
+{
+    // a new segment file is only found again if its entry is on disk too
+    if (!m_directoryDirty)
+        return true;
+#ifdef Q_OS_UNIX
+    const int fd = ::open(QFile::encodeName(m_directory).constData(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    const bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok)
+        return false;
+#endif
+    m_directoryDirty = false;
+    return true;
+}
+
+OutboxLog::Stats OutboxLog::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    Stats s = m_stats;
+    s.liveOps = m_live.size();
+    s.segments = int(m_segments.size());
+    s.spareSegments = int(m_spare.size());
+    return s;
+}
+
+bool OutboxLog::openCursor()
+{
+    const qint64 size = 2 * sizeof(CursorSlot);
+    m_cursorFile = std::make_unique<QFile>(QDir(m_directory).filePath(QStringLiteral("cursor")));
+    if (!m_cursorFile->open(QIODevice::ReadWrite)
+        || (m_cursorFile->size() < size && !m_cursorFile->resize(size))
+        || !(m_cursorData = m_cursorFile->map(0, size))) {
+        qWarning() << "OutboxLog: cannot map the cursor:" << m_cursorFile->errorString();
+        return false;
+    }
+
+    // the newer valid slot, none on a new log
+    for (int i = 0; i < 2; ++i) {
+        CursorSlot slot;
+        std::memcpy(&slot, m_cursorData + i * sizeof(CursorSlot), sizeof(slot));
+        if (slot.crc != cursorCrc(slot) || slot.generation <= m_cursorGeneration)
+            continue;
+        m_cursorGeneration = slot.generation;
+        m_cursor = { slot.segment, slot.offset };
+        m_nextPendingId = qMax(1, slot.nextPendingId);
+    }
+    return true;
+}
+
+void OutboxLog::writeCursor()
+{
+    CursorSlot slot {};
+    slot.generation = ++m_cursorGeneration;
+    slot.segment = m_cursor.segment;
+    slot.offset = m_cursor.offset;
+    slot.nextPendingId = m_nextPendingId;
+    slot.crc = cursorCrc(slot);
+    std::memcpy(m_cursorData + (slot.generation % 2) * sizeof(CursorSlot), &slot, sizeof(slot));
+}
+
+std::unique_ptr<OutboxLog::Segment> OutboxLog::mapSegment(const QString &path)
+{
+    auto segment = std::make_unique<Segment>();
+    segment->file = std::make_unique<QFile>(path);
+    if (!segment->file->open(QIODevice::ReadWrite)
+        || (segment->file->size() != kSegmentSize && !segment->file->resize(kSegmentSize))
+        || !(segment->data = segment->file->map(0, kSegmentSize))) {
+        qWarning() << "OutboxLog: cannot map" << path << segment->file->errorString();
+        return nullptr;
+    }
+
+    SegmentHeader h;
+    std::memcpy(&h, segment->data, sizeof(h));
+    if (h.magic == kSegmentMagic && h.crc == segmentCrc(h))
+        segment->seq = h.seq;
+    return segment;
+}
+
+bool OutboxLog::scanSegment(const Segment &segment, quint32 offset, QVector<Scanned> &records)
+{
+    while (offset + kRecordHeaderSize <= kSegmentSize) {
+        RecordHeader h;
+        std::memcpy(&h, segment.data + offset, sizeof(h));
+        const uchar *payload = segment.data + offset + kRecordHeaderSize;
+        if (h.kind < OpRecord || h.kind > SealRecord || h.size > kSegmentSize - offset - kRecordHeaderSize
+            || h.crc != recordCrc(segment.seq, h, payload))
+            break;
+
+        if (h.kind == SealRecord) {
+            m_tailOffset = offset;
+            return true;
+        }
+        records.append({ h.kind, h.batch, { segment.seq, offset }, payload, h.size });
+        offset += kRecordHeaderSize + aligned(h.size);
+    }
+    // the next append overwrites whatever follows
+    m_tailOffset = qMin(offset, kSegmentSize);
+    return false;
+}
+
+void OutboxLog::applyRecord(const Scanned &record, int *maxId)
+{
+    switch (record.kind) {
+    case OpRecord: {
+        OpFields f;
+        if (record.size < sizeof(f))
+            return;
+        std::memcpy(&f, record.payload, sizeof(f));
+        if (quint64(sizeof(f)) + f.nameSize + f.errorClassSize > record.size)
+            return;
+
+        const char *text = reinterpret_cast<const char *>(record.payload) + sizeof(f);
+        Entry e;
+        e.at = record.at;
+        e.op.pendingId = f.pendingId;
+        e.op.type = PendingOp::Type(f.type);
+        e.op.serverId = f.serverId;
+        e.op.localTempId = f.localTempId;
+        e.op.name = QString::fromUtf8(text, int(f.nameSize));
+        e.op.age = f.age;
+        e.op.createdAt = f.createdAt;
+        e.op.attempts = f.attempts;
+        e.op.nextAttemptAt = f.nextAttemptAt;
+        e.op.errorClass = QString::fromUtf8(text + f.nameSize, int(f.errorClassSize));
+        *maxId = qMax(*maxId, int(f.pendingId));
+        m_live.insert(f.pendingId, std::move(e));
+        break;
+    }
+    case AckRecord: {
+        AckFields f;
+        if (record.size < sizeof(f))
+            return;
+        std::memcpy(&f, record.payload, sizeof(f));
+        m_live.remove(f.pendingId);
+        break;
+    }
+    case RetryRecord: {
+        RetryFields f;
+        if (record.size < sizeof(f))
+            return;
+        std::memcpy(&f, record.payload, sizeof(f));
+        auto it = m_live.find(f.pendingId);
+        if (it == m_live.end() || quint64(sizeof(f)) + f.errorClassSize > record.size)
+            return;
+        it->op.attempts = f.attempts;
+        it->op.nextAttemptAt = f.nextAttemptAt;
+        it->op.errorClass = QString::fromUtf8(reinterpret_cast<const char *>(record.payload) + sizeof(f),
+                                              int(f.errorClassSize));
+        break;
+    }
+    }
+}
+
+OutboxLog::Location OutboxLog::writeRecord(quint32 kind, quint32 batch, const void *fixed, quint32 fixedSize,
+                                           const QByteArray &text1, const QByteArray &text2)
+{
+    const quint32 size = fixedSize + quint32(text1.size() + text2.size());
+    const quint32 footprint = kRecordHeaderSize + aligned(size);
+    if (!ensureRoom(footprint))
+        return Location();
+
+    Segment &segment = *m_segments.back();
+    uchar *record = segment.data + m_tailOffset;
+    uchar *payload = record + kRecordHeaderSize;
+    if (fixedSize > 0)
+        std::memcpy(payload, fixed, fixedSize);
+    std::memcpy(payload + fixedSize, text1.constData(), size_t(text1.size()));
+    std::memcpy(payload + fixedSize + text1.size(), text2.constData(), size_t(text2.size()));
+
+    RecordHeader h { size, 0, batch, kind };
+    h.crc = recordCrc(segment.seq, h, payload);
+    std::memcpy(record, &h, sizeof(h));
+
+    const Location at { segment.seq, m_tailOffset };
+    m_tailOffset += footprint;
+    m_stats.appendedBytes += footprint;
+    return at;
+}
+
+bool OutboxLog::ensureRoom(quint32 recordSize)
+{
+    // there is always room left for a seal behind the last record
+    if (recordSize + kRecordHeaderSize > kSegmentSize - kHeaderSize) {
+        qWarning() << "OutboxLog: a record of" << recordSize << "bytes does not fit a segment";
+        return false;
+    }
+    if (m_segments.empty())
+        return addSegment();
+    if (!m_tailSealed && m_tailOffset + recordSize + kRecordHeaderSize <= kSegmentSize)
+        return true;
+
+    // replay moves on to the next segment only past a seal
+    if (!m_tailSealed) {
+        Segment &segment = *m_segments.back();
+        RecordHeader seal { 0, 0, 0, SealRecord };
+        seal.crc = recordCrc(segment.seq, seal, nullptr);
+        std::memcpy(segment.data + m_tailOffset, &seal, sizeof(seal));
+        m_tailSealed = true;
+    }
+    return addSegment();
+}
+
+bool OutboxLog::addSegment()
+{
+    std::unique_ptr<Segment> segment;
+    if (!m_spare.empty()) {
+        segment = std::move(m_spare.back());
+        m_spare.pop_back();
+        m_stats.recycledSegments++;
+    } else {
+        segment = mapSegment(QDir(m_directory).filePath(QStringLiteral("segment-%1.log").arg(m_nextFileIndex++)));
+        if (!segment)
+            return false;
+        m_directoryDirty = true;
+    }
+
+    segment->seq = ++m_lastSeq;
+    SegmentHeader h { kSegmentMagic, 0, segment->seq };
+    h.crc = segmentCrc(h);
+    std::memcpy(segment->data, &h, sizeof(h));
+
+    m_segments.push_back(std::move(segment));
+    m_tailOffset = kHeaderSize;
+    m_tailSealed = false;
+    return true;
+}
+
+void OutboxLog::retireSegment(std::unique_ptr<Segment> segment)
+{
+    // never again part of the log, whatever its records say
+    std::memset(segment->data, 0, kHeaderSize);
+    segment->seq = 0;
+    if (int(m_spare.size()) < kMaxSpareSegments) {
+        m_spare.push_back(std::move(segment));
+        return;
+    }
+
+    segment->file->unmap(segment->data);
+    segment->file->close();
+    segment->file->remove();
+}
+
+void OutboxLog::advanceCursor()
+{
+    // an open batch may still be rolled back onto acked ops
+    if (m_batch != 0 || m_segments.empty())
+        return;
+
+    const Location cursor = m_live.isEmpty() ? Location { m_segments.back()->seq, m_tailOffset }
+                                             : m_live.first().at;
+    if (cursor == m_cursor)
+        return;
+
+    // persisted before any segment behind it is reused
+    m_cursor = cursor;
+    writeCursor();
+    while (m_segments.size() > 1 && m_segments.front()->seq < m_cursor.segment) {
+        retireSegment(std::move(m_segments.front()));
+        m_segments.pop_front();
+    }
+}
+
+void OutboxLog::remember(int pendingId)
+{
+    if (m_batch == 0)
+        return;
+
+    auto it = m_live.constFind(pendingId);
+    m_undo.append(qMakePair(pendingId, it == m_live.constEnd() ? std::nullopt : std::optional<Entry>(*it)));
+}
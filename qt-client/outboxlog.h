@@ -0,0 +1,168 @@
+#ifndef OUTBOXLOG_H
+#define OUTBOXLOG_H
+
+#include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <vector>
+#include "records.h"
+
+// Append-only store of pending ops, used by LocalDB instead of the
+// pending_ops table when it is given a log directory. New ops, acks and
+// retry updates are appended as checksummed records to fixed-size
+// memory-mapped segment files; the live ops are kept in memory and rebuilt
+// by replaying the log on open.
+//
+// The cursor is the position of the oldest unacknowledged op, persisted in
+// a small mapped file whenever an ack moves it. Segments wholly before it
+// are recycled as the next tail.
+//
+// Records written inside a LocalDB transaction carry a batch number that
+// LocalDB commits into sync_state together with its rows; a batch that
+// never committed is dropped on replay. LocalDB syncs the batch to disk
+// before that commit, so the tables and the log agree after a process
+// crash or a power loss. Records written outside a batch (acks and retry
+// updates after a server reply) are not synced: a power loss can bring
+// such an op back, and it is then sent once more.
+class OutboxLog
+{
+public:
+    struct Stats
+    {
+        int liveOps = 0;
+        int segments = 0;           // holding records past the cursor
+        int spareSegments = 0;
+        qint64 appendedBytes = 0;
+        qint64 recycledSegments = 0;
+    };
+
+    explicit OutboxLog(const QString &directory);
+    ~OutboxLog();
+
+    OutboxLog(const OutboxLog &) = delete;
+    OutboxLog &operator=(const OutboxLog &) = delete;
+
+    // maps the segments and replays them from the cursor; batches above
+    // committedBatch (or aborted ones) are dropped
+    bool open(quint32 committedBatch);
+    QString directory() const;
+
+    // records are written right away; abortBatch() undoes the batch in
+    // memory and marks it void on disk (synced before it returns), the
+    // cursor moves on commit only
+    quint32 beginBatch();
+    quint32 batch() const;      // 0 = none open
+    void commitBatch();
+    void abortBatch();
+
+    // assigns op.pendingId and returns it, 0 when the record was not written
+    int append(PendingOp op);
+    bool ack(int pendingId);
+    bool markRetry(int pendingId, int attempts, qint64 nextAttemptAt, const QString &errorClass);
+
+    // ordered like the table reads: created_at, then id
+    PendingOps ops() const;
+    PendingOps dueOps(qint64 nowMs) const;
+    bool find(int pendingId, PendingOp *op) const;
+    int count() const;
+    // -1 when empty
+    qint64 nextAttemptAt() const;
+
+    // writes all mapped pages back to disk
+    bool sync();
+    // writes back just the records of the open batch (and a new segment's
+    // directory entry); the batch survives a power loss once this returns
+    bool syncBatch();
+
+    Stats stats() const;
+
+private:
+    struct Location
+    {
+        quint64 segment = 0;
+        quint32 offset = 0;
+
+        bool operator==(const Location &other) const
+        {
+            return segment == other.segment && offset == other.offset;
+        }
+    };
+
+    struct Entry
+    {
+        PendingOp op;
+        Location at;    // of its op record
+    };
+
+    struct Segment
+    {
+        std::unique_ptr<QFile> file;
+        uchar *data = nullptr;
+        quint64 seq = 0;
+    };
+
+    // a record found on replay, payload points into the mapping
+    struct Scanned
+    {
+        quint32 kind;
+        quint32 batch;
+        Location at;
+        const uchar *payload;
+        quint32 size;
+    };
+
+    bool openCursor();
+    void writeCursor();
+    std::unique_ptr<Segment> mapSegment(const QString &path);
+    bool scanSegment(const Segment &segment, quint32 offset, QVector<Scanned> &records);
+    void applyRecord(const Scanned &record, int *maxId);
+
+    Location writeRecord(quint32 kind, quint32 batch, const void *fixed, quint32 fixedSize,
+                         const QByteArray &text1 = QByteArray(), const QByteArray &text2 = QByteArray());
+    bool ensureRoom(quint32 recordSize);
+    bool addSegment();
+    void retireSegment(std::unique_ptr<Segment> segment);
+    void advanceCursor();
+    void remember(int pendingId);
+    // where the next record goes
+    Location tail() const;
+    // msyncs the records from start up to the tail
+    bool syncFrom(const Location &start);
+    bool syncDirectory();
+
+    QString m_directory;
+    mutable QMutex m_mutex;
+
+    // segments in use ordered by seq, the back one is written to
+    std::deque<std::unique_ptr<Segment>> m_segments;
+    std::vector<std::unique_ptr<Segment>> m_spare;
+    quint32 m_tailOffset = 0;
+    bool m_tailSealed = false;
+    quint64 m_lastSeq = 0;
+    int m_nextFileIndex = 0;
+    bool m_directoryDirty = false;
+
+    std::unique_ptr<QFile> m_cursorFile;
+    uchar *m_cursorData = nullptr;
+    quint64 m_cursorGeneration = 0;
+    Location m_cursor;
+
+    // by pendingId, which grows with the append position
+    QMap<int, Entry> m_live;
+    int m_nextPendingId = 1;
+
+    quint32 m_batch = 0;
+    quint32 m_lastBatch = 0;
+    Location m_batchStart;      // tail position when the batch began
+    // state of the touched ops before the open batch, oldest first
+    QVector<QPair<int, std::optional<Entry>>> m_undo;
+
+    Stats m_stats;
+};
+
+#endif // OUTBOXLOG_H
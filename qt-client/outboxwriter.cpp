@@ -0,0 +1,165 @@
+#include "outboxwriter.h"
+#include "trace.h"
+#include "localdb.h"
+#include <QDebug>
+
+namespace {
+
+const int kRetryMs = 1000;
+// flushes in a row a mutation may fail before it is dropped
+const int kMaxFailures = 5;
+
+}
+
+OutboxWriter::OutboxWriter(LocalDB *db, QObject *parent)
+    : QObject(parent), m_db(db)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setInterval(50);
+    connect(&m_timer, &QTimer::timeout, this, &OutboxWriter::flush);
+
+    m_retryTimer.setSingleShot(true);
+    connect(&m_retryTimer, &QTimer::timeout, this, &OutboxWriter::flush);
+}
+
+OutboxWriter::~OutboxWriter()
+{
+    flush();
+}
+
+void OutboxWriter::setDurabilityWindow(int msec)
+{
+    m_timer.setInterval(qMax(0, msec));
+}
+
+int OutboxWriter::durabilityWindow() const
+{
+    return m_timer.interval();
+}
+
+void OutboxWriter::setMaxBatchSize(int count)
+{
+    m_maxBatchSize = qMax(1, count);
+}
+
+int OutboxWriter::maxBatchSize() const
+{
+    return m_maxBatchSize;
+}
+
+void OutboxWriter::enqueueInsert(int tempId, const QString &name, int age)
+{
+    m_buffer.append({ Mutation::Insert, tempId, name, age });
+    schedule();
+}
+
+void OutboxWriter::enqueueDelete(int id)
+{
+    if (id < 0) {
+        // insert still in memory: drop it, nothing ever reaches the disk
+        for (int i = m_buffer.size() - 1; i >= 0; --i) {
+            if (m_buffer[i].type == Mutation::Insert && m_buffer[i].id == id) {
+                m_buffer.removeAt(i);
+                return;
+            }
+        }
+    }
+
+    m_buffer.append({ Mutation::Delete, id, QString(), -1 });
+    schedule();
+}
+
+int OutboxWriter::bufferedCount() const
+{
+    return m_buffer.size();
+}
+
+bool OutboxWriter::flush()
+{
+    UM_TRACE_SCOPE("OutboxWriter::flush");
+    m_timer.stop();
+    if (m_buffer.isEmpty())
+        return true;
+
+    if (!m_db->beginTransaction()) {
+        retryLater();
+        return false;
+    }
+
+    bool ok = true;
+    int failed = -1;
+    for (int i = 0; i < m_buffer.size(); ++i)
+    {
+        const Mutation &m = m_buffer.at(i);
+        if (m.type == Mutation::Insert)
+        {
+            ok = m_db->saveUser(m.name, m.age, m.id)
+                 && m_db->addPendingOperation("insert", 0, m.id, m.name, m.age);
+        }
+        else if (m.id < 0)
+        {
+            // remove local unsynced insert
+            ok = m_db->deleteUser(m.id)
+                 && m_db->removePendingInsertForLocalTempId(m.id);
+        }
+        else
+        {
+            ok = m_db->addPendingOperation("delete", m.id, -1, "", -1)
+                 && m_db->deleteUser(m.id);
+        }
+        if (!ok) {
+            failed = i;
+            break;
+        }
+    }
+
+    // all or nothing: the batch stays buffered and is tried again whole
+    if (ok && !m_db->commitTransaction())
+        ok = false;
+    if (!ok) {
+        m_db->rollbackTransaction();
+        if (failed >= 0 && ++m_buffer[failed].failures >= kMaxFailures)
+            dropMutation(failed);
+        retryLater();
+        return false;
+    }
+
+    m_retryTimer.stop();
+    const int count = m_buffer.size();
+    m_buffer.clear();
+    emit flushed(count);
+    return true;
+}
+
+void OutboxWriter::schedule()
+{
+    // behind a failed flush: the retry takes the new mutation along
+    if (m_retryTimer.isActive())
+        return;
+
+    if (m_buffer.size() >= m_maxBatchSize || m_timer.interval() == 0) {
+        flush();
+        return;
+    }
+
+    if (!m_timer.isActive())
+        m_timer.start();
+}
+
+void OutboxWriter::retryLater()
+{
+    if (m_buffer.isEmpty() || m_retryTimer.isActive())
+        return;
+    qWarning() << "Outbox flush failed, keeping" << m_buffer.size() << "mutations";
+    m_retryTimer.start(qMax(m_timer.interval(), kRetryMs));
+}
+
+void OutboxWriter::dropMutation(int index)
+{
+    const Mutation m = m_buffer.takeAt(index);
+    qWarning() << "Outbox mutation for id" << m.id << "failed" << m.failures << "times, dropped";
+    if (m.type == Mutation::Insert)
+        emit insertDropped(m.id);
+    else
+        emit deleteDropped(m.id);
+}
@@ -0,0 +1,69 @@
+#ifndef OUTBOXWRITER_H
+#define OUTBOXWRITER_H
+
+#include <QObject>
+#include <QList>
+#include <QString>
+#include <QTimer>
+
+class LocalDB;
+
+// Buffers offline mutations in memory and commits them to users and the
+// pending ops (table or outbox log) together in one transaction, either
+// when the durability window expires or when the batch is full.
+class OutboxWriter : public QObject
+{
+    Q_OBJECT
+public:
+    explicit OutboxWriter(LocalDB *db, QObject *parent = nullptr);
+    ~OutboxWriter();
+
+    // max time (ms) a mutation stays in memory, 0 = commit on enqueue
+    void setDurabilityWindow(int msec);
+    int durabilityWindow() const;
+
+    void setMaxBatchSize(int count);
+    int maxBatchSize() const;
+
+    // local row + pending insert
+    void enqueueInsert(int tempId, const QString &name, int age);
+    // local row removal + pending delete (temp ids just cancel the insert)
+    void enqueueDelete(int id);
+
+    int bufferedCount() const;
+
+public slots:
+    bool flush();
+
+signals:
+    void flushed(int count);
+    // a mutation that failed kMaxFailures flushes in a row, dropped so
+    // the rest of the buffer can go through; the model still shows it
+    void insertDropped(int tempId);
+    void deleteDropped(int id);
+
+private:
+    struct Mutation
+    {
+        enum Type { Insert, Delete };
+
+        Type type;
+        int id;
+        QString name;
+        int age;
+        int failures = 0;
+    };
+
+    void schedule();
+    void retryLater();
+    void dropMutation(int index);
+
+    LocalDB *m_db;
+    QList<Mutation> m_buffer;
+    QTimer m_timer;
+    // one pending retry at a time, however many flushes failed
+    QTimer m_retryTimer;
+    int m_maxBatchSize = 256;
+};
+
+#endif // OUTBOXWRITER_H
@@ -0,0 +1,73 @@
+#ifndef RECORDS_H
+#define RECORDS_H
+
+#include <QMetaType>
+#include <QString>
+#include <QVector>
+
+// Typed rows of the local replica, passed by const ref or moved along the
+// sync chain instead of string-keyed QVariantMaps. QVector keeps them
+// contiguous on Qt 5 as well (QList would allocate every element).
+
+struct UserRecord
+{
+    int id = 0;
+    QString name;
+    int age = 0;
+};
+
+using UserRecords = QVector<UserRecord>;
+
+// a user row whose name lives in a NamePool (see namepool.h)
+struct PooledUserRecord
+{
+    int id = 0;
+    quint32 name = 0;
+    int age = 0;
+};
+
+// row order of full and paged user reads, each backed by an index
+enum class UserOrder { ById, ByName, ByAge };
+
+struct PendingOp
+{
+    enum Type { Insert, Delete, Unknown };
+
+    int pendingId = 0;
+    Type type = Unknown;
+    int serverId = 0;       // 0 = NULL (inserts)
+    int localTempId = 0;    // 0 = NULL (deletes)
+    QString name;
+    int age = 0;
+    qint64 createdAt = 0;
+    int attempts = 0;
+    qint64 nextAttemptAt = 0;
+    QString errorClass;
+
+    static Type typeFromString(const QString &opType)
+    {
+        if (opType == QLatin1String("insert"))
+            return Insert;
+        if (opType == QLatin1String("delete"))
+            return Delete;
+        return Unknown;
+    }
+};
+
+using PendingOps = QVector<PendingOp>;
+
+// a pending op that failed for good, kept in dead_ops
+struct DeadLetter
+{
+    int deadId = 0;
+    PendingOp op;
+    QString lastError;
+    qint64 failedAt = 0;
+};
+
+using DeadLetters = QVector<DeadLetter>;
+
+Q_DECLARE_METATYPE(UserRecord)
+Q_DECLARE_METATYPE(UserRecords)
+
+#endif // RECORDS_H
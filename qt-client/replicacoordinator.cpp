@@ -0,0 +1,146 @@
+#include "replicacoordinator.h"
+#include "localdb.h"
+#include "trace.h"
+#include <QDebug>
+#include <QSet>
+
+namespace {
+// a follower further behind than this reloads everything
+const qint64 kMaxIncrementalChanges = 20000;
+// change_log entries kept by the leader, pruned every kPruneIntervalMs
+const qint64 kKeepChanges = 50000;
+const qint64 kPruneIntervalMs = 10000;
+const int kElectionIntervalMs = 1000;
+}
+
+ReplicaCoordinator::ReplicaCoordinator(LocalDB *db, const QString &lockPath, QObject *parent)
+    : QObject(parent), m_db(db), m_lock(lockPath)
+{
+    m_pollTimer.setInterval(250);
+    connect(&m_pollTimer, &QTimer::timeout, this, &ReplicaCoordinator::poll);
+
+    m_electionTimer.setInterval(kElectionIntervalMs);
+    connect(&m_electionTimer, &QTimer::timeout, this, &ReplicaCoordinator::tryBecomeLeader);
+}
+
+ReplicaCoordinator::~ReplicaCoordinator()
+{
+    // the next process in line takes over
+    if (m_leader)
+        m_lock.unlock();
+}
+
+void ReplicaCoordinator::setPollInterval(int msec)
+{
+    m_pollTimer.setInterval(qMax(10, msec));
+}
+
+int ReplicaCoordinator::pollInterval() const
+{
+    return m_pollTimer.interval();
+}
+
+bool ReplicaCoordinator::start()
+{
+    if (!m_db->enableChangeLog())
+        return false;
+
+    // this process loads the whole table on start, later changes only
+    m_lastSeq = m_db->lastChangeSeq();
+    m_dataVersion = m_db->dataVersion();
+
+    tryBecomeLeader();
+    if (!m_leader)
+        m_electionTimer.start();
+    m_pollTimer.start();
+    return true;
+}
+
+bool ReplicaCoordinator::isLeader() const
+{
+    return m_leader;
+}
+
+const ReplicaCoordinator::Stats &ReplicaCoordinator::stats() const
+{
+    return m_stats;
+}
+
+void ReplicaCoordinator::tryBecomeLeader()
+{
+    // QLockFile drops locks of dead processes on its own
+    if (m_leader || !m_lock.tryLock(0))
+        return;
+
+    qDebug() << "Replica: this process is the sync leader";
+    m_leader = true;
+    m_electionTimer.stop();
+    m_pruneClock.start();
+    emit leadershipChanged(true);
+}
+
+void ReplicaCoordinator::poll()
+{
+    m_stats.polls++;
+
+    const qint64 version = m_db->dataVersion();
+    if (version == m_dataVersion)
+        return;
+    m_dataVersion = version;
+
+    UM_TRACE_SCOPE("ReplicaCoordinator::poll");
+    const qint64 last = m_db->lastChangeSeq();
+    if (last != m_lastSeq) {
+        // our own commits move data_version as well (the reader is another
+        // connection), but their rows are in the model already
+        const qint64 foreign = last - m_lastSeq - m_db->ownChangeCount(m_lastSeq, last);
+        const bool pruned = m_db->firstChangeSeq() > m_lastSeq + 1;
+        if (!pruned && foreign <= 0) {
+            m_lastSeq = last;
+        } else if (pruned || foreign > kMaxIncrementalChanges) {
+            // pruned past us or just too much: cheaper to reload
+            m_lastSeq = last;
+            m_stats.resets++;
+            emit replicaReset();
+        } else {
+            const QList<int> ids = m_db->changedUserIds(m_lastSeq, last);
+            m_lastSeq = last;
+
+            UserRecords rows;
+            QList<int> evicted;
+            m_db->loadUsersByIds(ids, rows, evicted);
+
+            QSet<int> present(evicted.cbegin(), evicted.cend());
+            for (const UserRecord &u : rows)
+                present.insert(u.id);
+            QList<int> removed;
+            for (int id : ids) {
+                if (!present.contains(id))
+                    removed.append(id);
+            }
+
+            m_stats.changeBatches++;
+            m_stats.rowsChanged += ids.size();
+            emit usersChanged(rows, removed);
+            if (!evicted.isEmpty())
+                emit usersEvicted(evicted);
+        }
+        m_db->forgetOwnChanges(last);
+    }
+
+    if (!m_leader)
+        return;
+
+    // offline ops queued by followers are replayed from here
+    const int pending = m_db->countPendingOperations();
+    if (pending != m_pendingOps) {
+        m_pendingOps = pending;
+        if (pending > 0)
+            emit pendingOpsChanged();
+    }
+
+    if (m_pruneClock.elapsed() >= kPruneIntervalMs) {
+        m_db->pruneChangeLog(kKeepChanges);
+        m_pruneClock.restart();
+    }
+}
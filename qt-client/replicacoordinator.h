@@ -0,0 +1,71 @@
+#ifndef REPLICACOORDINATOR_H
+#define REPLICACOORDINATOR_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QList>
+#include <QLockFile>
+#include <QTimer>
+#include "records.h"
+
+class LocalDB;
+
+// Several processes sharing one local_users.db: the one holding the lock
+// file is the sync leader (only it talks to the server), the others keep
+// trying to take over. Every process polls PRAGMA data_version and, when
+// another connection committed, reads the ids other processes touched
+// since its last look from change_log and reloads just those rows.
+class ReplicaCoordinator : public QObject
+{
+    Q_OBJECT
+public:
+    struct Stats
+    {
+        int polls = 0;
+        int changeBatches = 0;
+        int rowsChanged = 0;
+        int resets = 0;
+    };
+
+    ReplicaCoordinator(LocalDB *db, const QString &lockPath, QObject *parent = nullptr);
+    ~ReplicaCoordinator();
+
+    void setPollInterval(int msec);
+    int pollInterval() const;
+
+    // change log + first election, then polling
+    bool start();
+
+    bool isLeader() const;
+    const Stats &stats() const;
+
+signals:
+    void leadershipChanged(bool leader);
+
+    // rows written by any process since the last poll
+    void usersChanged(const UserRecords &rows, const QList<int> &removedIds);
+    void usersEvicted(const QList<int> &ids);
+    // too far behind for single rows: reload the whole table
+    void replicaReset();
+
+    // leader only: followers queued new offline ops
+    void pendingOpsChanged();
+
+private:
+    void tryBecomeLeader();
+    void poll();
+
+    LocalDB *m_db;
+    QLockFile m_lock;
+    bool m_leader = false;
+
+    QTimer m_pollTimer;
+    QTimer m_electionTimer;
+    QElapsedTimer m_pruneClock;
+    qint64 m_dataVersion = -1;
+    qint64 m_lastSeq = 0;
+    int m_pendingOps = -1;
+    Stats m_stats;
+};
+
+#endif // REPLICACOORDINATOR_H
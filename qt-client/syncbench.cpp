@@ -0,0 +1,602 @@
+#include "syncbench.h"
+#include "localdb.h"
+#include "bulktransfer.h"
+#include "namepool.h"
+#include "outboxlog.h"
+#include "websocketclient.h"
+#include <QFile>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QList>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <QVariantMap>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <utility>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace {
+// heap allocations of the whole process, for --bench load
+std::atomic<qint64> g_allocations { 0 };
+}
+
+// counting replacements of the global allocator; this file is only linked
+// into qt-client-sync and a relaxed increment is noise next to malloc
+void *operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+void seedUsers(LocalDB &db, int firstId, int count)
+{
+    db.beginTransaction();
+    for (int id = firstId; id < firstId + count; ++id)
+        db.insertUser(id, QStringLiteral("user%1").arg(id % 5000), 18 + id % 60);
+    db.commitTransaction();
+}
+
+// paged reads on 1..maxThreads reader threads while the owner thread keeps
+// committing 100-row write transactions
+int benchReaders(const BenchOptions &options)
+{
+    QTextStream out(stdout);
+
+    QTemporaryDir dir;
+    LocalDB db;
+    db.setDatabasePath(dir.filePath("bench_users.db"));
+    if (!db.open() || !db.createTable())
+        return 1;
+
+    seedUsers(db, 1, options.rows);
+    int nextId = options.rows + 1;
+
+    out << "threads    reads/s   writes/s\n";
+    for (int threads = 1; threads <= options.maxThreads; threads *= 2)
+    {
+        db.setMaxReaders(threads);
+
+        std::atomic<bool> stop { false };
+        std::atomic<qint64> reads { 0 };
+
+        QList<QThread*> workers;
+        for (int t = 0; t < threads; ++t)
+        {
+            QThread *worker = QThread::create([&db, &stop, &reads, &options, t]() {
+                QRandomGenerator rng(quint32(t + 1));
+                while (!stop.load(std::memory_order_relaxed)) {
+                    db.loadUsersPage(int(rng.bounded(quint32(options.rows))), 50);
+                    reads.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+            workers.append(worker);
+            worker->start();
+        }
+
+        qint64 writes = 0;
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < options.seconds * 1000) {
+            seedUsers(db, nextId, 100);
+            nextId += 100;
+            writes += 100;
+        }
+
+        stop = true;
+        for (QThread *worker : workers) {
+            worker->wait();
+            delete worker;
+        }
+
+        const double secs = timer.elapsed() / 1000.0;
+        out << QStringLiteral("%1 %2 %3\n")
+                   .arg(threads, 7)
+                   .arg(reads.load() / secs, 10, 'f', 0)
+                   .arg(writes / secs, 10, 'f', 0);
+        out.flush();
+    }
+    return 0;
+}
+
+// writes NDJSON and CSV files of options.rows users, imports each as
+// pending inserts, then exports the table again in that format
+int benchImport(const BenchOptions &options)
+{
+    QTextStream out(stdout);
+
+    QTemporaryDir dir;
+    const QString source = dir.filePath("users.ndjson");
+    const QString csvSource = dir.filePath("users.csv");
+    {
+        QFile file(source);
+        QFile csv(csvSource);
+        if (!file.open(QIODevice::WriteOnly) || !csv.open(QIODevice::WriteOnly))
+            return 1;
+        csv.write("name,age\n");
+        for (int i = 0; i < options.rows; ++i) {
+            file.write(QStringLiteral("{\"name\":\"user%1\",\"age\":%2}\n")
+                           .arg(i % 5000).arg(18 + i % 60).toUtf8());
+            // every 10th name quoted, with an escape and a line break
+            if (i % 10 == 0)
+                csv.write(QStringLiteral("\"user \"\"%1\"\"\nsecond line\",%2\n").arg(i % 5000).arg(18 + i % 60).toUtf8());
+            else
+                csv.write(QStringLiteral("user%1,%2\n").arg(i % 5000).arg(18 + i % 60).toUtf8());
+        }
+    }
+
+    LocalDB db;
+    db.setDatabasePath(dir.filePath("bench_users.db"));
+    if (!db.open() || !db.createTable())
+        return 1;
+
+    BulkTransfer transfer(&db);
+    auto report = [&out](const char *what, const BulkTransfer::Result &r) {
+        out << what << ": " << r.rows << " rows in " << r.elapsedMs << " ms ("
+            << qint64(r.rows * 1000.0 / qMax<qint64>(1, r.elapsedMs)) << " rows/s), peak RSS "
+            << peakRssKb() / 1024 << " MiB" << (r.ok ? "" : " FAILED") << "\n";
+        out.flush();
+    };
+
+    BulkTransfer::Result imported = transfer.importFile(source, BulkTransfer::Ndjson);
+    report("import", imported);
+
+    BulkTransfer::Result exported = transfer.exportFile(dir.filePath("export.ndjson"), BulkTransfer::Ndjson);
+    report("export", exported);
+
+    BulkTransfer::Result csvImported = transfer.importFile(csvSource, BulkTransfer::Csv);
+    report("import csv", csvImported);
+
+    BulkTransfer::Result csvExported = transfer.exportFile(dir.filePath("export.csv"), BulkTransfer::Csv);
+    report("export csv", csvExported);
+
+    return imported.ok && exported.ok && csvImported.ok && csvExported.ok ? 0 : 1;
+}
+
+// loads the whole table three ways: into per-row QVariantMaps like the old
+// API did, into a UserRecords vector, and streamed through forEachUser
+int benchLoad(const BenchOptions &options)
+{
+    QTextStream out(stdout);
+
+    QTemporaryDir dir;
+    LocalDB db;
+    db.setDatabasePath(dir.filePath("bench_users.db"));
+    if (!db.open() || !db.createTable())
+        return 1;
+
+    seedUsers(db, 1, options.rows);
+    const int rows = db.countUsers();
+
+    auto run = [&out, rows](const char *what, const std::function<qint64()> &load) {
+        const qint64 allocationsBefore = g_allocations.load();
+        QElapsedTimer timer;
+        timer.start();
+        const qint64 loaded = load();
+        const qint64 ms = timer.elapsed();
+        const qint64 allocations = g_allocations.load() - allocationsBefore;
+        out << QStringLiteral("%1 %2 rows %3 ms %4 allocs %5 allocs/row\n")
+                   .arg(QLatin1String(what), -10)
+                   .arg(loaded, 9)
+                   .arg(ms, 6)
+                   .arg(allocations, 10)
+                   .arg(double(allocations) / qMax(1, rows), 6, 'f', 2);
+        out.flush();
+    };
+
+    out << "mode            rows      time        allocations\n";
+    run("variantmap", [&db]() {
+        QList<QVariantMap> result;
+        db.forEachUser([&result](UserRecord &&user) {
+            QVariantMap m;
+            m["id"] = user.id;
+            m["name"] = user.name;
+            m["age"] = user.age;
+            result.append(m);
+            return true;
+        });
+        return qint64(result.size());
+    });
+    run("records", [&db]() {
+        return qint64(db.loadUsers().size());
+    });
+    run("callback", [&db]() {
+        qint64 count = 0;
+        db.forEachUser([&count](UserRecord &&) {
+            ++count;
+            return true;
+        });
+        return count;
+    });
+    out << "peak RSS " << peakRssKb() / 1024 << " MiB\n";
+    return 0;
+}
+
+// bytes of malloc'd memory in use; Qt allocates string and container data
+// with malloc, so operator new alone would miss most of it
+qint64 heapInUseBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    const struct mallinfo2 info = mallinfo2();
+    return qint64(info.uordblks + info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+// heap kept by the rows the model holds: a QString per row as loaded
+// from SQLite, against names interned in a NamePool
+int benchNames(const BenchOptions &options)
+{
+    QTextStream out(stdout);
+    if (heapInUseBytes() < 0) {
+        QTextStream(stderr) << "names: heap statistics need glibc 2.33 or newer\n";
+        return 1;
+    }
+
+    QTemporaryDir dir;
+    LocalDB db;
+    db.setDatabasePath(dir.filePath("bench_users.db"));
+    if (!db.open() || !db.createTable())
+        return 1;
+
+    seedUsers(db, 1, options.rows);
+
+    auto report = [&out](const char *what, int rows, qint64 bytes) {
+        out << QStringLiteral("%1 %2 rows %3 KiB %4 bytes/row %5 MiB per 100k rows\n")
+                   .arg(QLatin1String(what), -8)
+                   .arg(rows, 9)
+                   .arg(bytes / 1024, 9)
+                   .arg(double(bytes) / qMax(1, rows), 7, 'f', 1)
+                   .arg(double(bytes) * 100000 / qMax(1, rows) / (1024 * 1024), 7, 'f', 2);
+        out.flush();
+    };
+
+    {
+        const qint64 before = heapInUseBytes();
+        UserRecords rows;
+        db.forEachUser([&rows](UserRecord &&user) {
+            rows.append(std::move(user));
+            return true;
+        });
+        report("qstring", rows.size(), heapInUseBytes() - before);
+    }
+
+    {
+        const qint64 before = heapInUseBytes();
+        NamePool pool;
+        QVector<PooledUserRecord> rows;
+        db.forEachPooledUser(pool, [&rows](const PooledUserRecord &user) {
+            rows.append(user);
+            return true;
+        });
+        report("pooled", rows.size(), heapInUseBytes() - before);
+
+        const NamePool::Stats stats = pool.stats();
+        out << "pool: " << stats.names << " distinct names, " << stats.nameBytes << " bytes of UTF-8, "
+            << stats.reservedBytes / 1024 << " KiB reserved, "
+            << QString::number(100.0 * stats.hits / qMax<qint64>(1, stats.lookups), 'f', 1) << "% hits\n";
+    }
+    return 0;
+}
+
+// latency of the same API calls as REST requests and as RPC on the
+// WebSocket, against a running server: insert, fetch by id and delete one
+// call at a time, then a burst with every call in flight at once
+int benchRpc(const BenchOptions &options)
+{
+    QTextStream out(stdout);
+
+    WebSocketClient socket(options.wsUrl);
+    {
+        QEventLoop loop;
+        QTimer::singleShot(5000, &loop, &QEventLoop::quit);
+        QObject::connect(&socket, &WebSocketClient::serverOnline, &loop, &QEventLoop::quit);
+        socket.start();
+        loop.exec();
+    }
+    if (!socket.isRpcReady()) {
+        QTextStream(stderr) << "rpc: no server with RPC support at " << options.wsUrl.toString() << "\n";
+        return 1;
+    }
+
+    using Done = std::function<void(int status, const QByteArray &body)>;
+    using Transport = std::function<void(const QByteArray &verb, const QString &path, const QByteArray &body, Done done)>;
+
+    QNetworkAccessManager manager;
+    const Transport rest = [&](const QByteArray &verb, const QString &path, const QByteArray &body, Done done) {
+        QNetworkRequest req(options.serverUrl.resolved(QUrl(path)));
+        if (!body.isEmpty())
+            req.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+        QNetworkReply *reply = body.isEmpty() ? manager.sendCustomRequest(req, verb)
+                                              : manager.sendCustomRequest(req, verb, body);
+        QObject::connect(reply, &QNetworkReply::finished, reply, [reply, done]() {
+            done(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(), reply->readAll());
+            reply->deleteLater();
+        });
+    };
+    const Transport rpc = [&](const QByteArray &verb, const QString &path, const QByteArray &body, Done done) {
+        if (socket.call(verb, path, body, [done](const WebSocketClient::RpcReply &r) { done(r.status, r.body); }) == 0)
+            done(0, QByteArray());
+    };
+
+    // one call, waited for: microseconds, -1 on failure
+    auto timed = [](const Transport &send, const QByteArray &verb, const QString &path,
+                    const QByteArray &body, QByteArray *answer) {
+        QEventLoop loop;
+        bool finished = false;
+        int status = 0;
+        QElapsedTimer timer;
+        timer.start();
+        send(verb, path, body, [&](int s, const QByteArray &b) {
+            status = s;
+            if (answer)
+                *answer = b;
+            finished = true;
+            loop.quit();
+        });
+        if (!finished)
+            loop.exec();
+        return status >= 200 && status < 300 ? timer.nsecsElapsed() / 1000 : qint64(-1);
+    };
+
+    auto report = [&out](const char *operation, const char *transport, QVector<qint64> us, int failures) {
+        if (us.isEmpty()) {
+            out << operation << " " << transport << ": every call failed\n";
+            return;
+        }
+        std::sort(us.begin(), us.end());
+        qint64 total = 0;
+        for (qint64 v : us)
+            total += v;
+        auto percentile = [&us](int p) { return us.at(qMin(int(us.size()) - 1, int(us.size()) * p / 100)) / 1000.0; };
+        out << QStringLiteral("%1 %2 %3 %4 %5 %6 %7\n")
+                   .arg(QLatin1String(operation), -9)
+                   .arg(QLatin1String(transport), -9)
+                   .arg(us.size(), 7)
+                   .arg(total / 1000.0 / us.size(), 9, 'f', 2)
+                   .arg(percentile(50), 9, 'f', 2)
+                   .arg(percentile(95), 9, 'f', 2)
+                   .arg(failures, 8);
+        out.flush();
+    };
+
+    const int calls = qBound(1, options.rows, 1000);
+    const QByteArray newUser = QByteArrayLiteral("{\"name\":\"rpcbench\",\"age\":42}");
+    const std::pair<const char *, Transport> transports[] = { { "rest", rest }, { "rpc", rpc } };
+
+    out << "operation transport   calls   mean ms    p50 ms    p95 ms  failed\n";
+    for (const auto &transport : transports) {
+        QVector<qint64> inserts, fetches, deletes;
+        int failures = 0;
+        for (int i = 0; i < calls; ++i) {
+            QByteArray answer;
+            const qint64 insertUs = timed(transport.second, "POST", QStringLiteral("/api/users"), newUser, &answer);
+            if (insertUs < 0) {
+                failures++;
+                continue;
+            }
+            inserts.append(insertUs);
+
+            const int id = QJsonDocument::fromJson(answer).object()["id"].toInt();
+            const qint64 fetchUs = timed(transport.second, "GET", QStringLiteral("/api/users?ids=%1").arg(id), QByteArray(), nullptr);
+            if (fetchUs >= 0)
+                fetches.append(fetchUs);
+            const qint64 deleteUs = timed(transport.second, "DELETE", QStringLiteral("/api/users/%1").arg(id), QByteArray(), nullptr);
+            if (deleteUs >= 0)
+                deletes.append(deleteUs);
+        }
+        report("insert", transport.first, inserts, failures);
+        report("fetch", transport.first, fetches, calls - failures - int(fetches.size()));
+        report("delete", transport.first, deletes, calls - failures - int(deletes.size()));
+    }
+
+    // up to kBurstWindow calls in flight, the server's own RPC limit: REST
+    // spreads them over a few connections, RPC multiplexes on one socket.
+    // Only 2xx answers count as done; 429/503 are rejections, not progress
+    constexpr int kBurstWindow = 64;
+    struct BurstResult
+    {
+        int ok = 0;
+        int rejected = 0;
+        int failed = 0;
+    };
+    auto burst = [](const Transport &send, const QByteArray &verb, const QStringList &paths, const QByteArray &body,
+                    const std::function<void(const QByteArray &answer)> &onOk) {
+        BurstResult result;
+        QEventLoop loop;
+        int next = 0;
+        int inFlight = 0;
+        std::function<void()> pump = [&]() {
+            while (inFlight < kBurstWindow && next < paths.size()) {
+                inFlight++;
+                send(verb, paths.at(next++), body, [&](int status, const QByteArray &answer) {
+                    inFlight--;
+                    if (status >= 200 && status < 300) {
+                        result.ok++;
+                        if (onOk)
+                            onOk(answer);
+                    } else if (status == 429 || status == 503) {
+                        result.rejected++;
+                    } else {
+                        result.failed++;
+                    }
+                    if (next < paths.size())
+                        pump();
+                    else if (inFlight == 0)
+                        loop.quit();
+                });
+            }
+        };
+        pump();
+        if (inFlight > 0)
+            loop.exec();
+        return result;
+    };
+
+    for (const auto &transport : transports) {
+        QStringList insertPaths;
+        for (int i = 0; i < calls; ++i)
+            insertPaths.append(QStringLiteral("/api/users"));
+        QList<int> ids;
+        QElapsedTimer timer;
+        timer.start();
+        const BurstResult inserted = burst(transport.second, "POST", insertPaths, newUser, [&ids](const QByteArray &answer) {
+            ids.append(QJsonDocument::fromJson(answer).object()["id"].toInt());
+        });
+
+        QStringList deletePaths;
+        for (int id : std::as_const(ids))
+            deletePaths.append(QStringLiteral("/api/users/%1").arg(id));
+        const BurstResult deleted = burst(transport.second, "DELETE", deletePaths, QByteArray(), nullptr);
+
+        const qint64 ms = qMax<qint64>(1, timer.elapsed());
+        out << "burst " << transport.first << ": " << inserted.ok << "/" << calls << " inserts + "
+            << deleted.ok << "/" << ids.size() << " deletes in " << ms << " ms ("
+            << qint64((inserted.ok + deleted.ok) * 1000.0 / ms) << " ok calls/s), rejected "
+            << inserted.rejected + deleted.rejected << ", failed " << inserted.failed + deleted.failed << "\n";
+        out.flush();
+    }
+    return 0;
+}
+
+// an offline write burst on the pending-op store, the pending_ops table
+// against the segment log: ops queued one by one and acked in replay
+// order, queued in OutboxWriter-sized transactions, then read back on open
+int benchOutbox(const BenchOptions &options)
+{
+    QTextStream out(stdout);
+    const int n = qMax(1, options.rows);
+    const int batchSize = 256;
+    bool ok = true;
+
+    for (const bool useLog : { false, true }) {
+        QTemporaryDir dir;
+        const char *backend = useLog ? "log" : "table";
+        auto openDb = [&](LocalDB &db) {
+            db.setDatabasePath(dir.filePath("bench_outbox.db"));
+            if (useLog)
+                db.setOutboxLogDirectory(dir.filePath("outbox"));
+            return db.open() && db.createTable();
+        };
+        auto report = [&](const char *what, int ops, qint64 ns) {
+            out << backend << " " << what << ": " << ops << " ops in " << ns / 1000000 << " ms ("
+                << qint64(ops * 1e9 / qMax<qint64>(1, ns)) << " ops/s)\n";
+            out.flush();
+        };
+
+        {
+            LocalDB db;
+            if (!openDb(db))
+                return 1;
+
+            QElapsedTimer timer;
+            timer.start();
+            for (int i = 0; i < n; ++i)
+                db.addPendingOperation("delete", i + 1, -1, QString(), -1);
+            report("enqueue", n, timer.nsecsElapsed());
+
+            const PendingOps queued = db.loadPendingOperations();
+            timer.start();
+            for (const PendingOp &op : queued)
+                db.removePendingOperation(op.pendingId);
+            report("ack", queued.size(), timer.nsecsElapsed());
+            ok = ok && queued.size() == n && db.countPendingOperations() == 0;
+
+            timer.start();
+            for (int i = 0; i < n; i += batchSize) {
+                if (!db.beginTransaction())
+                    return 1;
+                for (int j = i; j < qMin(n, i + batchSize); ++j)
+                    db.addPendingOperation("insert", 0, -(j + 1), QStringLiteral("user%1").arg(j % 5000), 18 + j % 60);
+                ok = db.commitTransaction() && ok;
+            }
+            report("enqueue x256", n, timer.nsecsElapsed());
+
+            if (const OutboxLog *log = db.outboxLog()) {
+                const OutboxLog::Stats s = log->stats();
+                out << "log: " << s.segments << " segments in use, " << s.spareSegments << " spare, "
+                    << s.recycledSegments << " recycled, " << s.appendedBytes / 1024 << " KiB appended\n";
+            }
+        }
+
+        // what a restart after a crash pays to get the queue back
+        QElapsedTimer timer;
+        timer.start();
+        LocalDB db;
+        if (!openDb(db))
+            return 1;
+        const int recovered = db.countPendingOperations();
+        out << backend << " reopen: " << recovered << " pending ops back in " << timer.elapsed() << " ms\n";
+        out.flush();
+        ok = ok && recovered == n;
+    }
+    return ok ? 0 : 1;
+}
+
+}
+
+qint64 peakRssKb()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef Q_OS_MACOS
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return -1;
+#endif
+}
+
+int runBenchmark(const QString &name, const BenchOptions &options)
+{
+    if (name == "readers")
+        return benchReaders(options);
+    if (name == "import")
+        return benchImport(options);
+    if (name == "load")
+        return benchLoad(options);
+    if (name == "names")
+        return benchNames(options);
+    if (name == "rpc")
+        return benchRpc(options);
+    if (name == "outbox")
+        return benchOutbox(options);
+
+    QTextStream(stderr) << "Unknown benchmark: " << name << "\n";
+    return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef SYNCBENCH_H
+#define SYNCBENCH_H
+
+#include <QString>
+#include <QUrl>
+
+// Local benchmarks run by qt-client-sync --bench <name>, each against a
+// throwaway database in a temporary directory.
+struct BenchOptions
+{
+    int rows = 100000;
+    int maxThreads = 8;
+    int seconds = 3;
+    // rpc: a running server
+    QUrl serverUrl;
+    QUrl wsUrl;
+};
+
+// returns the process exit code
+int runBenchmark(const QString &name, const BenchOptions &options);
+
+// peak resident set size of this process in KiB, -1 when unknown
+qint64 peakRssKb();
+
+#endif // SYNCBENCH_H
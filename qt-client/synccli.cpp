@@ -0,0 +1,199 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
+#include <QTimer>
+#include "syncengine.h"
+#include "syncbench.h"
+#include "bulktransfer.h"
+#include "trace.h"
+
+namespace {
+
+void printStats(const SyncEngine &engine, bool ok)
+{
+    const SyncEngine::Stats &s = engine.stats();
+    QTextStream out(stdout);
+    out << "sync run " << s.syncRuns << (ok ? " ok" : " FAILED")
+        << ": replayed " << s.opsReplayed << " ops (" << s.opsFailed << " failed, "
+        << s.opsRetried << " backed off, " << s.opsDeadLettered << " dead-lettered)"
+        << " in " << s.lastReplayMs << " ms, snapshot " << s.lastSnapshotRows
+        << " rows / " << s.lastSnapshotPages << " pages in " << s.lastSnapshotMs << " ms, "
+        << "reconcile " << s.lastReconcileRanges << " ranges / " << s.lastReconcileRepaired
+        << " rows repaired / " << s.lastReconcileBytes << " bytes in " << s.lastReconcileMs << " ms, "
+        << engine.localDb()->countPendingOperations() << " ops still pending; "
+        << s.requestsSent << " requests (" << s.rpcRequests << " over RPC), " << s.requestsThrottled << " throttled, "
+        << s.backPressureHits << " back-pressure hits, "
+        << engine.scheduler()->coalescedTriggers() << " triggers coalesced";
+    if (engine.localDb()->cacheLimit() > 0)
+        out << "; cache " << engine.localDb()->countUsers() << "/" << engine.localDb()->cacheLimit()
+            << " rows, " << s.rowsEvicted << " evicted, " << s.rowsFetched << " fetched back";
+    out << "\n";
+}
+
+void printTransfer(const char *what, const BulkTransfer::Result &r)
+{
+    QTextStream out(stdout);
+    out << what << ": " << r.rows << " rows (" << r.skipped << " skipped) in " << r.elapsedMs << " ms, "
+        << qint64(r.rows * 1000.0 / qMax<qint64>(1, r.elapsedMs)) << " rows/s, peak RSS "
+        << peakRssKb() / 1024 << " MiB\n";
+    if (!r.ok)
+        QTextStream(stderr) << what << " failed: " << r.error << "\n";
+}
+
+// --trace: dump the recorded events however main() returns
+struct TraceDump
+{
+    QString path;
+    ~TraceDump()
+    {
+        if (!path.isEmpty() && Trace::writeChromeJson(path))
+            QTextStream(stdout) << "trace written to " << path << "\n";
+    }
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qt-client-sync");
+    QCoreApplication::setApplicationVersion("0.1");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless offline-cache sync for the user manager.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption dbOption("db", "Local replica database.", "path", "local_users.db");
+    QCommandLineOption outboxLogOption("outbox-log", "Keep pending ops in a memory-mapped segment log in this "
+                                                     "directory instead of the database.", "dir");
+    QCommandLineOption serverOption("server", "REST endpoint of the users API.", "url",
+                                    "http://localhost:3000/api/users");
+    QCommandLineOption wsOption("ws", "WebSocket endpoint.", "url", "ws://localhost:3001");
+    QCommandLineOption onceOption("once", "Exit after the first sync run (outbox replay + snapshot).");
+    QCommandLineOption timeoutOption("timeout", "Give up --once after this many seconds.", "secs", "30");
+    QCommandLineOption statsOption("stats", "Print timing stats after every sync run.");
+    QCommandLineOption rateOption("rate", "Max outbound requests per second.", "n", "20");
+    QCommandLineOption burstOption("burst", "Outbound request burst size.", "n", "10");
+    QCommandLineOption pageSizeOption("page-size", "Rows per snapshot page.", "n", "5000");
+    QCommandLineOption parallelOption("parallel", "Snapshot slices downloaded in parallel.", "n", "4");
+    QCommandLineOption fullSnapshotOption("full-snapshot", "Always download the whole snapshot instead of "
+                                                           "reconciling range hashes.");
+    QCommandLineOption noRpcOption("no-rpc", "Always use REST, never RPC over the WebSocket.");
+    QCommandLineOption sharedOption("shared", "Share the db with other processes: only the elected leader syncs.");
+    QCommandLineOption cacheLimitOption("cache-limit", "Keep at most n server rows locally (0 = all).", "n", "0");
+    QCommandLineOption jitterOption("jitter", "Max random delay (ms) of the first sync after a reconnect.",
+                                    "msec", "3000");
+    QCommandLineOption importOption("import", "Queue the users of an NDJSON/CSV file as pending inserts.", "file");
+    QCommandLineOption exportOption("export", "Write the local users table to an NDJSON/CSV file.", "file");
+    QCommandLineOption formatOption("format", "File format for --import/--export (ndjson, csv), "
+                                              "default from the file extension.", "format");
+    QCommandLineOption chunkOption("chunk", "Rows per import transaction.", "n", "10000");
+    QCommandLineOption benchOption("bench", "Run a local benchmark instead of syncing (readers, import, load, names, rpc, outbox).", "name");
+    QCommandLineOption rowsOption("rows", "Rows to seed for --bench (calls per operation for rpc).", "n", "100000");
+    QCommandLineOption threadsOption("threads", "Max threads for --bench.", "n", "8");
+    QCommandLineOption secondsOption("seconds", "Duration of each --bench step.", "secs", "3");
+    QCommandLineOption traceOption("trace", "Write a Chrome trace JSON on exit "
+                                            "(needs USERMANAGER_ENABLE_TRACING).", "file");
+    parser.addOptions({ dbOption, outboxLogOption, serverOption, wsOption, onceOption, timeoutOption, statsOption,
+                        rateOption, burstOption, jitterOption, pageSizeOption, parallelOption, fullSnapshotOption, noRpcOption, sharedOption, cacheLimitOption,
+                        importOption, exportOption, formatOption, chunkOption, benchOption, rowsOption, threadsOption, secondsOption,
+                        traceOption });
+    parser.process(app);
+
+    TraceDump traceDump{ parser.value(traceOption) };
+
+    if (parser.isSet(benchOption)) {
+        BenchOptions options;
+        options.rows = parser.value(rowsOption).toInt();
+        options.maxThreads = parser.value(threadsOption).toInt();
+        options.seconds = parser.value(secondsOption).toInt();
+        options.serverUrl = QUrl(parser.value(serverOption));
+        options.wsUrl = QUrl(parser.value(wsOption));
+        return runBenchmark(parser.value(benchOption), options);
+    }
+
+    // bulk transfers run on their own before any sync starts
+    if (parser.isSet(importOption) || parser.isSet(exportOption)) {
+        LocalDB db;
+        db.setDatabasePath(parser.value(dbOption));
+        db.setOutboxLogDirectory(parser.value(outboxLogOption));
+        if (!db.open() || !db.createTable())
+            return 1;
+
+        BulkTransfer transfer(&db);
+        transfer.setChunkSize(parser.value(chunkOption).toInt());
+
+        auto formatFor = [&](const QString &path) {
+            if (parser.isSet(formatOption))
+                return parser.value(formatOption) == "csv" ? BulkTransfer::Csv : BulkTransfer::Ndjson;
+            return BulkTransfer::formatForPath(path);
+        };
+
+        if (parser.isSet(importOption)) {
+            const QString path = parser.value(importOption);
+            BulkTransfer::Result r = transfer.importFile(path, formatFor(path));
+            printTransfer("import", r);
+            if (!r.ok)
+                return 1;
+        }
+        if (parser.isSet(exportOption)) {
+            const QString path = parser.value(exportOption);
+            BulkTransfer::Result r = transfer.exportFile(path, formatFor(path));
+            printTransfer("export", r);
+            if (!r.ok)
+                return 1;
+        }
+
+        // push the import with --once, otherwise we are done
+        if (!parser.isSet(onceOption))
+            return 0;
+    }
+
+    SyncEngine engine;
+    engine.setDatabasePath(parser.value(dbOption));
+    engine.setOutboxLogDirectory(parser.value(outboxLogOption));
+    engine.setServerUrl(QUrl(parser.value(serverOption)));
+    engine.setWebSocketUrl(QUrl(parser.value(wsOption)));
+    engine.setRequestRate(parser.value(rateOption).toDouble(), parser.value(burstOption).toInt());
+    engine.scheduler()->setReconnectJitter(parser.value(jitterOption).toInt());
+    engine.setSnapshotPageSize(parser.value(pageSizeOption).toInt());
+    engine.setSnapshotParallelism(parser.value(parallelOption).toInt());
+    engine.setCacheLimit(parser.value(cacheLimitOption).toInt());
+    engine.setReconcileAfterReplay(!parser.isSet(fullSnapshotOption));
+    engine.setSharedReplica(parser.isSet(sharedOption));
+    engine.setUseRpc(!parser.isSet(noRpcOption));
+
+    const bool once = parser.isSet(onceOption);
+    const bool stats = parser.isSet(statsOption) || once;
+
+    QObject::connect(&engine, &SyncEngine::syncFinished, &app, [&](bool ok) {
+        if (stats)
+            printStats(engine, ok);
+        if (once)
+            app.exit(ok ? 0 : 1);
+    });
+
+    QObject::connect(&engine, &SyncEngine::leadershipChanged, &app, [](bool leader) {
+        QTextStream(stdout) << (leader ? "sync leader now\n" : "following the sync leader\n");
+    });
+    if (stats) {
+        QObject::connect(&engine, &SyncEngine::usersChanged, &app,
+                         [](const UserRecords &rows, const QList<int> &removedIds) {
+            QTextStream(stdout) << "replica: " << rows.size() << " rows changed, "
+                                << removedIds.size() << " removed\n";
+        });
+    }
+
+    if (once) {
+        QTimer::singleShot(parser.value(timeoutOption).toInt() * 1000, &app, [&app]() {
+            QTextStream(stderr) << "No sync run finished before the timeout\n";
+            app.exit(2);
+        });
+    }
+
+    if (!engine.start())
+        return 1;
+
+    return app.exec();
+}
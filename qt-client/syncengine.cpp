@@ -0,0 +1,1240 @@
+#include "syncengine.h"
+#include "trace.h"
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QDebug>
+#include <QDateTime>
+#include <QRandomGenerator>
+#include <algorithm>
+#include <climits>
+
+namespace {
+const int kMaxInsertBatch = 500;
+// ids per GET ?ids= request, keeps the URL short
+const int kMaxFetchBatch = 200;
+
+// Merkle descent: children per range, ranges per request, requests in
+// flight; ranges with at most kMerkleLeafRows server rows are refetched
+const int kMerkleFanout = 16;
+const int kMerkleBatch = 64;
+const int kMerkleInFlight = 2;
+const int kMerkleLeafRows = 32;
+const int kRepairPageRows = 1000;
+
+// per-op retry policy: exponential backoff with jitter
+const int kMaxAttempts = 10;
+const qint64 kRetryBaseMs = 1000;
+const qint64 kRetryMaxMs = 5 * 60 * 1000;
+
+// used when a 429/503 comes without Retry-After
+const qint64 kDefaultBackOffMs = 5000;
+
+bool isPermanent(const QString &errorClass)
+{
+    return errorClass == "client" || errorClass == "protocol";
+}
+
+// Retry-After is either delta-seconds or an HTTP date
+qint64 parseRetryAfter(const QByteArray &value)
+{
+    if (value.isEmpty())
+        return -1;
+
+    bool ok = false;
+    const qint64 secs = value.trimmed().toLongLong(&ok);
+    if (ok)
+        return qMax<qint64>(0, secs * 1000);
+
+    const QDateTime when = QDateTime::fromString(QString::fromLatin1(value).trimmed(), Qt::RFC2822Date);
+    if (!when.isValid())
+        return -1;
+    return qMax<qint64>(0, QDateTime::currentDateTimeUtc().msecsTo(when));
+}
+}
+
+SyncEngine::SyncEngine(QObject *parent)
+    : QObject(parent)
+{
+    mpManager = std::make_unique<QNetworkAccessManager>();
+    mpLocalDB = std::make_unique<LocalDB>();
+
+    // all sync triggers end up here, deduplicated and coalesced
+    mpScheduler = std::make_unique<SyncScheduler>();
+    connect(mpScheduler.get(), &SyncScheduler::syncDue,
+            this, &SyncEngine::syncPendingOperations);
+
+    // drains requests held back by the token bucket
+    mRequestTimer.setSingleShot(true);
+    connect(&mRequestTimer, &QTimer::timeout, this, &SyncEngine::pumpRequests);
+}
+
+SyncEngine::~SyncEngine()
+{
+    // commit what is still buffered before the db goes away
+    mpOutbox.reset();
+}
+
+void SyncEngine::setServerUrl(const QUrl &url)
+{
+    mServerUrl = url;
+}
+
+QUrl SyncEngine::serverUrl() const
+{
+    return mServerUrl;
+}
+
+void SyncEngine::setWebSocketUrl(const QUrl &url)
+{
+    mWebSocketUrl = url;
+}
+
+void SyncEngine::setDatabasePath(const QString &path)
+{
+    mpLocalDB->setDatabasePath(path);
+}
+
+void SyncEngine::setOutboxLogDirectory(const QString &directory)
+{
+    mpLocalDB->setOutboxLogDirectory(directory);
+}
+
+void SyncEngine::setRequestRate(double perSecond, int burst)
+{
+    mBucket.setRate(perSecond, burst);
+}
+
+void SyncEngine::setUseRpc(bool enabled)
+{
+    mUseRpc = enabled;
+}
+
+void SyncEngine::setSnapshotPageSize(int rows)
+{
+    mSnapshotPageSize = qMax(1, rows);
+}
+
+void SyncEngine::setSnapshotParallelism(int slices)
+{
+    mSnapshotParallelism = qMax(1, slices);
+}
+
+void SyncEngine::setReconcileAfterReplay(bool enabled)
+{
+    mReconcileAfterReplay = enabled;
+}
+
+void SyncEngine::setSharedReplica(bool enabled)
+{
+    mSharedReplica = enabled;
+}
+
+ReplicaCoordinator *SyncEngine::replica() const
+{
+    return mpReplica.get();
+}
+
+bool SyncEngine::isLeader() const
+{
+    return !mpReplica || mpReplica->isLeader();
+}
+
+void SyncEngine::setCacheLimit(int maxRows)
+{
+    mpLocalDB->setCacheLimit(maxRows);
+
+    // already running: shrink to the new limit right away
+    if (mpOutbox)
+        evictColdRows();
+}
+
+SyncScheduler *SyncEngine::scheduler() const
+{
+    return mpScheduler.get();
+}
+
+bool SyncEngine::start()
+{
+    // the log is private to this process, the other replicas could not
+    // see its ops
+    if (mSharedReplica && !mpLocalDB->outboxLogDirectory().isEmpty()) {
+        qWarning() << "Outbox log not supported with a shared replica, using the pending_ops table";
+        mpLocalDB->setOutboxLogDirectory(QString());
+    }
+
+    // init local db
+    bool ok = mpLocalDB->open();
+    if (!ok)
+        qWarning() << "LocalDB open failed";
+
+    mpLocalDB->createTable();
+
+    // offline mutations are group committed
+    mpOutbox = std::make_unique<OutboxWriter>(mpLocalDB.get());
+    // a mutation that never made it to disk: undo it in the model
+    connect(mpOutbox.get(), &OutboxWriter::insertDropped,
+            this, &SyncEngine::userRemoved);
+    connect(mpOutbox.get(), &OutboxWriter::deleteDropped, this, [this](int id) {
+        UserRecords rows;
+        QList<int> evicted;
+        mpLocalDB->loadUsersByIds({ id }, rows, evicted);
+        for (const UserRecord &u : rows)
+            emit userInserted(u.id, u.name, u.age);
+    });
+
+    if (!mSharedReplica) {
+        mpLocalDB->disableChangeLog();
+        startNetwork();
+        return ok;
+    }
+
+    // other processes see our rows only once committed, and temp ids
+    // come from the table: no buffering window
+    mpOutbox->setDurabilityWindow(0);
+
+    mpReplica = std::make_unique<ReplicaCoordinator>(mpLocalDB.get(), mpLocalDB->databasePath() + ".leader");
+    connect(mpReplica.get(), &ReplicaCoordinator::leadershipChanged,
+            this, &SyncEngine::onLeadershipChanged);
+    connect(mpReplica.get(), &ReplicaCoordinator::usersChanged,
+            this, &SyncEngine::usersChanged);
+    connect(mpReplica.get(), &ReplicaCoordinator::usersEvicted,
+            this, &SyncEngine::usersEvicted);
+    connect(mpReplica.get(), &ReplicaCoordinator::replicaReset,
+            this, &SyncEngine::replicaReset);
+    connect(mpReplica.get(), &ReplicaCoordinator::pendingOpsChanged, this, [this]() {
+        if (mServerOnline)
+            mpScheduler->requestSync(SyncScheduler::LocalChange);
+    });
+
+    return mpReplica->start() && ok;
+}
+
+void SyncEngine::onLeadershipChanged(bool leader)
+{
+    emit leadershipChanged(leader);
+
+    // followers stay offline, their ops are replayed by the leader
+    if (leader)
+        startNetwork();
+}
+
+void SyncEngine::startNetwork()
+{
+    if (mpSocketClient)
+        return;
+
+    // init websocket
+    mpSocketClient = std::make_unique<WebSocketClient>(mWebSocketUrl);
+
+    // SERVER ONLINE: sync pending ops + update gui
+    connect(mpSocketClient.get(), &WebSocketClient::serverOnline,
+            this, &SyncEngine::onServerOnline);
+
+    // SERVER OFFLINE: notify offline state
+    connect(mpSocketClient.get(), &WebSocketClient::serverOffline,
+            this, &SyncEngine::onServerOffline);
+
+    mpSocketClient->start();
+
+    // load data from server (if online)
+    getUsers();
+}
+
+LocalDB *SyncEngine::localDb() const
+{
+    return mpLocalDB.get();
+}
+
+OutboxWriter *SyncEngine::outbox() const
+{
+    return mpOutbox.get();
+}
+
+bool SyncEngine::isServerOnline() const
+{
+    return mServerOnline;
+}
+
+const SyncEngine::Stats &SyncEngine::stats() const
+{
+    return mStats;
+}
+
+void SyncEngine::sendRequest(const QByteArray &verb, const QUrl &url,
+                             const QByteArray &body, ReplyHandler handler)
+{
+    mRequestQueue.append({ verb, url, body, std::move(handler) });
+    pumpRequests();
+}
+
+void SyncEngine::pumpRequests()
+{
+    while (!mRequestQueue.isEmpty())
+    {
+        if (!mBucket.tryTake()) {
+            mStats.requestsThrottled++;
+            if (!mRequestTimer.isActive())
+                mRequestTimer.start(int(qMax<qint64>(1, mBucket.msUntilAvailable())));
+            return;
+        }
+        dispatchRequest(mRequestQueue.takeFirst());
+    }
+}
+
+void SyncEngine::dispatchRequest(QueuedRequest request)
+{
+    // same call over the open socket: no connection setup or HTTP headers
+    if (mUseRpc && mpSocketClient && mpSocketClient->isRpcReady()) {
+        QString path = request.url.path(QUrl::FullyEncoded);
+        if (request.url.hasQuery())
+            path += QLatin1Char('?') + request.url.query(QUrl::FullyEncoded);
+
+        ReplyHandler handler = std::move(request.handler);
+        const quint64 id = mpSocketClient->call(request.verb, path, request.body,
+                                                [this, handler](const WebSocketClient::RpcReply &reply) {
+            UM_TRACE_SCOPE("SyncEngine::handleReply");
+            ApiReply r;
+            r.status = reply.status;
+            r.body = reply.body;
+            r.error = reply.error;
+            finishRequest(r, reply.retryAfter, handler);
+        });
+        if (id != 0) {
+            mStats.requestsSent++;
+            mStats.rpcRequests++;
+            return;
+        }
+        request.handler = std::move(handler);
+    }
+
+    QNetworkRequest req(request.url);
+    if (!request.body.isEmpty())
+        req.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+
+    QNetworkReply *reply = request.body.isEmpty()
+        ? mpManager->sendCustomRequest(req, request.verb)
+        : mpManager->sendCustomRequest(req, request.verb, request.body);
+    mStats.requestsSent++;
+    UM_TRACE_ASYNC_BEGIN("http", reply, (request.verb + ' ' + request.url.path().toUtf8()).constData());
+
+    ReplyHandler handler = std::move(request.handler);
+    connect(reply, &QNetworkReply::finished, this, [this, reply, handler]() {
+        UM_TRACE_ASYNC_END("http", reply);
+        UM_TRACE_SCOPE("SyncEngine::handleReply");
+        ApiReply r;
+        const QVariant status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+        r.status = status.isValid() ? status.toInt() : 0;
+        r.body = reply->readAll();
+        if (reply->error() != QNetworkReply::NoError)
+            r.error = reply->errorString();
+
+        reply->deleteLater();
+        finishRequest(r, reply->rawHeader("Retry-After"), handler);
+    });
+}
+
+void SyncEngine::finishRequest(ApiReply &reply, const QByteArray &retryAfter, const ReplyHandler &handler)
+{
+    // server back-pressure: hold every outbound request and sync run
+    if (reply.status == 429 || reply.status == 503) {
+        reply.retryAfterMs = parseRetryAfter(retryAfter);
+        const qint64 pause = mBucket.pauseFor(reply.retryAfterMs >= 0 ? reply.retryAfterMs : kDefaultBackOffMs);
+        qWarning() << "Server back-pressure, pausing requests for" << pause << "ms";
+        mStats.backPressureHits++;
+        mpScheduler->deferFor(pause);
+    }
+
+    handler(reply);
+}
+
+// "network": no HTTP answer, "server": 5xx/408/429 (both transient),
+// "client": other 4xx, "protocol": unusable answer (both permanent)
+QString SyncEngine::errorClassOf(const ApiReply &reply)
+{
+    if (reply.status == 0)
+        return QStringLiteral("network");
+    if (reply.status >= 500 || reply.status == 408 || reply.status == 429)
+        return QStringLiteral("server");
+    if (reply.status >= 400)
+        return QStringLiteral("client");
+    return QStringLiteral("protocol");
+}
+
+void SyncEngine::onServerOnline()
+{
+    if (mServerOnline)
+        return;
+
+    mServerOnline = true;
+    emit serverOnlineChanged(true);
+
+    // the replay ends with a fresh snapshot
+    mpScheduler->requestSync(SyncScheduler::Reconnect);
+}
+
+void SyncEngine::onServerOffline()
+{
+    if (!mServerOnline)
+        return;
+
+    mServerOnline = false;
+    qDebug() << "Server offline!";
+    mpScheduler->cancel();
+    emit serverOnlineChanged(false);
+}
+
+void SyncEngine::requestSync()
+{
+    mpScheduler->requestSync(SyncScheduler::Manual);
+}
+
+void SyncEngine::insertUser(const QString &name, int age)
+{
+    qDebug() << "sendUserToServer:" << name << age;
+
+    // === CASE A : SERVER ONLINE ===
+    if (mServerOnline)
+    {
+        QJsonObject userJson;
+        userJson["name"] = name;
+        userJson["age"] = age;
+
+        sendRequest("POST", mServerUrl, QJsonDocument(userJson).toJson(),
+            [this, name, age](const ApiReply &reply) {
+
+                if (reply.ok())
+                {
+                    QJsonDocument doc = QJsonDocument::fromJson(reply.body);
+                    QJsonObject obj = doc.object();
+
+                    QString name = obj["name"].toString();
+                    int age = obj["age"].toInt();
+                    int serverId = obj["id"].toInt();
+
+                    // salva su db locale
+                    if (!mpLocalDB->saveUser(name, age, serverId)) {
+                        // on the server already, the next run brings it
+                        mpScheduler->requestSync(SyncScheduler::LocalChange);
+                        return;
+                    }
+
+                    // aggiorna UI: just this row
+                    emit userInserted(serverId, name, age);
+                }
+                else
+                {
+                    qWarning() << "POST error:" << reply.error;
+                    // fallback offline, the replay retries it
+                    handleInsertOffline(name, age);
+                }
+            });
+
+        return;
+    }
+
+    // === CASE B : SERVER OFFLINE ===
+    handleInsertOffline(name, age);
+}
+
+void SyncEngine::deleteUser(int id)
+{
+    if (mServerOnline)
+    {
+        // ------- SERVER ONLINE: normal DELETE -------
+
+        QUrl url(QString("%1/%2").arg(mServerUrl.toString()).arg(id));
+
+        sendRequest("DELETE", url, QByteArray(), [this, id](const ApiReply &reply) {
+            if (reply.ok() || reply.status == 404)
+            {
+                qDebug() << "User deleted on server OK.";
+
+                if (!mpLocalDB->deleteUser(id)) {
+                    // gone on the server, the next run removes it here
+                    mpScheduler->requestSync(SyncScheduler::LocalChange);
+                    return;
+                }
+                emit userRemoved(id);
+            }
+            else
+            {
+                qWarning() << "Error DELETE:" << reply.error;
+
+                // fallback: salva offline
+                handleDeleteOffline(id);
+            }
+        });
+    }
+    else
+    {
+        handleDeleteOffline(id);
+    }
+}
+
+void SyncEngine::handleInsertOffline(const QString &name, int age)
+{
+    qDebug() << "Handling insert offline, name =" << name << " age =" << age;
+
+    int tempId = mpLocalDB->generateTempId();
+    if (tempId == 0) {
+        qWarning() << "No temp id for the offline insert, dropped";
+        return;
+    }
+
+    // save locally + pending op, committed with the next batch
+    mpOutbox->enqueueInsert(tempId, name, age);
+
+    emit userInserted(tempId, name, age);
+
+    // queued while online (failed request): replay it soon
+    if (mServerOnline)
+        mpScheduler->requestSync(SyncScheduler::LocalChange);
+}
+
+void SyncEngine::handleDeleteOffline(int id)
+{
+    qDebug() << "Handling delete offline, id =" << id;
+
+    // temp ids drop the unsynced insert, server ids queue a pending delete
+    mpOutbox->enqueueDelete(id);
+
+    emit userRemoved(id);
+
+    if (mServerOnline)
+        mpScheduler->requestSync(SyncScheduler::LocalChange);
+}
+
+void SyncEngine::syncPendingOperations()
+{
+    // a run is still going (timer valid until its snapshot lands)
+    if (!mServerOnline || mReplayTimer.isValid())
+        return;
+
+    mpScheduler->runStarted();
+    mpOutbox->flush();
+
+    // ops still backing off wait for their own slot
+    mReplayOps = mpLocalDB->loadDuePendingOperations(QDateTime::currentMSecsSinceEpoch());
+
+    mReplayOk = true;
+    mNoBatchBefore = 0;
+    mReplayTimer.start();
+    UM_TRACE_ASYNC_BEGIN("sync run", this, nullptr);
+    processNextPendingOperation(0);
+}
+
+void SyncEngine::getUsers()
+{
+    requestSnapshot(false);
+}
+
+void SyncEngine::requestSnapshot(bool endsSyncRun)
+{
+    // a download is already running: it closes the sync run instead
+    if (mSnapshot.active) {
+        mSnapshot.endsSyncRun = mSnapshot.endsSyncRun || endsSyncRun;
+        return;
+    }
+
+    mSnapshot = SnapshotState();
+    mSnapshot.active = true;
+    mSnapshot.endsSyncRun = endsSyncRun;
+    mSnapshot.timer.start();
+    UM_TRACE_ASYNC_BEGIN("snapshot", &mSnapshot, nullptr);
+
+    if (!mPagedSnapshotSupported) {
+        requestFullSnapshot();
+        return;
+    }
+
+    QUrl url(mServerUrl.toString() + "/range");
+    sendRequest("GET", url, QByteArray(), [this](const ApiReply &reply) {
+        if (reply.ok()) {
+            startPagedSnapshot(reply);
+        } else if (reply.status == 404) {
+            // server without paging: one monolithic GET
+            mPagedSnapshotSupported = false;
+            requestFullSnapshot();
+        } else {
+            qWarning() << "GET range error:" << reply.error;
+            finishSnapshot(false);
+        }
+    });
+}
+
+void SyncEngine::requestFullSnapshot()
+{
+    // use GET (no body)
+    sendRequest("GET", mServerUrl, QByteArray(), [this](const ApiReply &reply) {
+        if (reply.ok()) {
+            mSnapshot.rows = createList(reply.body);
+            mSnapshot.pages = 1;
+        } else {
+            qWarning() << "GET error:" << reply.error;
+            // the local DB is still the source of truth
+        }
+        finishSnapshot(reply.ok());
+    });
+}
+
+void SyncEngine::startPagedSnapshot(const ApiReply &range)
+{
+    const QJsonObject r = QJsonDocument::fromJson(range.body).object();
+    const qint64 count = r["count"].toVariant().toLongLong();
+    const qint64 minId = r["min_id"].toVariant().toLongLong();
+    const qint64 maxId = r["max_id"].toVariant().toLongLong();
+
+    // resume the grid of an interrupted download, otherwise lay out a new
+    // one sized for ~parallelism pages per slice
+    if (mpLocalDB->syncState("snapshot_in_progress") == "1") {
+        mSnapshot.base = mpLocalDB->syncState("snapshot_base").toLongLong();
+        mSnapshot.sliceSize = qMax<qint64>(1, mpLocalDB->syncState("snapshot_slice_size").toLongLong());
+        mSnapshot.cursors = mpLocalDB->loadSnapshotSlices();
+        qDebug() << "Resuming snapshot," << mSnapshot.cursors.size() << "slices already started";
+    } else {
+        const qint64 span = count > 0 ? maxId - minId + 1 : 0;
+        const qint64 rowsPerSlice = qint64(mSnapshotPageSize) * mSnapshotParallelism;
+        mSnapshot.base = count > 0 ? minId - 1 : 0;
+        mSnapshot.sliceSize = count > 0 ? qMax<qint64>(1, (span * rowsPerSlice + count - 1) / count) : 1;
+
+        mpLocalDB->clearSnapshotSlices();
+        mpLocalDB->setSyncState("snapshot_base", QString::number(mSnapshot.base));
+        mpLocalDB->setSyncState("snapshot_slice_size", QString::number(mSnapshot.sliceSize));
+        mpLocalDB->setSyncState("snapshot_in_progress", "1");
+    }
+
+    // rows appended since an interrupted download just add slices
+    mSnapshot.sliceCount = count > 0 && maxId > mSnapshot.base
+        ? int((maxId - mSnapshot.base + mSnapshot.sliceSize - 1) / mSnapshot.sliceSize) : 0;
+    mSnapshot.skipIds = mpLocalDB->pendingDeleteIds();
+
+    if (mSnapshot.sliceCount == 0) {
+        completeSnapshot();
+        return;
+    }
+
+    for (int i = 0; i < mSnapshotParallelism; ++i)
+        fetchNextSlice();
+}
+
+void SyncEngine::fetchNextSlice()
+{
+    while (mSnapshot.nextSlice < mSnapshot.sliceCount && !mSnapshot.failed)
+    {
+        const int slice = mSnapshot.nextSlice++;
+        const int cursor = mSnapshot.cursors.value(slice, 0);
+        if (cursor < 0)
+            continue; // committed by an earlier run
+
+        const int lo = int(mSnapshot.base + slice * mSnapshot.sliceSize);
+        mSnapshot.inFlight++;
+        fetchSlicePage(slice, qMax(lo, cursor));
+        return;
+    }
+
+    if (mSnapshot.inFlight > 0)
+        return;
+
+    if (mSnapshot.failed)
+        finishSnapshot(false);
+    else
+        completeSnapshot();
+}
+
+void SyncEngine::fetchSlicePage(int slice, int afterId)
+{
+    const int hi = int(mSnapshot.base + (slice + 1) * mSnapshot.sliceSize);
+
+    QUrl url(QStringLiteral("%1?after_id=%2&before_id=%3&limit=%4")
+                 .arg(mServerUrl.toString()).arg(afterId).arg(qint64(hi) + 1).arg(mSnapshotPageSize));
+
+    sendRequest("GET", url, QByteArray(), [this, slice, afterId, hi](const ApiReply &reply) {
+        if (!reply.ok()) {
+            // the committed pages stay, the next run resumes from there
+            qWarning() << "GET page error:" << reply.error;
+            mSnapshot.failed = true;
+            mSnapshot.inFlight--;
+            fetchNextSlice();
+            return;
+        }
+
+        UserRecords rows = parseUsers(QJsonDocument::fromJson(reply.body).array());
+        const bool sliceDone = rows.size() < mSnapshotPageSize;
+        const int uptoId = sliceDone ? hi : rows.last().id;
+
+        // deletes queued while earlier pages were downloading count too
+        mpOutbox->flush();
+        mSnapshot.skipIds = mpLocalDB->pendingDeleteIds();
+
+        QList<int> stillEvicted;
+        if (!mpLocalDB->commitSnapshotPage(slice, afterId, uptoId, sliceDone, rows, mSnapshot.skipIds, &stillEvicted)) {
+            mSnapshot.failed = true;
+            mSnapshot.inFlight--;
+            fetchNextSlice();
+            return;
+        }
+
+        mSnapshot.rows += rows.size();
+        mSnapshot.pages++;
+        // the model must not show rows the db kept out
+        rows.erase(std::remove_if(rows.begin(), rows.end(), [this](const UserRecord &u) {
+            return mSnapshot.skipIds.contains(u.id);
+        }), rows.end());
+        emit usersPageReceived(afterId, uptoId, rows);
+        if (!stillEvicted.isEmpty())
+            emit usersEvicted(stillEvicted);
+        evictColdRows();
+
+        if (!sliceDone && !mSnapshot.failed) {
+            fetchSlicePage(slice, uptoId);
+            return;
+        }
+
+        mSnapshot.inFlight--;
+        fetchNextSlice();
+    });
+}
+
+void SyncEngine::completeSnapshot()
+{
+    // every slice is in: drop what the server has outside the grid
+    const int low = int(mSnapshot.base);
+    const int high = int(mSnapshot.base + mSnapshot.sliceCount * mSnapshot.sliceSize);
+    mpLocalDB->removeUsersOutside(low, high);
+    emit usersPageReceived(0, low, UserRecords());
+    emit usersPageReceived(high, INT_MAX, UserRecords());
+
+    mpLocalDB->clearSnapshotSlices();
+    mpLocalDB->setSyncState("snapshot_in_progress", "0");
+    finishSnapshot(true);
+}
+
+void SyncEngine::finishSnapshot(bool ok)
+{
+    const bool endsSyncRun = mSnapshot.endsSyncRun;
+    if (ok) {
+        mStats.lastSnapshotMs = mSnapshot.timer.elapsed();
+        mStats.lastSnapshotPages = mSnapshot.pages;
+        mStats.lastSnapshotRows = mSnapshot.rows;
+    }
+    mSnapshot.active = false;
+    UM_TRACE_ASYNC_END("snapshot", &mSnapshot);
+
+    if (endsSyncRun)
+        endSyncRun(ok);
+}
+
+void SyncEngine::endSyncRun(bool ok)
+{
+    UM_TRACE_ASYNC_END("sync run", this);
+    mReplayTimer.invalidate();
+    mpScheduler->runFinished();
+    scheduleRetry();
+    emit syncFinished(ok && mReplayOk);
+}
+
+void SyncEngine::reconcile()
+{
+    startReconcile(false);
+}
+
+void SyncEngine::startReconcile(bool endsSyncRun)
+{
+    // a snapshot download covers everything a reconciliation would find
+    if (mSnapshot.active) {
+        if (endsSyncRun)
+            requestSnapshot(true);
+        return;
+    }
+    if (mReconcile.active) {
+        mReconcile.endsSyncRun = mReconcile.endsSyncRun || endsSyncRun;
+        return;
+    }
+
+    mReconcile = ReconcileState();
+    mReconcile.active = true;
+    mReconcile.endsSyncRun = endsSyncRun;
+    mReconcile.timer.start();
+    UM_TRACE_ASYNC_BEGIN("reconcile", &mReconcile, nullptr);
+
+    if (!mServerOnline || !mMerkleSupported) {
+        finishReconcile(false);
+        return;
+    }
+
+    QUrl url(mServerUrl.toString() + "/range");
+    sendRequest("GET", url, QByteArray(), [this](const ApiReply &reply) {
+        if (!reply.ok()) {
+            qWarning() << "GET range error:" << reply.error;
+            finishReconcile(false);
+            return;
+        }
+        mReconcile.bytes += reply.body.size();
+
+        // the root covers both sides, rows only we have must go too
+        const QJsonObject r = QJsonDocument::fromJson(reply.body).object();
+        const qint64 top = qMax<qint64>(r["max_id"].toVariant().toLongLong(), mpLocalDB->maxUserId());
+        mReconcile.skipIds = mpLocalDB->pendingDeleteIds();
+        if (top > 0)
+            mReconcile.queue.append(qMakePair(qint64(0), top));
+        pumpReconcile();
+    });
+}
+
+void SyncEngine::pumpReconcile()
+{
+    while (!mReconcile.failed && mReconcile.inFlight < kMerkleInFlight && !mReconcile.queue.isEmpty()) {
+        const QList<QPair<qint64, qint64>> batch = mReconcile.queue.mid(0, kMerkleBatch);
+        mReconcile.queue.erase(mReconcile.queue.begin(), mReconcile.queue.begin() + batch.size());
+        compareRanges(batch);
+    }
+
+    if (mReconcile.inFlight == 0 && (mReconcile.failed || mReconcile.queue.isEmpty()))
+        finishReconcile(!mReconcile.failed);
+}
+
+void SyncEngine::compareRanges(const QList<QPair<qint64, qint64>> &ranges)
+{
+    QJsonArray jsonRanges;
+    for (const auto &range : ranges)
+        jsonRanges.append(QJsonArray{ range.first, range.second });
+    const QByteArray body = QJsonDocument(QJsonObject{
+        { "fanout", kMerkleFanout },
+        { "ranges", jsonRanges } }).toJson(QJsonDocument::Compact);
+
+    mReconcile.inFlight++;
+    mReconcile.bytes += body.size();
+
+    QUrl url(mServerUrl.toString() + "/merkle");
+    sendRequest("POST", url, body, [this, ranges](const ApiReply &reply) {
+        mReconcile.inFlight--;
+        mReconcile.bytes += reply.body.size();
+
+        const QJsonArray answer = QJsonDocument::fromJson(reply.body).array();
+        if (!reply.ok() || answer.size() != ranges.size()) {
+            qWarning() << "POST merkle error:" << reply.error;
+            // old server: plain snapshots from now on
+            if (reply.status == 404 || reply.status == 405)
+                mMerkleSupported = false;
+            mReconcile.failed = true;
+            pumpReconcile();
+            return;
+        }
+
+        for (int i = 0; i < ranges.size(); ++i) {
+            const QJsonArray remote = answer.at(i).toArray();
+            const QList<LocalDB::RangeHash> local =
+                mpLocalDB->rangeHashes(ranges.at(i).first, ranges.at(i).second, kMerkleFanout);
+            if (remote.size() != local.size()) {
+                qWarning() << "Merkle split mismatch for range" << ranges.at(i);
+                mReconcile.failed = true;
+                break;
+            }
+
+            for (int c = 0; c < local.size(); ++c) {
+                const QJsonArray child = remote.at(c).toArray();
+                const LocalDB::RangeHash &mine = local.at(c);
+                const int remoteCount = child.at(2).toInt();
+                const quint64 remoteHash = child.at(3).toString().toULongLong(nullptr, 16);
+                mReconcile.compared++;
+                if (remoteCount == mine.count && remoteHash == mine.hash)
+                    continue;
+
+                // small enough: refetch it, otherwise look one level deeper
+                if (remoteCount <= kMerkleLeafRows)
+                    repairRange(mine.lo, mine.hi);
+                else
+                    mReconcile.queue.append(qMakePair(mine.lo, mine.hi));
+            }
+        }
+        pumpReconcile();
+    });
+}
+
+void SyncEngine::repairRange(qint64 lo, qint64 hi)
+{
+    mReconcile.inFlight++;
+
+    QUrl url(QStringLiteral("%1?after_id=%2&before_id=%3&limit=%4")
+                 .arg(mServerUrl.toString()).arg(lo).arg(hi + 1).arg(kRepairPageRows));
+
+    sendRequest("GET", url, QByteArray(), [this, lo, hi](const ApiReply &reply) {
+        mReconcile.inFlight--;
+        mReconcile.bytes += reply.body.size();
+        if (!reply.ok()) {
+            qWarning() << "GET repair range error:" << reply.error;
+            mReconcile.failed = true;
+            pumpReconcile();
+            return;
+        }
+
+        UserRecords rows = parseUsers(QJsonDocument::fromJson(reply.body).array());
+
+        // grew meanwhile: take what came, compare the rest again
+        qint64 upto = hi;
+        if (rows.size() >= kRepairPageRows) {
+            upto = rows.last().id;
+            mReconcile.queue.append(qMakePair(upto, hi));
+        }
+
+        // evicted rows only get their new hash, they stay evicted
+        QList<int> stillEvicted;
+        if (!mpLocalDB->replaceRange(int(lo), int(upto), rows, mReconcile.skipIds, &stillEvicted)) {
+            mReconcile.failed = true;
+            pumpReconcile();
+            return;
+        }
+
+        rows.erase(std::remove_if(rows.begin(), rows.end(), [this](const UserRecord &u) {
+            return mReconcile.skipIds.contains(u.id);
+        }), rows.end());
+        mReconcile.repairedRows += rows.size();
+        emit usersPageReceived(int(lo), int(upto), rows);
+        if (!stillEvicted.isEmpty())
+            emit usersEvicted(stillEvicted);
+        pumpReconcile();
+    });
+}
+
+void SyncEngine::finishReconcile(bool ok)
+{
+    const bool endsSyncRun = mReconcile.endsSyncRun;
+    mReconcile.active = false;
+    UM_TRACE_ASYNC_END("reconcile", &mReconcile);
+
+    mStats.reconcileRuns++;
+    mStats.lastReconcileMs = mReconcile.timer.elapsed();
+    mStats.lastReconcileBytes = mReconcile.bytes;
+    mStats.lastReconcileRanges = mReconcile.compared;
+    mStats.lastReconcileRepaired = mReconcile.repairedRows;
+    qDebug() << "Reconcile" << (ok ? "done:" : "FAILED:") << mReconcile.compared << "ranges compared,"
+             << mReconcile.repairedRows << "rows repaired," << mReconcile.bytes << "bytes";
+    emit reconcileFinished(ok);
+
+    if (!endsSyncRun)
+        return;
+
+    // no verdict: the full download settles it
+    if (ok)
+        endSyncRun(true);
+    else
+        requestSnapshot(true);
+}
+
+UserRecords SyncEngine::parseUsers(const QJsonArray &arr)
+{
+    UM_TRACE_SCOPE("SyncEngine::parseUsers");
+    UserRecords users;
+    users.reserve(arr.size());
+
+    for (const QJsonValue &v : arr) {
+        if (!v.isObject()) continue;
+        const QJsonObject o = v.toObject();
+        users.append(UserRecord{ o["id"].toInt(), o["name"].toString(), o["age"].toInt() });
+    }
+    return users;
+}
+
+int SyncEngine::createList(const QByteArray &jsonData)
+{
+    UM_TRACE_SCOPE("SyncEngine::createList");
+    QJsonDocument doc = QJsonDocument::fromJson(jsonData);
+    if (!doc.isArray()) {
+        qWarning() << "Expected array from server";
+        return 0;
+    }
+
+    const UserRecords users = parseUsers(doc.array());
+
+    // save local copy in one transaction
+    mpLocalDB->beginTransaction();
+    for (const UserRecord &u : users)
+        mpLocalDB->saveUser(u.name, u.age, u.id);
+    mpLocalDB->commitTransaction();
+
+    emit usersReceived(users);
+    evictColdRows();
+    return users.size();
+}
+
+void SyncEngine::evictColdRows()
+{
+    const QList<int> ids = mpLocalDB->evictColdRows();
+    if (ids.isEmpty())
+        return;
+
+    mStats.rowsEvicted += ids.size();
+    emit usersEvicted(ids);
+}
+
+void SyncEngine::fetchUsers(const QList<int> &ids)
+{
+    if (ids.isEmpty())
+        return;
+
+    if (!mServerOnline) {
+        emit usersFetchFailed(ids);
+        return;
+    }
+
+    for (int first = 0; first < ids.size(); first += kMaxFetchBatch) {
+        const QList<int> chunk = ids.mid(first, kMaxFetchBatch);
+        QStringList idList;
+        for (int id : chunk)
+            idList.append(QString::number(id));
+
+        QUrl url(QStringLiteral("%1?ids=%2").arg(mServerUrl.toString(), idList.join(',')));
+        mStats.fetchRequests++;
+
+        sendRequest("GET", url, QByteArray(), [this, chunk](const ApiReply &reply) {
+            if (!reply.ok()) {
+                qWarning() << "GET ids error:" << reply.error;
+                emit usersFetchFailed(chunk);
+                return;
+            }
+
+            const UserRecords rows = parseUsers(QJsonDocument::fromJson(reply.body).array());
+            QSet<int> found;
+            for (const UserRecord &u : rows)
+                found.insert(u.id);
+
+            QList<int> missing;
+            for (int id : chunk) {
+                if (!found.contains(id))
+                    missing.append(id);
+            }
+
+            mpLocalDB->storeFetchedUsers(rows, missing);
+            mStats.rowsFetched += rows.size();
+
+            emit usersFetched(rows);
+            for (int id : missing)
+                emit userRemoved(id);
+
+            // the fetched rows are the hottest now, something else goes
+            evictColdRows();
+        });
+    }
+}
+
+void SyncEngine::processPendingDelete(int index)
+{
+    const PendingOp &op = mReplayOps.at(index);
+    const int serverId = op.serverId;
+
+    qDebug() << "Processing pending DELETE for id =" << serverId;
+
+    QUrl url(QString("%1/%2").arg(mServerUrl.toString()).arg(serverId));
+
+    sendRequest("DELETE", url, QByteArray(), [this, index](const ApiReply &reply) {
+        const PendingOp &op = mReplayOps.at(index);
+
+        // 404: the row is already gone, which is what we wanted
+        if (reply.ok() || reply.status == 404)
+        {
+            mpLocalDB->removePendingOperation(op.pendingId);
+            mStats.opsReplayed++;
+            processNextPendingOperation(index + 1);
+        }
+        else
+        {
+            qWarning() << "Pending delete failed:" << reply.error;
+            if (handlePendingFailure(op, errorClassOf(reply), reply.error))
+                processNextPendingOperation(index + 1);
+            else
+                finishReplay(false);
+        }
+    });
+}
+
+void SyncEngine::processPendingInsert(int index)
+{
+    const PendingOp &op = mReplayOps.at(index);
+
+    qDebug() << "Processing pending INSERT:" << op.name << op.age << "temp id =" << op.localTempId;
+
+    // ----- Send to server -----
+    QJsonObject json;
+    json["name"] = op.name;
+    json["age"] = op.age;
+
+    sendRequest("POST", mServerUrl, QJsonDocument(json).toJson(), [this, index](const ApiReply &reply) {
+        const PendingOp &op = mReplayOps.at(index);
+
+        int newId = 0;
+        if (reply.ok())
+            newId = QJsonDocument::fromJson(reply.body).object()["id"].toInt();
+
+        if (newId > 0)
+        {
+            // update local cache: replace temp id → new id
+            mpLocalDB->replaceTempId(op.localTempId, newId);
+            emit userIdReplaced(op.localTempId, newId);
+
+            // remove pending op
+            mpLocalDB->removePendingOperation(op.pendingId);
+            mStats.opsReplayed++;
+
+            // continue chain
+            processNextPendingOperation(index + 1);
+        }
+        else
+        {
+            qWarning() << "Insert sync failed:" << reply.error;
+            QString errorClass = reply.ok() ? QStringLiteral("protocol") : errorClassOf(reply);
+            if (handlePendingFailure(op, errorClass, reply.error))
+                processNextPendingOperation(index + 1);
+            else
+                finishReplay(false);
+        }
+    });
+}
+
+void SyncEngine::processPendingInsertBatch(int index, int count)
+{
+    qDebug() << "Processing" << count << "pending INSERTs in one batch";
+
+    QJsonArray users;
+    for (int i = index; i < index + count; ++i) {
+        QJsonObject json;
+        json["name"] = mReplayOps.at(i).name;
+        json["age"] = mReplayOps.at(i).age;
+        users.append(json);
+    }
+
+    QUrl url(mServerUrl.toString() + "/bulk");
+
+    sendRequest("POST", url, QJsonDocument(users).toJson(QJsonDocument::Compact), [this, index, count](const ApiReply &reply) {
+
+        QJsonArray created;
+        if (reply.ok())
+            created = QJsonDocument::fromJson(reply.body).array();
+
+        QString errorClass = reply.ok() ? QStringLiteral("protocol") : errorClassOf(reply);
+
+        if (reply.ok() && created.size() == count)
+        {
+            // server keeps the request order: swap every temp id in one go
+            mpLocalDB->beginTransaction();
+            for (int i = 0; i < count; ++i) {
+                const PendingOp &op = mReplayOps.at(index + i);
+                mpLocalDB->replaceTempId(op.localTempId, created[i].toObject()["id"].toInt());
+                mpLocalDB->removePendingOperation(op.pendingId);
+            }
+            mpLocalDB->commitTransaction();
+
+            for (int i = 0; i < count; ++i)
+                emit userIdReplaced(mReplayOps.at(index + i).localTempId, created[i].toObject()["id"].toInt());
+
+            mStats.opsReplayed += count;
+            processNextPendingOperation(index + count);
+        }
+        else if (isPermanent(errorClass))
+        {
+            // no bulk endpoint, or one poison row rejects the whole batch:
+            // replay these one by one so only the bad ones are dead-lettered
+            qWarning() << "Bulk insert rejected, retrying one by one:" << reply.error;
+            if (reply.status == 404 || reply.status == 405)
+                mBulkSupported = false;
+            mNoBatchBefore = index + count;
+            processNextPendingOperation(index);
+        }
+        else
+        {
+            qWarning() << "Bulk insert sync failed:" << reply.error;
+            bool goOn = true;
+            for (int i = index; i < index + count; ++i)
+                goOn = handlePendingFailure(mReplayOps.at(i), errorClass, reply.error) && goOn;
+
+            if (goOn)
+                processNextPendingOperation(index + count);
+            else
+                finishReplay(false);
+        }
+    });
+}
+
+void SyncEngine::processNextPendingOperation(int index)
+{
+    if (index >= mReplayOps.size()) {
+        qDebug() << "All pending operations processed.";
+        finishReplay(mReplayOk);
+        return;
+    }
+
+    int inserts = 0;
+    while (mBulkSupported && index >= mNoBatchBefore && inserts < kMaxInsertBatch
+           && index + inserts < mReplayOps.size()
+           && mReplayOps.at(index + inserts).type == PendingOp::Insert)
+        ++inserts;
+
+    const PendingOp::Type type = mReplayOps.at(index).type;
+    if (inserts > 1)
+        processPendingInsertBatch(index, inserts);
+    else if (type == PendingOp::Insert)
+        processPendingInsert(index);
+    else if (type == PendingOp::Delete)
+        processPendingDelete(index);
+    else
+        processNextPendingOperation(index + 1);
+}
+
+bool SyncEngine::handlePendingFailure(const PendingOp &op, const QString &errorClass, const QString &error)
+{
+    const int pendingId = op.pendingId;
+    const int attempts = op.attempts + 1;
+    mStats.opsFailed++;
+    mReplayOk = false;
+
+    if (isPermanent(errorClass) || attempts >= kMaxAttempts)
+    {
+        qWarning() << "Pending op" << pendingId << "moved to dead letters after"
+                   << attempts << "attempts:" << errorClass << error;
+        mpLocalDB->moveToDeadLetter(pendingId, attempts, errorClass, error);
+        mStats.opsDeadLettered++;
+        emit operationDeadLettered(pendingId, errorClass, error);
+        return true;
+    }
+
+    // transient: back this op off, the others keep their turn
+    qint64 delay = qMin(kRetryBaseMs << qMin(attempts - 1, 16), kRetryMaxMs);
+    delay = delay / 2 + qint64(QRandomGenerator::global()->bounded(quint32(delay / 2 + 1)));
+    mpLocalDB->markPendingRetry(pendingId, attempts, QDateTime::currentMSecsSinceEpoch() + delay,
+                                errorClass, error);
+    mStats.opsRetried++;
+
+    // no HTTP answer at all: the rest of the queue would fail the same way
+    return errorClass != "network";
+}
+
+void SyncEngine::scheduleRetry()
+{
+    // wake the replay up when the earliest backed-off op is due; with the
+    // bucket empty that is as soon as it holds a token again,
+    // (1 - tokens) / rate, otherwise no sooner than the base retry delay
+    qint64 next = mpLocalDB->nextPendingAttemptAt();
+    if (next < 0)
+        return;
+    const qint64 tokenWait = mBucket.msUntilAvailable();
+    mpScheduler->requestSyncAt(qMax(next, QDateTime::currentMSecsSinceEpoch()
+                                          + (tokenWait > 0 ? tokenWait : kRetryBaseMs)));
+}
+
+void SyncEngine::finishReplay(bool ok)
+{
+    mReplayOps.clear();
+    mReplayOk = ok;
+    mStats.syncRuns++;
+    mStats.lastReplayMs = mReplayTimer.elapsed();
+
+    // refresh from the server, this closes the sync run: range hashes
+    // once a full replica exists, the paged snapshot otherwise
+    if (mReconcileAfterReplay && mMerkleSupported
+        && mpLocalDB->syncState("snapshot_in_progress") == "0")
+        startReconcile(true);
+    else
+        requestSnapshot(true);
+}
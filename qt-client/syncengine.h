@@ -0,0 +1,285 @@
+#ifndef SYNCENGINE_H
+#define SYNCENGINE_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QList>
+#include <QPair>
+#include <QUrl>
+#include <functional>
+#include <memory>
+#include "localdb.h"
+#include "outboxwriter.h"
+#include "replicacoordinator.h"
+#include "syncscheduler.h"
+#include "tokenbucket.h"
+#include "websocketclient.h"
+
+class QNetworkAccessManager;
+class QJsonArray;
+
+// Offline cache sync logic without any GUI dependency: owns the local
+// replica, the outbox and the server connection. Views (DbUserModel) and
+// the headless qt-client-sync tool listen to its signals.
+class SyncEngine : public QObject
+{
+    Q_OBJECT
+public:
+    struct Stats
+    {
+        int syncRuns = 0;
+        int opsReplayed = 0;
+        int opsFailed = 0;
+        int opsRetried = 0;
+        int opsDeadLettered = 0;
+        qint64 lastReplayMs = 0;
+        qint64 lastSnapshotMs = 0;
+        int lastSnapshotRows = 0;
+        int lastSnapshotPages = 0;
+        int requestsSent = 0;
+        int rpcRequests = 0;        // of requestsSent, over the WebSocket
+        int requestsThrottled = 0;
+        int backPressureHits = 0;
+        int rowsEvicted = 0;
+        int rowsFetched = 0;
+        int fetchRequests = 0;
+        int reconcileRuns = 0;
+        qint64 lastReconcileMs = 0;
+        qint64 lastReconcileBytes = 0;
+        int lastReconcileRanges = 0;
+        int lastReconcileRepaired = 0;
+    };
+
+    explicit SyncEngine(QObject *parent = nullptr);
+    ~SyncEngine() override;
+
+    void setServerUrl(const QUrl &url);
+    QUrl serverUrl() const;
+    void setWebSocketUrl(const QUrl &url);
+    void setDatabasePath(const QString &path);
+    // pending ops in a memory-mapped segment log in directory instead of
+    // the pending_ops table (LocalDB), ignored for a shared replica
+    void setOutboxLogDirectory(const QString &directory);
+
+    // outbound request budget shared by CRUD and sync
+    void setRequestRate(double perSecond, int burst);
+
+    // send API calls as RPC over the WebSocket while it is connected and
+    // the server supports it, REST otherwise (default on)
+    void setUseRpc(bool enabled);
+
+    // paged snapshot: rows per page, id-range slices fetched in parallel
+    void setSnapshotPageSize(int rows);
+    void setSnapshotParallelism(int slices);
+
+    // once a full snapshot landed, later runs compare Merkle range hashes
+    // and download only the ranges that differ (default on)
+    void setReconcileAfterReplay(bool enabled);
+
+    // several processes on one db file: only the elected leader syncs,
+    // the others follow its writes through the change log
+    void setSharedReplica(bool enabled);
+    ReplicaCoordinator *replica() const;
+    bool isLeader() const;
+
+    // bounded local cache, 0 keeps every row
+    void setCacheLimit(int maxRows);
+
+    SyncScheduler *scheduler() const;
+
+    // open the local db, then start watching the server
+    bool start();
+
+    LocalDB *localDb() const;
+    OutboxWriter *outbox() const;
+    bool isServerOnline() const;
+    const Stats &stats() const;
+
+    // user actions, online or queued in the outbox
+    void insertUser(const QString &name, int age);
+    void deleteUser(int id);
+
+    // ask for a sync run, coalesced by the scheduler
+    void requestSync();
+
+    // replay the outbox, then refresh from the server snapshot
+    void syncPendingOperations();
+    void getUsers();
+
+    // check the replica against the server by range hashes, repair what differs
+    void reconcile();
+
+    // evicted rows on demand, answered by usersFetched/usersFetchFailed
+    void fetchUsers(const QList<int> &ids);
+
+signals:
+    void serverOnlineChanged(bool online);
+
+    // single rows changed locally
+    void userInserted(int id, const QString &name, int age);
+    void userRemoved(int id);
+    void userIdReplaced(int tempId, int serverId);
+
+    // full server snapshot, already saved locally
+    void usersReceived(const UserRecords &users);
+    // one snapshot page, already saved locally: the server rows with ids
+    // in (afterId, uptoId] are exactly these
+    void usersPageReceived(int afterId, int uptoId, const UserRecords &rows);
+
+    // bounded cache: rows dropped locally (only the id is kept) and rows
+    // brought back on demand
+    void usersEvicted(const QList<int> &ids);
+    void usersFetched(const UserRecords &rows);
+    void usersFetchFailed(const QList<int> &ids);
+
+    void syncFinished(bool ok);
+    void reconcileFinished(bool ok);
+
+    // shared replica: rows written by any process, or reload everything
+    void usersChanged(const UserRecords &rows, const QList<int> &removedIds);
+    void replicaReset();
+    void leadershipChanged(bool leader);
+
+    // a pending op failed for good and moved to dead_ops
+    void operationDeadLettered(int pendingId, const QString &errorClass, const QString &error);
+
+private:
+    // transport-neutral answer to one API call
+    struct ApiReply
+    {
+        int status = 0;           // HTTP status, 0 = no answer at all
+        QByteArray body;
+        QString error;            // empty on success
+        qint64 retryAfterMs = -1; // server back-pressure hint
+
+        bool ok() const { return error.isEmpty(); }
+    };
+    using ReplyHandler = std::function<void(const ApiReply &reply)>;
+
+    struct QueuedRequest
+    {
+        QByteArray verb;
+        QUrl url;
+        QByteArray body;
+        ReplyHandler handler;
+    };
+
+    // every outbound call goes through the token bucket
+    void sendRequest(const QByteArray &verb, const QUrl &url,
+                     const QByteArray &body, ReplyHandler handler);
+    void pumpRequests();
+    void dispatchRequest(QueuedRequest request);
+    // back-pressure bookkeeping shared by both transports, then handler
+    void finishRequest(ApiReply &reply, const QByteArray &retryAfter, const ReplyHandler &handler);
+
+    static QString errorClassOf(const ApiReply &reply);
+
+    void startNetwork();
+    void onLeadershipChanged(bool leader);
+    void onServerOnline();
+    void onServerOffline();
+
+    void handleInsertOffline(const QString &name, int age);
+    void handleDeleteOffline(int id);
+
+    void requestSnapshot(bool endsSyncRun);
+    void requestFullSnapshot();
+    void startPagedSnapshot(const ApiReply &range);
+    void fetchNextSlice();
+    void fetchSlicePage(int slice, int afterId);
+    void completeSnapshot();
+    void finishSnapshot(bool ok);
+    void endSyncRun(bool ok);
+
+    void startReconcile(bool endsSyncRun);
+    void pumpReconcile();
+    void compareRanges(const QList<QPair<qint64, qint64>> &ranges);
+    void repairRange(qint64 lo, qint64 hi);
+    void finishReconcile(bool ok);
+    int createList(const QByteArray &jsonData);
+    void evictColdRows();
+    static UserRecords parseUsers(const QJsonArray &arr);
+
+    // the replay walks mReplayOps by index, nothing is copied per op
+    void processPendingDelete(int index);
+    void processPendingInsert(int index);
+    // consecutive pending inserts go out as one POST /bulk
+    void processPendingInsertBatch(int index, int count);
+    void processNextPendingOperation(int index);
+    void finishReplay(bool ok);
+
+    // per-op retry/dead-letter bookkeeping, false = stop the chain
+    bool handlePendingFailure(const PendingOp &op, const QString &errorClass, const QString &error);
+    void scheduleRetry();
+
+private:
+    std::unique_ptr<QNetworkAccessManager> mpManager;
+    std::unique_ptr<LocalDB> mpLocalDB;
+    std::unique_ptr<OutboxWriter> mpOutbox;
+    std::unique_ptr<WebSocketClient> mpSocketClient;
+    std::unique_ptr<ReplicaCoordinator> mpReplica;
+    bool mSharedReplica = false;
+
+    bool mServerOnline = false;
+    bool mUseRpc = true;
+    QUrl mServerUrl = QUrl(QStringLiteral("http://localhost:3000/api/users"));
+    QUrl mWebSocketUrl = QUrl(QStringLiteral("ws://localhost:3001"));
+
+    PendingOps mReplayOps;
+    bool mReplayOk = true;
+    bool mBulkSupported = true;
+    int mNoBatchBefore = 0;
+    QElapsedTimer mReplayTimer;
+
+    // one snapshot download at a time, sliced by id on a fixed grid so an
+    // interrupted download resumes from the last committed page
+    struct SnapshotState
+    {
+        bool active = false;
+        bool endsSyncRun = false;
+        bool failed = false;
+        qint64 base = 0;
+        qint64 sliceSize = 1;
+        int sliceCount = 0;
+        int nextSlice = 0;
+        int inFlight = 0;
+        int rows = 0;
+        int pages = 0;
+        QHash<int, int> cursors;
+        QSet<int> skipIds;
+        QElapsedTimer timer;
+    };
+
+    SnapshotState mSnapshot;
+    bool mPagedSnapshotSupported = true;
+    int mSnapshotPageSize = 5000;
+    int mSnapshotParallelism = 4;
+
+    // Merkle descent: ranges still to compare, repairs and compares in flight
+    struct ReconcileState
+    {
+        bool active = false;
+        bool endsSyncRun = false;
+        bool failed = false;
+        int inFlight = 0;
+        int compared = 0;
+        int repairedRows = 0;
+        qint64 bytes = 0;
+        QList<QPair<qint64, qint64>> queue;
+        QSet<int> skipIds;
+        QElapsedTimer timer;
+    };
+
+    ReconcileState mReconcile;
+    bool mReconcileAfterReplay = true;
+    bool mMerkleSupported = true;
+
+    std::unique_ptr<SyncScheduler> mpScheduler;
+    TokenBucket mBucket;
+    QList<QueuedRequest> mRequestQueue;
+    QTimer mRequestTimer;
+    Stats mStats;
+};
+
+#endif // SYNCENGINE_H
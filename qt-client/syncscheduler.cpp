@@ -0,0 +1,120 @@
+#include "syncscheduler.h"
+#include <QDateTime>
+#include <QRandomGenerator>
+
+SyncScheduler::SyncScheduler(QObject *parent)
+    : QObject(parent)
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout, this, &SyncScheduler::onTimeout);
+}
+
+void SyncScheduler::setCoalesceWindow(int msec)
+{
+    m_coalesceWindow = qMax(0, msec);
+}
+
+int SyncScheduler::coalesceWindow() const
+{
+    return m_coalesceWindow;
+}
+
+void SyncScheduler::setReconnectJitter(int msec)
+{
+    m_reconnectJitter = qMax(0, msec);
+}
+
+int SyncScheduler::reconnectJitter() const
+{
+    return m_reconnectJitter;
+}
+
+void SyncScheduler::requestSync(Trigger trigger)
+{
+    if (m_running) {
+        // one follow-up run covers everything that came in meanwhile
+        m_rerun = true;
+        m_coalesced++;
+        return;
+    }
+
+    qint64 delay = m_coalesceWindow;
+    if (trigger == Reconnect && m_reconnectJitter > 0)
+        delay += QRandomGenerator::global()->bounded(m_reconnectJitter + 1);
+    else if (trigger == Manual)
+        delay = 0;
+
+    arm(delay);
+}
+
+void SyncScheduler::requestSyncAt(qint64 whenMs)
+{
+    if (m_running) {
+        m_rerun = true;
+        m_coalesced++;
+        return;
+    }
+    arm(qMax<qint64>(0, whenMs - QDateTime::currentMSecsSinceEpoch()));
+}
+
+void SyncScheduler::deferFor(qint64 msec)
+{
+    m_deferUntil = qMax(m_deferUntil, QDateTime::currentMSecsSinceEpoch() + msec);
+    if (m_timer.isActive())
+        arm(m_timer.remainingTime());
+}
+
+void SyncScheduler::runStarted()
+{
+    m_timer.stop();
+    m_running = true;
+}
+
+void SyncScheduler::runFinished()
+{
+    m_running = false;
+    if (m_rerun) {
+        m_rerun = false;
+        requestSync(LocalChange);
+    }
+}
+
+bool SyncScheduler::isRunning() const
+{
+    return m_running;
+}
+
+int SyncScheduler::coalescedTriggers() const
+{
+    return m_coalesced;
+}
+
+void SyncScheduler::cancel()
+{
+    m_timer.stop();
+    m_rerun = false;
+}
+
+void SyncScheduler::arm(qint64 delayMs)
+{
+    const qint64 deferred = m_deferUntil - QDateTime::currentMSecsSinceEpoch();
+    delayMs = qMax(delayMs, deferred);
+
+    // an earlier run already on the clock absorbs this trigger
+    if (m_timer.isActive() && m_timer.remainingTime() <= delayMs && deferred <= 0) {
+        m_coalesced++;
+        return;
+    }
+    m_timer.start(int(qMax<qint64>(0, delayMs)));
+}
+
+void SyncScheduler::onTimeout()
+{
+    // back-pressure may have arrived after the timer was armed
+    const qint64 deferred = m_deferUntil - QDateTime::currentMSecsSinceEpoch();
+    if (deferred > 0) {
+        m_timer.start(int(deferred));
+        return;
+    }
+    emit syncDue();
+}
@@ -0,0 +1,64 @@
+#ifndef SYNCSCHEDULER_H
+#define SYNCSCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+
+// Admission control for sync runs: triggers (reconnects, local changes,
+// retry wake-ups) are deduplicated and coalesced into a single run, a run
+// requested while one is active is folded into one follow-up run, and the
+// first run after a reconnect is jittered so restarting the server does
+// not get every client at the same instant.
+class SyncScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Trigger {
+        Reconnect,
+        LocalChange,
+        Retry,
+        Manual
+    };
+
+    explicit SyncScheduler(QObject *parent = nullptr);
+
+    // triggers within this window end up in the same run
+    void setCoalesceWindow(int msec);
+    int coalesceWindow() const;
+
+    // random 0..msec delay added to Reconnect triggers
+    void setReconnectJitter(int msec);
+    int reconnectJitter() const;
+
+    void requestSync(Trigger trigger);
+    // wall clock (ms since epoch), e.g. a pending op's next_attempt_at
+    void requestSyncAt(qint64 whenMs);
+    // server back-pressure: no run starts before this delay has passed
+    void deferFor(qint64 msec);
+
+    void runStarted();
+    void runFinished();
+    bool isRunning() const;
+
+    // triggers absorbed by an already scheduled or running sync
+    int coalescedTriggers() const;
+
+    void cancel();
+
+signals:
+    void syncDue();
+
+private:
+    void arm(qint64 delayMs);
+    void onTimeout();
+
+    QTimer m_timer;
+    int m_coalesceWindow = 200;
+    int m_reconnectJitter = 3000;
+    bool m_running = false;
+    bool m_rerun = false;
+    qint64 m_deferUntil = 0;
+    int m_coalesced = 0;
+};
+
+#endif // SYNCSCHEDULER_H
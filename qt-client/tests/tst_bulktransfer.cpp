@@ -0,0 +1,116 @@
+#include "bulktransfer.h"
+#include "localdb.h"
+#include <QFile>
+#include <QMap>
+#include <QTemporaryDir>
+#include <QtTest>
+
+// CSV imports: quoted fields across lines, "" escapes, and a stray quote
+// that must not swallow the rest of the file
+class TestBulkTransfer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void quotedLineBreaksAndEscapes();
+    void unbalancedQuoteSkipsItsLine();
+    void unbalancedQuoteAtEndOfFile();
+
+private:
+    BulkTransfer::Result importCsv(const QByteArray &content);
+    // name -> age of every imported row
+    QMap<QString, int> importedUsers();
+
+    std::unique_ptr<QTemporaryDir> m_dir;
+    std::unique_ptr<LocalDB> m_db;
+};
+
+void TestBulkTransfer::init()
+{
+    m_dir = std::make_unique<QTemporaryDir>();
+    QVERIFY(m_dir->isValid());
+    m_db = std::make_unique<LocalDB>();
+    m_db->setDatabasePath(m_dir->filePath(QStringLiteral("users.db")));
+    QVERIFY(m_db->open());
+    QVERIFY(m_db->createTable());
+}
+
+void TestBulkTransfer::cleanup()
+{
+    m_db.reset();
+    m_dir.reset();
+}
+
+BulkTransfer::Result TestBulkTransfer::importCsv(const QByteArray &content)
+{
+    const QString path = m_dir->filePath(QStringLiteral("users.csv"));
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(content) != content.size())
+        return BulkTransfer::Result();
+    file.close();
+
+    BulkTransfer transfer(m_db.get());
+    return transfer.importFile(path, BulkTransfer::Csv);
+}
+
+QMap<QString, int> TestBulkTransfer::importedUsers()
+{
+    QMap<QString, int> users;
+    for (const UserRecord &u : m_db->loadUsers())
+        users.insert(u.name, u.age);
+    return users;
+}
+
+void TestBulkTransfer::quotedLineBreaksAndEscapes()
+{
+    const BulkTransfer::Result r = importCsv(
+        "age,name\r\n"
+        "42,\"Smith, \"\"Jo\"\"\r\nsecond line\"\r\n"
+        "7, spaced \n"
+        "9,\"a\n\nb\"\n");
+    QVERIFY(r.ok);
+    QCOMPARE(r.rows, qint64(3));
+    QCOMPARE(r.skipped, qint64(0));
+
+    const QMap<QString, int> users = importedUsers();
+    QCOMPARE(users.size(), 3);
+    QCOMPARE(users.value(QStringLiteral("Smith, \"Jo\"\r\nsecond line"), -1), 42);
+    QCOMPARE(users.value(QStringLiteral(" spaced "), -1), 7);
+    QCOMPARE(users.value(QStringLiteral("a\n\nb"), -1), 9);
+}
+
+void TestBulkTransfer::unbalancedQuoteSkipsItsLine()
+{
+    // more lines behind the stray quote than a record may span
+    QByteArray content = "name,age\nfirst,1\n\"broken,2\n";
+    for (int i = 0; i < 150; ++i)
+        content += "user" + QByteArray::number(i) + "," + QByteArray::number(i % 90) + "\n";
+
+    const BulkTransfer::Result r = importCsv(content);
+    QVERIFY(r.ok);
+    QCOMPARE(r.rows, qint64(151));
+    QCOMPARE(r.skipped, qint64(1));
+
+    const QMap<QString, int> users = importedUsers();
+    QCOMPARE(users.value(QStringLiteral("first"), -1), 1);
+    QCOMPARE(users.value(QStringLiteral("user0"), -1), 0);
+    QCOMPARE(users.value(QStringLiteral("user149"), -1), 149 % 90);
+}
+
+void TestBulkTransfer::unbalancedQuoteAtEndOfFile()
+{
+    const BulkTransfer::Result r = importCsv("name,age\nfirst,1\n\"broken,2\nlast,3\n");
+    QVERIFY(r.ok);
+    QCOMPARE(r.rows, qint64(2));
+    QCOMPARE(r.skipped, qint64(1));
+
+    const QMap<QString, int> users = importedUsers();
+    QCOMPARE(users.value(QStringLiteral("first"), -1), 1);
+    QCOMPARE(users.value(QStringLiteral("last"), -1), 3);
+}
+
+QTEST_GUILESS_MAIN(TestBulkTransfer)
+#include "tst_bulktransfer.moc"
@@ -0,0 +1,133 @@
+#include "localdb.h"
+#include <QTemporaryDir>
+#include <QtTest>
+
+namespace {
+
+struct KnownRow
+{
+    int id;
+    const char *name;   // UTF-8
+    int age;
+    const char *hash;   // as the server sends it: 16 hex digits
+};
+
+// computed by node-server (fnv1a64 on 16-bit limbs, rowHash)
+const KnownRow kRows[] = {
+    { 1, "alice", 30, "2aa77f9c9bfb21a3" },
+    { 2, "Zo\xc3\xab", 41, "a7534a6044f2e001" },
+    { 3, "", 0, "97652002601107f2" },
+    { 70, "bob, \"jr\"", 7, "a675d5d05621db18" },
+    { 130, "\xe5\x90\x8d\xe5\x89\x8d", 99, "c401643d7807a696" },
+    { 200, "carol", 52, "32e0d7511541829f" },
+};
+
+struct KnownChild
+{
+    qint64 lo;
+    qint64 hi;
+    int count;
+    const char *hash;
+};
+
+// the server's POST /api/users/merkle answer for the rows above
+const KnownChild kRange0To256Fanout2[] = {
+    { 0, 128, 4, "bce4c02ee9391d48" },
+    { 128, 256, 2, "f6e1b36c6d462409" },
+};
+const KnownChild kRange0To200Fanout4[] = {
+    { 0, 50, 3, "1a9115febf18c650" },
+    { 50, 100, 1, "a675d5d05621db18" },
+    { 100, 150, 1, "c401643d7807a696" },
+    { 150, 200, 1, "32e0d7511541829f" },
+};
+
+quint64 serverHash(const char *hex)
+{
+    // parsed like SyncEngine::compareRanges does
+    return QByteArray(hex).toULongLong(nullptr, 16);
+}
+
+}
+
+// The client and the server must hash rows and ranges alike, or every
+// range looks divergent and reconcile turns into a full download. The
+// expected values come from the server implementation.
+class TestMerkle : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void rowHashMatchesServer();
+    void rangeHashesMatchServer();
+    void evictedRowsStillHash();
+
+private:
+    template<size_t N>
+    void compareRange(qint64 lo, qint64 hi, int fanout, const KnownChild (&expected)[N]);
+
+    std::unique_ptr<QTemporaryDir> m_dir;
+    std::unique_ptr<LocalDB> m_db;
+};
+
+void TestMerkle::init()
+{
+    m_dir = std::make_unique<QTemporaryDir>();
+    QVERIFY(m_dir->isValid());
+    m_db = std::make_unique<LocalDB>();
+    m_db->setDatabasePath(m_dir->filePath(QStringLiteral("users.db")));
+    QVERIFY(m_db->open());
+    QVERIFY(m_db->createTable());
+    for (const KnownRow &row : kRows)
+        QVERIFY(m_db->insertUser(row.id, QString::fromUtf8(row.name), row.age));
+}
+
+void TestMerkle::cleanup()
+{
+    m_db.reset();
+    m_dir.reset();
+}
+
+template<size_t N>
+void TestMerkle::compareRange(qint64 lo, qint64 hi, int fanout, const KnownChild (&expected)[N])
+{
+    const QList<LocalDB::RangeHash> children = m_db->rangeHashes(lo, hi, fanout);
+    QCOMPARE(children.size(), int(N));
+    for (size_t i = 0; i < N; ++i) {
+        const LocalDB::RangeHash &child = children.at(int(i));
+        QCOMPARE(child.lo, expected[i].lo);
+        QCOMPARE(child.hi, expected[i].hi);
+        QCOMPARE(child.count, expected[i].count);
+        QCOMPARE(child.hash, serverHash(expected[i].hash));
+    }
+}
+
+void TestMerkle::rowHashMatchesServer()
+{
+    for (const KnownRow &row : kRows)
+        QCOMPARE(LocalDB::rowHash(row.id, QString::fromUtf8(row.name), row.age), serverHash(row.hash));
+}
+
+void TestMerkle::rangeHashesMatchServer()
+{
+    // (0, 128] is read from whole buckets, the rest from the edge rows
+    compareRange(0, 256, 2, kRange0To256Fanout2);
+    compareRange(0, 200, 4, kRange0To200Fanout4);
+}
+
+void TestMerkle::evictedRowsStillHash()
+{
+    // all equally cold: ids 1-3 go, their hashes stay in the buckets
+    m_db->setCacheLimit(3);
+    QCOMPARE(m_db->evictColdRows().size(), 3);
+    QCOMPARE(m_db->countUsers(), 3);
+
+    compareRange(0, 256, 2, kRange0To256Fanout2);
+    compareRange(0, 200, 4, kRange0To200Fanout4);
+}
+
+QTEST_GUILESS_MAIN(TestMerkle)
+#include "tst_merkle.moc"
@@ -0,0 +1,256 @@
+#include "outboxlog.h"
+#include <QDir>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QtTest>
+
+namespace {
+
+PendingOp makeOp(int i)
+{
+    PendingOp op;
+    op.type = PendingOp::Insert;
+    op.localTempId = -i;
+    op.name = QStringLiteral("user%1").arg(i);
+    op.age = i % 90;
+    op.createdAt = 1000 + i / 100;
+    return op;
+}
+
+// enough ~80 byte records to fill a few 1 MiB segments
+const int kManyOps = 40000;
+
+}
+
+// Replay of the outbox log after the ways a process can stop: a record
+// torn by a crash, a batch that never committed, an aborted batch. Each
+// OutboxLog going out of scope without commitBatch() stands for a crash.
+class TestOutboxLog : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+
+    void reopenRestoresOps();
+    void tornTailRecordIsDropped();
+    void unfinishedBatchIsVoided();
+    void abortedBatchIsUndone();
+    void voidedBatchStaysVoidAfterLaterCommit();
+    void ackedSegmentsAreRecycled();
+
+private:
+    std::unique_ptr<QTemporaryDir> m_dir;
+};
+
+void TestOutboxLog::init()
+{
+    m_dir = std::make_unique<QTemporaryDir>();
+    QVERIFY(m_dir->isValid());
+}
+
+void TestOutboxLog::reopenRestoresOps()
+{
+    int retried;
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        for (int i = 1; i <= 100; ++i)
+            QVERIFY(log.append(makeOp(i)) != 0);
+        retried = log.ops().at(50).pendingId;
+        QVERIFY(log.ack(log.ops().first().pendingId));
+        QVERIFY(log.markRetry(retried, 3, 12345, QStringLiteral("server")));
+    }
+
+    OutboxLog log(m_dir->path());
+    QVERIFY(log.open(0));
+    QCOMPARE(log.count(), 99);
+    PendingOp op;
+    QVERIFY(log.find(retried, &op));
+    QCOMPARE(op.attempts, 3);
+    QCOMPARE(op.nextAttemptAt, qint64(12345));
+    QCOMPARE(op.errorClass, QStringLiteral("server"));
+    QCOMPARE(log.ops().first().name, QStringLiteral("user2"));
+}
+
+void TestOutboxLog::tornTailRecordIsDropped()
+{
+    int last = 0;
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        for (int i = 1; i <= 10; ++i)
+            last = log.append(makeOp(i));
+    }
+
+    // one byte of the last record's name: its checksum no longer matches
+    QFile segment(QDir(m_dir->path()).filePath(QStringLiteral("segment-0.log")));
+    QVERIFY(segment.open(QIODevice::ReadWrite));
+    QByteArray data = segment.readAll();
+    const int at = data.lastIndexOf("user10");
+    QVERIFY(at > 0);
+    data[at] = 'X';
+    QVERIFY(segment.seek(0));
+    QCOMPARE(segment.write(data), qint64(data.size()));
+    segment.close();
+
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        QCOMPARE(log.count(), 9);
+        PendingOp op;
+        QVERIFY(!log.find(last, &op));
+        // the tail is overwritten from the torn record on
+        QVERIFY(log.append(makeOp(11)) != 0);
+    }
+
+    OutboxLog log(m_dir->path());
+    QVERIFY(log.open(0));
+    QCOMPARE(log.count(), 10);
+    QCOMPARE(log.ops().last().name, QStringLiteral("user11"));
+}
+
+void TestOutboxLog::unfinishedBatchIsVoided()
+{
+    int kept = 0;
+    int added = 0;
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        kept = log.append(makeOp(1));
+        QCOMPARE(log.beginBatch(), quint32(1));
+        added = log.append(makeOp(2));
+        QVERIFY(log.ack(kept));
+        // no commitBatch(): sync_state never saw batch 1
+    }
+
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        PendingOp op;
+        QVERIFY(log.find(kept, &op));
+        QVERIFY(!log.find(added, &op));
+        QCOMPARE(log.count(), 1);
+
+        // a later batch commits: the voided one must not come back with it
+        QCOMPARE(log.beginBatch(), quint32(2));
+        QVERIFY(log.append(makeOp(3)) > added);
+        log.commitBatch();
+    }
+
+    OutboxLog log(m_dir->path());
+    QVERIFY(log.open(2));
+    PendingOp op;
+    QVERIFY(log.find(kept, &op));
+    QVERIFY(!log.find(added, &op));
+    QCOMPARE(log.count(), 2);
+}
+
+void TestOutboxLog::abortedBatchIsUndone()
+{
+    int kept = 0;
+    int committed = 0;
+    int aborted = 0;
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        kept = log.append(makeOp(1));
+
+        log.beginBatch();
+        committed = log.append(makeOp(2));
+        log.commitBatch();
+
+        log.beginBatch();
+        aborted = log.append(makeOp(3));
+        QVERIFY(log.ack(kept));
+        QVERIFY(log.ack(committed));
+        QCOMPARE(log.count(), 1);
+        log.abortBatch();
+
+        // undone in memory right away
+        QCOMPARE(log.count(), 2);
+        PendingOp op;
+        QVERIFY(log.find(kept, &op));
+        QVERIFY(log.find(committed, &op));
+        QVERIFY(!log.find(aborted, &op));
+    }
+
+    // and on replay, even with the batch number counted as committed
+    OutboxLog log(m_dir->path());
+    QVERIFY(log.open(2));
+    QCOMPARE(log.count(), 2);
+    PendingOp op;
+    QVERIFY(log.find(kept, &op));
+    QVERIFY(log.find(committed, &op));
+    QVERIFY(!log.find(aborted, &op));
+}
+
+void TestOutboxLog::voidedBatchStaysVoidAfterLaterCommit()
+{
+    int unfinished = 0;
+    int aborted = 0;
+    int committed = 0;
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        QCOMPARE(log.beginBatch(), quint32(1));
+        unfinished = log.append(makeOp(1));
+    }
+
+    {
+        // batch 1 is voided on open, batch 2 by abortBatch(); batch 3
+        // commits, so sync_state covers all three batch numbers
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        QCOMPARE(log.beginBatch(), quint32(2));
+        aborted = log.append(makeOp(2));
+        log.abortBatch();
+
+        QCOMPARE(log.beginBatch(), quint32(3));
+        committed = log.append(makeOp(3));
+        QVERIFY(log.syncBatch());
+        log.commitBatch();
+    }
+
+    OutboxLog log(m_dir->path());
+    QVERIFY(log.open(3));
+    PendingOp op;
+    QVERIFY(!log.find(unfinished, &op));
+    QVERIFY(!log.find(aborted, &op));
+    QVERIFY(log.find(committed, &op));
+    QCOMPARE(log.count(), 1);
+}
+
+void TestOutboxLog::ackedSegmentsAreRecycled()
+{
+    QVector<int> ids;
+    {
+        OutboxLog log(m_dir->path());
+        QVERIFY(log.open(0));
+        for (int i = 1; i <= kManyOps; ++i)
+            ids.append(log.append(makeOp(i)));
+        QVERIFY(log.stats().segments > 2);
+
+        // the oldest segments hold acked ops only
+        for (int i = 0; i < kManyOps * 3 / 4; ++i)
+            QVERIFY(log.ack(ids.at(i)));
+        QVERIFY(log.stats().spareSegments > 0);
+
+        for (int i = kManyOps + 1; i <= 2 * kManyOps; ++i)
+            ids.append(log.append(makeOp(i)));
+        QVERIFY(log.stats().recycledSegments > 0);
+    }
+
+    // recycled files still carry old records past their new header
+    const int live = kManyOps + kManyOps / 4;
+    OutboxLog log(m_dir->path());
+    QVERIFY(log.open(0));
+    QCOMPARE(log.count(), live);
+    const PendingOps ops = log.ops();
+    QCOMPARE(ops.first().pendingId, ids.at(kManyOps * 3 / 4));
+    QCOMPARE(ops.last().pendingId, ids.last());
+    QVERIFY(QDir(m_dir->path()).entryList({ QStringLiteral("segment-*.log") }).size() <= log.stats().segments + 2);
+}
+
+QTEST_GUILESS_MAIN(TestOutboxLog)
+#include "tst_outboxlog.moc"
@@ -0,0 +1,75 @@
+#include "tokenbucket.h"
+#include <QRandomGenerator>
+#include <QtGlobal>
+#include <cmath>
+
+namespace {
+// a pause ends up to this share of its length later, at random
+const int kPauseJitterDivisor = 4;
+}
+
+TokenBucket::TokenBucket(double rate, int burst)
+    : m_rate(qMax(0.001, rate)),
+    m_burst(qMax(1, burst)),
+    m_tokens(m_burst)
+{
+    m_clock.start();
+}
+
+void TokenBucket::setRate(double perSecond, int burst)
+{
+    refill();
+    m_rate = qMax(0.001, perSecond);
+    m_burst = qMax(1, burst);
+    m_tokens = qMin(m_tokens, double(m_burst));
+}
+
+double TokenBucket::rate() const
+{
+    return m_rate;
+}
+
+int TokenBucket::burst() const
+{
+    return m_burst;
+}
+
+bool TokenBucket::tryTake()
+{
+    refill();
+    if (m_clock.elapsed() < m_pausedUntil || m_tokens < 1.0)
+        return false;
+
+    m_tokens -= 1.0;
+    return true;
+}
+
+qint64 TokenBucket::msUntilAvailable()
+{
+    refill();
+    // a pause is followed by the time the first token takes
+    const qint64 paused = qMax<qint64>(0, m_pausedUntil - m_clock.elapsed());
+    if (m_tokens >= 1.0)
+        return paused;
+    return paused + qint64(std::ceil((1.0 - m_tokens) * 1000.0 / m_rate));
+}
+
+qint64 TokenBucket::pauseFor(qint64 msec)
+{
+    // clients paused by the same Retry-After must not all come back at
+    // once, and then with only the tokens refilled since, not a burst
+    msec += qint64(QRandomGenerator::global()->bounded(quint32(msec / kPauseJitterDivisor + 1)));
+    m_pausedUntil = qMax(m_pausedUntil, m_clock.elapsed() + msec);
+    m_tokens = 0.0;
+    return m_pausedUntil - m_clock.elapsed();
+}
+
+void TokenBucket::refill()
+{
+    // nothing accrues while paused
+    const qint64 now = m_clock.elapsed();
+    const qint64 from = qMax(m_lastRefill, m_pausedUntil);
+    if (now > from)
+        m_tokens = qMin(double(m_burst), m_tokens + (now - from) * m_rate / 1000.0);
+    m_lastRefill = now;
+}
@@ -0,0 +1,37 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <QElapsedTimer>
+
+// Classic token bucket on the monotonic clock: refills at rate() tokens
+// per second up to burst(), one token per outbound request. pauseFor()
+// empties it for a while when the server asks us to back off; it refills
+// only from the end of the pause, which is jittered.
+class TokenBucket
+{
+public:
+    explicit TokenBucket(double rate = 20.0, int burst = 10);
+
+    void setRate(double perSecond, int burst);
+    double rate() const;
+    int burst() const;
+
+    bool tryTake();
+    // 0 when a token is available now
+    qint64 msUntilAvailable();
+
+    // returns the pause actually taken (msec plus jitter)
+    qint64 pauseFor(qint64 msec);
+
+private:
+    void refill();
+
+    QElapsedTimer m_clock;
+    double m_rate;
+    int m_burst;
+    double m_tokens;
+    qint64 m_lastRefill = 0;
+    qint64 m_pausedUntil = 0;
+};
+
+#endif // TOKENBUCKET_H
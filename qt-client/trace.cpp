@@ -0,0 +1,193 @@
+#include "trace.h"
+#include <QDebug>
+
+#ifdef USERMANAGER_TRACING
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QTextStream>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace {
+// per thread, power of two
+const quint64 kRingSize = 8192;
+const int kDetailSize = 48;
+
+struct Event
+{
+    const char *name;
+    quint64 id;             // async spans only
+    qint64 ts;              // us since the first event
+    qint64 dur;             // complete events only
+    char phase;             // 'X' complete, 'b'/'e' async begin/end
+    char detail[kDetailSize];
+};
+
+// written by its own thread only; head is published with release so a
+// dump sees fully written events
+struct ThreadBuffer
+{
+    Event events[kRingSize];
+    std::atomic<quint64> head{0};
+    int tid = 0;
+};
+
+QMutex &registryMutex()
+{
+    static QMutex mutex;
+    return mutex;
+}
+
+// buffers outlive their threads so a later dump still sees them
+std::vector<ThreadBuffer *> &registry()
+{
+    static std::vector<ThreadBuffer *> buffers;
+    return buffers;
+}
+
+ThreadBuffer *threadBuffer()
+{
+    thread_local ThreadBuffer *buffer = [] {
+        auto *b = new ThreadBuffer;
+        QMutexLocker lock(&registryMutex());
+        registry().push_back(b);
+        b->tid = int(registry().size());
+        return b;
+    }();
+    return buffer;
+}
+
+void record(char phase, const char *name, quint64 id, qint64 ts, qint64 dur, const char *detail)
+{
+    ThreadBuffer *b = threadBuffer();
+    const quint64 head = b->head.load(std::memory_order_relaxed);
+    Event &e = b->events[head & (kRingSize - 1)];
+    e.name = name;
+    e.id = id;
+    e.ts = ts;
+    e.dur = dur;
+    e.phase = phase;
+    if (detail)
+        qstrncpy(e.detail, detail, kDetailSize);
+    else
+        e.detail[0] = '\0';
+    b->head.store(head + 1, std::memory_order_release);
+}
+
+void writeJsonString(QTextStream &out, const char *s)
+{
+    out << '"';
+    for (; *s; ++s) {
+        const char c = *s;
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (uchar(c) >= 0x20)
+            out << c;
+    }
+    out << '"';
+}
+}
+
+namespace Trace {
+
+bool isEnabled()
+{
+    return true;
+}
+
+qint64 nowUs()
+{
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+void complete(const char *name, qint64 startUs, qint64 durationUs)
+{
+    record('X', name, 0, startUs, durationUs, nullptr);
+}
+
+void asyncBegin(const char *name, quint64 id, const char *detail)
+{
+    record('b', name, id, nowUs(), 0, detail);
+}
+
+void asyncEnd(const char *name, quint64 id)
+{
+    record('e', name, id, nowUs(), 0, nullptr);
+}
+
+bool writeChromeJson(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        qWarning() << "Trace: cannot write" << path << file.errorString();
+        return false;
+    }
+
+    QTextStream out(&file);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+
+    QMutexLocker lock(&registryMutex());
+    std::vector<Event> events;
+    for (ThreadBuffer *b : registry()) {
+        const quint64 head = b->head.load(std::memory_order_acquire);
+        const quint64 begin = head > kRingSize ? head - kRingSize : 0;
+        events.clear();
+        for (quint64 i = begin; i < head; ++i)
+            events.push_back(b->events[i & (kRingSize - 1)]);
+
+        // the owner kept recording meanwhile: drop what it overwrote, and
+        // the slot of the event it may be writing right now (index after,
+        // not yet published), which replaces event after - kRingSize
+        const quint64 after = b->head.load(std::memory_order_acquire);
+        const quint64 overwritten = after + 1 > begin + kRingSize ? after + 1 - begin - kRingSize : 0;
+
+        for (size_t i = size_t(qMin<quint64>(overwritten, events.size())); i < events.size(); ++i) {
+            const Event &e = events[i];
+            out << (first ? "" : ",") << "\n{\"name\":";
+            first = false;
+            writeJsonString(out, e.name);
+            out << ",\"ph\":\"" << e.phase << "\",\"ts\":" << e.ts
+                << ",\"pid\":1,\"tid\":" << b->tid;
+            if (e.phase == 'X') {
+                out << ",\"cat\":\"usermanager\",\"dur\":" << e.dur;
+            } else {
+                out << ",\"cat\":\"async\",\"id\":\"0x" << QString::number(e.id, 16) << '"';
+                if (e.detail[0]) {
+                    out << ",\"args\":{\"detail\":";
+                    writeJsonString(out, e.detail);
+                    out << '}';
+                }
+            }
+            out << '}';
+        }
+    }
+    out << "\n]}\n";
+    out.flush();
+    return file.error() == QFile::NoError;
+}
+
+} // namespace Trace
+
+#else
+
+namespace Trace {
+
+bool isEnabled()
+{
+    return false;
+}
+
+bool writeChromeJson(const QString &path)
+{
+    qWarning() << "Trace: not compiled in (USERMANAGER_ENABLE_TRACING=OFF), nothing written to" << path;
+    return false;
+}
+
+} // namespace Trace
+
+#endif
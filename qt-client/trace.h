@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Lightweight event tracing, dumped as Chrome trace JSON (chrome://tracing,
+// ui.perfetto.dev). Compiled in only with -DUSERMANAGER_ENABLE_TRACING=ON;
+// otherwise the UM_TRACE_* macros expand to nothing and their arguments
+// are never evaluated.
+//
+// Every thread records into its own ring buffer (no lock on the hot path,
+// the oldest events are overwritten), names must be string literals.
+namespace Trace {
+
+bool isEnabled();
+
+// snapshot of every thread buffer, false when tracing is compiled out
+bool writeChromeJson(const QString &path);
+
+#ifdef USERMANAGER_TRACING
+qint64 nowUs();
+void complete(const char *name, qint64 startUs, qint64 durationUs);
+void asyncBegin(const char *name, quint64 id, const char *detail = nullptr);
+void asyncEnd(const char *name, quint64 id);
+
+class Scope
+{
+public:
+    explicit Scope(const char *name) : m_name(name), m_start(nowUs()) {}
+    ~Scope() { complete(m_name, m_start, nowUs() - m_start); }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+private:
+    const char *m_name;
+    qint64 m_start;
+};
+#endif
+
+} // namespace Trace
+
+#ifdef USERMANAGER_TRACING
+#define UM_TRACE_CONCAT_(a, b) a##b
+#define UM_TRACE_CONCAT(a, b) UM_TRACE_CONCAT_(a, b)
+// duration of the enclosing block
+#define UM_TRACE_SCOPE(name) Trace::Scope UM_TRACE_CONCAT(umTraceScope_, __LINE__)(name)
+// spans crossing the event loop (network replies etc.), matched by name + id
+#define UM_TRACE_ASYNC_BEGIN(name, id, detail) Trace::asyncBegin(name, quint64(quintptr(id)), detail)
+#define UM_TRACE_ASYNC_END(name, id) Trace::asyncEnd(name, quint64(quintptr(id)))
+#else
+#define UM_TRACE_SCOPE(name) do {} while (0)
+#define UM_TRACE_ASYNC_BEGIN(name, id, detail) do {} while (0)
+#define UM_TRACE_ASYNC_END(name, id) do {} while (0)
+#endif
+
+#endif // TRACE_H
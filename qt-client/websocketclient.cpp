@@ -1,8 +1,10 @@
 #include "websocketclient.h"
+#include "trace.h"
 #include <QDebug>
 #include <QAbstractSocket>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <utility>
 
 WebSocketClient::WebSocketClient(const QUrl &url, QObject *parent)
     : QObject(parent), m_url(url)
@@ -17,11 +19,18 @@ WebSocketClient::WebSocketClient(const QUrl &url, QObject *parent)
     m_reconnectTimer.setInterval(2000);
     m_reconnectTimer.setSingleShot(false);
     connect(&m_reconnectTimer, &QTimer::timeout, this, &WebSocketClient::tryReconnect);
+
+    // sweeps calls past their deadline while any are in flight
+    m_rpcTimer.setInterval(1000);
+    connect(&m_rpcTimer, &QTimer::timeout, this, &WebSocketClient::expireCalls);
+    m_clock.start();
 }
 
 WebSocketClient::~WebSocketClient()
 {
     m_reconnectTimer.stop();
+    // no handler may run into a half-destroyed owner
+    m_calls.clear();
     m_webSocket.close();
 }
 
@@ -30,32 +39,147 @@ void WebSocketClient::start()
     tryReconnect();
 }
 
+bool WebSocketClient::isOnline() const
+{
+    return m_online;
+}
+
+bool WebSocketClient::isRpcReady() const
+{
+    return m_rpcReady && m_webSocket.state() == QAbstractSocket::ConnectedState;
+}
+
+quint64 WebSocketClient::call(const QByteArray &verb, const QString &path, const QByteArray &body, RpcHandler handler)
+{
+    if (!isRpcReady())
+        return 0;
+
+    const quint64 id = m_nextCallId++;
+    QJsonObject frame;
+    frame["rpc"] = double(id);
+    frame["method"] = QString::fromLatin1(verb);
+    frame["path"] = path;
+    if (!body.isEmpty())
+        frame["body"] = QString::fromUtf8(body);
+
+    m_calls.insert(id, { std::move(handler), m_clock.elapsed() + m_rpcTimeoutMs });
+    if (!m_rpcTimer.isActive())
+        m_rpcTimer.start();
+    UM_TRACE_ASYNC_BEGIN("rpc", id, (verb + ' ' + path.toUtf8()).constData());
+    m_webSocket.sendTextMessage(QString::fromUtf8(QJsonDocument(frame).toJson(QJsonDocument::Compact)));
+    return id;
+}
+
+int WebSocketClient::rpcInFlight() const
+{
+    return m_calls.size();
+}
+
+void WebSocketClient::setRpcTimeout(int msec)
+{
+    m_rpcTimeoutMs = qMax(1, msec);
+}
+
+void WebSocketClient::onRpcReply(const QJsonObject &frame)
+{
+    const quint64 id = quint64(frame["rpc"].toDouble());
+    auto it = m_calls.find(id);
+    // timed out already
+    if (it == m_calls.end())
+        return;
+
+    RpcHandler handler = std::move(it->handler);
+    m_calls.erase(it);
+    UM_TRACE_ASYNC_END("rpc", id);
+
+    RpcReply reply;
+    reply.status = frame["status"].toInt();
+    reply.body = frame["body"].toString().toUtf8();
+    reply.retryAfter = frame["retryAfter"].toString().toLatin1();
+    if (reply.status == 0 || reply.status >= 400)
+        reply.error = QStringLiteral("Server replied with status %1").arg(reply.status);
+    handler(reply);
+}
+
+void WebSocketClient::expireCalls()
+{
+    const qint64 now = m_clock.elapsed();
+    QList<RpcHandler> expired;
+    for (auto it = m_calls.begin(); it != m_calls.end();) {
+        if (it->deadline <= now) {
+            expired.append(std::move(it->handler));
+            it = m_calls.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (m_calls.isEmpty())
+        m_rpcTimer.stop();
+
+    RpcReply reply;
+    reply.error = QStringLiteral("RPC timed out");
+    for (const RpcHandler &handler : expired)
+        handler(reply);
+}
+
+void WebSocketClient::failCalls(const QString &error)
+{
+    // handlers may issue new calls (over HTTP by now): detach first
+    const QHash<quint64, PendingCall> calls = std::exchange(m_calls, {});
+    m_rpcTimer.stop();
+
+    RpcReply reply;
+    reply.error = error;
+    for (const PendingCall &pending : calls)
+        pending.handler(reply);
+}
+
 void WebSocketClient::onConnected()
 {
     qDebug() << "WebSocket connected";
+    UM_TRACE_ASYNC_END("ws connect", this);
     m_reconnectTimer.stop();
-    emit serverOnline();
+    if (!m_online) {
+        m_online = true;
+        emit serverOnline();
+    }
 }
 
 void WebSocketClient::onDisconnected()
 {
     qDebug() << "WebSocket disconnected";
-    emit serverOffline();
+    m_rpcReady = false;
+    failCalls(QStringLiteral("WebSocket disconnected"));
+    if (m_online) {
+        m_online = false;
+        emit serverOffline();
+    }
     m_reconnectTimer.start();
 }
 
 void WebSocketClient::onTextMessageReceived(const QString &message)
 {
+    UM_TRACE_SCOPE("WebSocketClient::onTextMessageReceived");
+    QJsonDocument doc = QJsonDocument::fromJson(message.toUtf8());
+    const QJsonObject obj = doc.object();
+
+    // RPC answers go to their caller only (the hello carries "rpc" too)
+    if (obj.contains("rpc") && !obj.contains("event")) {
+        onRpcReply(obj);
+        return;
+    }
+
     qDebug() << "WebSocket message:" << message;
 
     // forward raw message
     emit textMessageReceivedSignal(message);
 
-    // also parse simple event
-    QJsonDocument doc = QJsonDocument::fromJson(message.toUtf8());
-    if (doc.isObject()) {
-        QJsonObject obj = doc.object();
-        if (obj.contains("event") && obj["event"].toString() == "serverOnline") {
+    if (obj.contains("event") && obj["event"].toString() == "serverOnline") {
+        // servers without RPC leave it out of the hello
+        m_rpcReady = obj["rpc"].toInt() >= 1;
+        // usually right after onConnected(): only report transitions
+        if (!m_online) {
+            m_online = true;
             emit serverOnline();
         }
     }
@@ -66,6 +190,7 @@ void WebSocketClient::tryReconnect()
     if (m_webSocket.state() != QAbstractSocket::ConnectedState)
     {
         qDebug() << "Trying to connect to WebSocket server at" << m_url;
+        UM_TRACE_ASYNC_BEGIN("ws connect", this, m_url.toString().toUtf8().constData());
         m_webSocket.open(m_url);
         m_reconnectTimer.start();
     }
@@ -75,5 +200,11 @@ void WebSocketClient::onError(QAbstractSocket::SocketError error)
 {
     Q_UNUSED(error);
     qWarning() << "WebSocket error:" << m_webSocket.errorString();
-    emit serverOffline();
+    UM_TRACE_ASYNC_END("ws connect", this);
+    m_rpcReady = false;
+    failCalls(QStringLiteral("WebSocket error: ") + m_webSocket.errorString());
+    if (m_online) {
+        m_online = false;
+        emit serverOffline();
+    }
 }
@@ -2,8 +2,13 @@
 #define WEBSOCKETCLIENT_H
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QWebSocket>
 #include <QTimer>
+#include <functional>
+
+class QJsonObject;
 
 class WebSocketClient : public QObject
 {
@@ -13,6 +18,29 @@ public:
     ~WebSocketClient();
 
     void start();
+    bool isOnline() const;
+
+    // Request/response RPC on the same socket: every call carries a
+    // correlation id, any number can be in flight and answers come back in
+    // whatever order the server finishes them. Frames are
+    //   -> { rpc, method, path, body }   <- { rpc, status, body, retryAfter }
+    // with the REST verb, path and JSON body as text.
+    struct RpcReply
+    {
+        int status = 0;         // HTTP status, 0 = no answer
+        QByteArray body;
+        QByteArray retryAfter;
+        QString error;          // empty on success
+    };
+    using RpcHandler = std::function<void(const RpcReply &reply)>;
+
+    // connected and the server announced RPC in its hello
+    bool isRpcReady() const;
+    // id of the call, 0 (handler never called) when not ready
+    quint64 call(const QByteArray &verb, const QString &path, const QByteArray &body, RpcHandler handler);
+    int rpcInFlight() const;
+    // calls without an answer after this fail with status 0
+    void setRpcTimeout(int msec);
 
 signals:
     void serverOnline();
@@ -27,9 +55,27 @@ private slots:
     void onError(QAbstractSocket::SocketError error);
 
 private:
+    void onRpcReply(const QJsonObject &frame);
+    void expireCalls();
+    void failCalls(const QString &error);
+
+    struct PendingCall
+    {
+        RpcHandler handler;
+        qint64 deadline;
+    };
+
     QWebSocket m_webSocket;
     QUrl m_url;
     QTimer m_reconnectTimer;
+    bool m_online = false;
+
+    bool m_rpcReady = false;
+    quint64 m_nextCallId = 1;
+    QHash<quint64, PendingCall> m_calls;
+    QTimer m_rpcTimer;
+    QElapsedTimer m_clock;
+    int m_rpcTimeoutMs = 30000;
 };
 
 #endif // WEBSOCKETCLIENT_H